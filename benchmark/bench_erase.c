@@ -0,0 +1,107 @@
+/*
+ * Benchmark of 4 KB sector erases against 64 KB block erases
+ *
+ * Measures erasing one 64 KB run sector by sector and with one block erase,
+ * and the time to format, fill and rebuild the mimic cache with and without
+ * the bulk erase before lfs_format().
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include <bsp/board.h>
+#include <hardware/flash.h>
+#include <tusb.h>
+#include "littlefs_driver.h"
+#include "mimic_fat.h"
+
+#define NUM_FILES  32
+#define FILE_SIZE  8192
+
+static lfs_t fs;
+static uint8_t buffer[512];
+
+
+static lfs_block_t first_aligned_block(void) {
+    const struct lfs_config *c = &lfs_pico_flash_config;
+    uint32_t base = PICO_FLASH_SIZE_BYTES - c->block_count * c->block_size;
+    uint32_t sectors_per_block = FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE;
+    uint32_t sector = base / FLASH_SECTOR_SIZE;
+    return (sectors_per_block - sector % sectors_per_block) % sectors_per_block;
+}
+
+static void bench_erase_run(void) {
+    const struct lfs_config *c = &lfs_pico_flash_config;
+    lfs_block_t block = first_aligned_block();
+    uint32_t sectors_per_block = FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE;
+
+    uint64_t start_at = time_us_64();
+    for (uint32_t i = 0; i < sectors_per_block; i++)
+        c->erase(c, block + i);
+    uint64_t sector_us = time_us_64() - start_at;
+
+    start_at = time_us_64();
+    littlefs_bulk_erase(block, sectors_per_block);
+    uint64_t block_us = time_us_64() - start_at;
+    for (uint32_t i = 0; i < sectors_per_block; i++)
+        c->erase(c, block + i);  // drain the pool
+
+    printf("64 KB by sector erase %8llu us\n", sector_us);
+    printf("64 KB by block erase  %8llu us\n", block_us);
+}
+
+static void bench_format(bool is_bulk) {
+    littlefs_erase_stats_t before, after;
+    littlefs_erase_stats(&before);
+
+    uint64_t start_at = time_us_64();
+    if (is_bulk)
+        littlefs_bulk_erase(0, lfs_pico_flash_config.block_count);
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    uint64_t format_us = time_us_64() - start_at;
+
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    start_at = time_us_64();
+    for (int i = 0; i < NUM_FILES; i++) {
+        char path[LFS_NAME_MAX + 1];
+        snprintf(path, sizeof(path), "FILE%02d.BIN", i);
+        lfs_file_t file;
+        err = lfs_file_open(&fs, &file, path, LFS_O_WRONLY | LFS_O_CREAT);
+        assert(err == 0);
+        for (size_t size = 0; size < FILE_SIZE; size += sizeof(buffer))
+            lfs_file_write(&fs, &file, buffer, sizeof(buffer));
+        lfs_file_close(&fs, &file);
+    }
+    uint64_t fill_us = time_us_64() - start_at;
+    lfs_unmount(&fs);
+
+    start_at = time_us_64();
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+    uint64_t cache_us = time_us_64() - start_at;
+    mimic_fat_cleanup_cache();
+
+    littlefs_erase_stats(&after);
+    printf("%s\n", is_bulk ? "bulk erase and format" : "format");
+    printf("  format              %8llu us\n", format_us);
+    printf("  write %d files      %8llu us\n", NUM_FILES, fill_us);
+    printf("  create cache        %8llu us\n", cache_us);
+    printf("  erase hits/misses   %4lu/%lu\n", after.hits - before.hits, after.misses - before.misses);
+    printf("  erase exposed       %8llu us\n", after.exposed_us - before.exposed_us);
+}
+
+int main(void) {
+    board_init();
+    tud_init(BOARD_TUD_RHPORT);
+    stdio_init_all();
+
+    printf("Start benchmark, erase\n");
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (uint8_t)i;
+
+    bench_erase_run();
+    bench_format(false);
+    bench_format(true);
+}
@@ -0,0 +1,90 @@
+/*
+ * Benchmark of littlefs reads through the uncached and the cached XIP alias
+ *
+ * The same image is measured by each build of this program; the XIP mode is
+ * selected by LITTLEFS_XIP_CACHED when littlefs_driver.c is compiled.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include <bsp/board.h>
+#include <tusb.h>
+#include "mimic_fat.h"
+
+#define NUM_DIRECTORIES  4
+#define NUM_FILES        16
+#define FILE_SIZE        2048
+#define READ_REPEAT      8
+
+extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
+
+static lfs_t fs;
+static uint8_t buffer[DISK_SECTOR_SIZE];
+
+
+static void create_image(void) {
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (uint8_t)i;
+    for (int d = 0; d < NUM_DIRECTORIES; d++) {
+        char path[LFS_NAME_MAX + 1];
+        snprintf(path, sizeof(path), "DIR%d", d);
+        err = lfs_mkdir(&fs, path);
+        assert(err == 0);
+        for (int f = 0; f < NUM_FILES; f++) {
+            snprintf(path, sizeof(path), "DIR%d/FILE%02d.BIN", d, f);
+            lfs_file_t file;
+            err = lfs_file_open(&fs, &file, path, LFS_O_WRONLY | LFS_O_CREAT);
+            assert(err == 0);
+            for (size_t size = 0; size < FILE_SIZE; size += sizeof(buffer))
+                lfs_file_write(&fs, &file, buffer, sizeof(buffer));
+            lfs_file_close(&fs, &file);
+        }
+    }
+    lfs_unmount(&fs);
+}
+
+int main(void) {
+    board_init();
+    tud_init(BOARD_TUD_RHPORT);
+    stdio_init_all();
+
+    printf("Start benchmark, XIP %s\n", LITTLEFS_XIP_CACHED ? "cached" : "uncached");
+    create_image();
+
+    uint64_t start_at = time_us_64();
+    int err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    uint64_t mount_us = time_us_64() - start_at;
+    lfs_unmount(&fs);
+
+    start_at = time_us_64();
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+    uint64_t create_cache_us = time_us_64() - start_at;
+
+    uint32_t num_sectors = 0;
+    uint32_t max_us = 0;
+    start_at = time_us_64();
+    for (int r = 0; r < READ_REPEAT; r++) {
+        for (uint32_t sector = 0; sector < mimic_fat_total_sector_size(); sector++) {
+            uint64_t read_at = time_us_64();
+            mimic_fat_read(0, sector, buffer, sizeof(buffer));
+            uint32_t us = time_us_64() - read_at;
+            if (us > max_us)
+                max_us = us;
+            num_sectors++;
+        }
+    }
+    uint64_t read_us = time_us_64() - start_at;
+
+    printf("lfs_mount           %8llu us\n", mount_us);
+    printf("create_dir_entry    %8llu us\n", create_cache_us);
+    printf("sector read average %8.1f us\n", (double)read_us / num_sectors);
+    printf("sector read max     %8lu us\n", max_us);
+}
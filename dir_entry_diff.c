@@ -0,0 +1,249 @@
+/*
+ * Keyed difference of FAT directory entries
+ *
+ * Both directory images are parsed into logical entries, a short filename entry
+ * together with its long filename chain, and the old entries are indexed by name
+ * and by first cluster. Each new entry is then looked up in constant time, so the
+ * difference is found in time linear to the number of entries.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "dir_entry_diff.h"
+
+#define HASH_TABLE_SIZE    (DIR_ENTRY_DIFF_MAX_ENTRIES * 2 + 1)
+#define FNV_OFFSET_BASIS   2166136261u
+#define FNV_PRIME          16777619u
+
+typedef struct {
+    const fat_dir_entry_t *entry;  // short filename entry
+    uint32_t name_hash;
+    bool is_matched;
+} logical_entry_t;
+
+static logical_entry_t orig_entry[DIR_ENTRY_DIFF_MAX_ENTRIES];
+static logical_entry_t new_entry[DIR_ENTRY_DIFF_MAX_ENTRIES];
+// Index + 1 of orig_entry, 0 for an empty slot
+static uint16_t name_index[HASH_TABLE_SIZE];
+static uint16_t cluster_index[HASH_TABLE_SIZE];
+
+
+static uint32_t hash_bytes(uint32_t hash, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint8_t short_filename_check_sum(const uint8_t *filename) {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++) {
+        sum = (sum >> 1) + (sum << 7) + filename[i];
+    }
+    return sum;
+}
+
+/*
+ * Hash of one long filename entry. Entries of a chain are combined with XOR,
+ * and the order is part of the hash, so the chain may be read in any order.
+ */
+static uint32_t hash_long_filename_entry(const fat_lfn_t *lfn) {
+    uint8_t order = lfn->LDIR_Ord & 0x1F;
+    uint32_t hash = hash_bytes(FNV_OFFSET_BASIS, &order, 1);
+    hash = hash_bytes(hash, lfn->LDIR_Name1, sizeof(lfn->LDIR_Name1));
+    hash = hash_bytes(hash, lfn->LDIR_Name2, sizeof(lfn->LDIR_Name2));
+    return hash_bytes(hash, lfn->LDIR_Name3, sizeof(lfn->LDIR_Name3));
+}
+
+static bool is_dot_entry(const fat_dir_entry_t *dir) {
+    return memcmp(dir->DIR_Name, ".          ", 11) == 0
+        || memcmp(dir->DIR_Name, "..         ", 11) == 0;
+}
+
+/*
+ * Group the long filename chain and the short filename entry of each file or directory
+ *
+ * A long filename is used as the name only if the chain is complete and its checksum
+ * matches the short filename. Deleted entries, the volume label and `.`/`..` are skipped.
+ */
+static size_t parse_dir_entry(const fat_dir_entry_t *dir, size_t num, logical_entry_t *result) {
+    size_t count = 0;
+    uint32_t long_filename_hash = 0;
+    uint8_t long_filename_check_sum = 0;
+    int next_order = 0;  // expected order of the next long filename entry, 0 if none
+
+    for (size_t i = 0; i < num; i++) {
+        const fat_dir_entry_t *entry = &dir[i];
+        if (entry->DIR_Name[0] == '\0')
+            break;
+        if (entry->DIR_Name[0] == 0xE5) {
+            long_filename_hash = 0;
+            next_order = 0;
+            continue;
+        }
+
+        if ((entry->DIR_Attr & 0x0F) == 0x0F) {
+            const fat_lfn_t *lfn = (const fat_lfn_t *)entry;
+            int order = lfn->LDIR_Ord & 0x1F;
+            if (lfn->LDIR_Ord & 0x40) {
+                long_filename_hash = 0;
+                long_filename_check_sum = lfn->LDIR_Chksum;
+            } else if (order != next_order || lfn->LDIR_Chksum != long_filename_check_sum) {
+                long_filename_hash = 0;  // broken chain
+                next_order = 0;
+                continue;
+            }
+            long_filename_hash ^= hash_long_filename_entry(lfn);
+            next_order = order - 1;
+            continue;
+        }
+
+        bool has_long_filename = (next_order == 0 && long_filename_hash != 0
+                                  && short_filename_check_sum(entry->DIR_Name) == long_filename_check_sum);
+        uint32_t hash = long_filename_hash;
+        long_filename_hash = 0;
+        next_order = 0;
+
+        if ((entry->DIR_Attr & 0x08) || is_dot_entry(entry))  // volume label, `.` or `..`
+            continue;
+
+        result[count].entry = entry;
+        result[count].name_hash = has_long_filename ? hash : hash_bytes(FNV_OFFSET_BASIS, entry->DIR_Name, 11);
+        result[count].is_matched = false;
+        count++;
+    }
+    return count;
+}
+
+static bool is_directory(const fat_dir_entry_t *dir) {
+    return (dir->DIR_Attr & 0x10) ? true : false;
+}
+
+static void insert_index(uint16_t *index, uint32_t hash, size_t i) {
+    size_t slot = hash % HASH_TABLE_SIZE;
+    while (index[slot] != 0)
+        slot = (slot + 1) % HASH_TABLE_SIZE;
+    index[slot] = i + 1;
+}
+
+static bool is_same_name(const logical_entry_t *a, const logical_entry_t *b) {
+    return a->name_hash == b->name_hash
+        && memcmp(a->entry->DIR_Name, b->entry->DIR_Name, 11) == 0;
+}
+
+static logical_entry_t *find_by_name(const logical_entry_t *target) {
+    for (size_t slot = target->name_hash % HASH_TABLE_SIZE; name_index[slot] != 0; slot = (slot + 1) % HASH_TABLE_SIZE) {
+        logical_entry_t *entry = &orig_entry[name_index[slot] - 1];
+        if (!entry->is_matched
+            && is_same_name(entry, target)
+            && is_directory(entry->entry) == is_directory(target->entry))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t hash_cluster(uint32_t cluster) {
+    return cluster * 2654435761u;
+}
+
+static logical_entry_t *find_by_cluster(const logical_entry_t *target) {
+    uint32_t cluster = target->entry->DIR_FstClusLO;
+    for (size_t slot = hash_cluster(cluster) % HASH_TABLE_SIZE; cluster_index[slot] != 0; slot = (slot + 1) % HASH_TABLE_SIZE) {
+        logical_entry_t *entry = &orig_entry[cluster_index[slot] - 1];
+        if (!entry->is_matched
+            && entry->entry->DIR_FstClusLO == cluster
+            && is_directory(entry->entry) == is_directory(target->entry))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static size_t append_diff(dir_entry_diff_t *result, size_t result_size, size_t count,
+                          dir_entry_diff_type_t type, const fat_dir_entry_t *orig, const fat_dir_entry_t *new)
+{
+    if (count < result_size) {
+        result[count].type = type;
+        result[count].orig = orig;
+        result[count].new = new;
+    }
+    return count + 1;
+}
+
+/*
+ * Find the changes from the orig directory image to the new directory image
+ *
+ * Entries with a first cluster are paired by cluster first, since the cluster
+ * identifies the data: a file renamed away and replaced by a new file of the same
+ * name, or two files that swapped names, are renames. The remaining entries are
+ * paired by name. Up to result_size changes are stored in *result; the return value
+ * is the number of changes found. A result of 2 * num entries is always large enough.
+ */
+size_t dir_entry_diff(const fat_dir_entry_t *orig, const fat_dir_entry_t *new, size_t num,
+                      dir_entry_diff_t *result, size_t result_size)
+{
+    if (num > DIR_ENTRY_DIFF_MAX_ENTRIES)
+        num = DIR_ENTRY_DIFF_MAX_ENTRIES;
+
+    size_t orig_num = parse_dir_entry(orig, num, orig_entry);
+    size_t new_num = parse_dir_entry(new, num, new_entry);
+
+    memset(name_index, 0, sizeof(name_index));
+    memset(cluster_index, 0, sizeof(cluster_index));
+    for (size_t i = 0; i < orig_num; i++) {
+        insert_index(name_index, orig_entry[i].name_hash, i);
+        if (orig_entry[i].entry->DIR_FstClusLO != 0)
+            insert_index(cluster_index, hash_cluster(orig_entry[i].entry->DIR_FstClusLO), i);
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < new_num; i++) {
+        if (new_entry[i].entry->DIR_FstClusLO == 0)
+            continue;
+        logical_entry_t *entry = find_by_cluster(&new_entry[i]);
+        if (entry == NULL)
+            continue;
+
+        const fat_dir_entry_t *a = entry->entry;
+        const fat_dir_entry_t *b = new_entry[i].entry;
+        entry->is_matched = true;
+        new_entry[i].is_matched = true;
+        if (!is_same_name(entry, &new_entry[i]))
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_RENAME, a, b);
+        else if (a->DIR_FileSize != b->DIR_FileSize)
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_RESIZE, a, b);
+        else if (a->DIR_Attr != b->DIR_Attr)
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_ATTR, a, b);
+    }
+
+    for (size_t i = 0; i < new_num; i++) {
+        if (new_entry[i].is_matched)
+            continue;
+
+        logical_entry_t *entry = find_by_name(&new_entry[i]);
+        if (entry == NULL) {
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_CREATE, NULL, new_entry[i].entry);
+            continue;
+        }
+
+        const fat_dir_entry_t *a = entry->entry;
+        const fat_dir_entry_t *b = new_entry[i].entry;
+        entry->is_matched = true;
+        new_entry[i].is_matched = true;
+        if (a->DIR_FstClusLO != b->DIR_FstClusLO || a->DIR_FileSize != b->DIR_FileSize)
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_RESIZE, a, b);
+        else if (a->DIR_Attr != b->DIR_Attr)
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_ATTR, a, b);
+    }
+
+    for (size_t i = 0; i < orig_num; i++) {
+        if (!orig_entry[i].is_matched)
+            count = append_diff(result, result_size, count, DIR_ENTRY_DIFF_DELETE, orig_entry[i].entry, NULL);
+    }
+    return count;
+}
@@ -0,0 +1,91 @@
+/*
+ * Flash reads through the XIP streaming interface and DMA
+ *
+ * Reads of FLASH_DMA_THRESHOLD bytes or more are split into an unaligned head,
+ * a word aligned body and an unaligned tail. The body is fetched by the XIP
+ * stream engine and moved to RAM by a DMA channel, so the flash is read in
+ * back-to-back bursts instead of one stalled uncached XIP access per word. The
+ * head and the tail, and reads whose source and destination cannot both be
+ * word aligned, are copied with memcpy.
+ *
+ * The CPU waits for the transfer: littlefs needs the data when the read callback
+ * returns, so there is nothing to overlap it with. The gain over memcpy comes
+ * from the streaming alone, see benchmark/bench_flash_dma.c.
+ *
+ * On the host there is no stream engine and the body is copied with memcpy,
+ * so the splitting can be tested off the device.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "flash_dma.h"
+
+#if PICO_ON_DEVICE
+#include <hardware/dma.h>
+#include <hardware/regs/addressmap.h>
+#include <hardware/structs/xip_ctrl.h>
+#endif
+
+static flash_dma_stats_t stats = {0};
+
+
+#if PICO_ON_DEVICE
+static int dma_channel = -1;
+
+static void stream_read(const uint32_t *src, uint32_t *dst, size_t words) {
+    if (dma_channel < 0)
+        dma_channel = dma_claim_unused_channel(true);
+
+    // Drain the stream FIFO left over from an aborted transfer
+    while (!(xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY))
+        (void)xip_ctrl_hw->stream_fifo;
+    xip_ctrl_hw->stream_addr = (uint32_t)src;
+    xip_ctrl_hw->stream_ctr = words;
+
+    dma_channel_config config = dma_channel_get_default_config(dma_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, DREQ_XIP_STREAM);
+    dma_channel_configure(dma_channel, &config, dst, (const void *)XIP_AUX_BASE, words, true);
+    dma_channel_wait_for_finish_blocking(dma_channel);  // the caller needs the data now
+}
+#else
+static void stream_read(const uint32_t *src, uint32_t *dst, size_t words) {
+    memcpy(dst, src, words * sizeof(uint32_t));
+}
+#endif
+
+static void copy_read(const uint8_t *src, uint8_t *dst, size_t size) {
+    memcpy(dst, src, size);
+    stats.memcpy_bytes += size;
+}
+
+void flash_dma_read(const void *xip_addr, void *buffer, size_t size) {
+    const uint8_t *src = xip_addr;
+    uint8_t *dst = buffer;
+
+    if (size < FLASH_DMA_THRESHOLD || ((uintptr_t)src & 0x3) != ((uintptr_t)dst & 0x3)) {
+        copy_read(src, dst, size);
+        return;
+    }
+
+    size_t head = (4 - ((uintptr_t)src & 0x3)) & 0x3;
+    copy_read(src, dst, head);
+    src += head;
+    dst += head;
+    size -= head;
+
+    size_t words = size / sizeof(uint32_t);
+    stream_read((const uint32_t *)src, (uint32_t *)dst, words);
+    stats.dma_bytes += words * sizeof(uint32_t);
+    src += words * sizeof(uint32_t);
+    dst += words * sizeof(uint32_t);
+    size -= words * sizeof(uint32_t);
+
+    copy_read(src, dst, size);
+}
+
+void flash_dma_stats(flash_dma_stats_t *result) {
+    *result = stats;
+}
@@ -0,0 +1,232 @@
+/*
+ * Benchmark of dir_entry_diff() on directories of 1 to 1000 entries
+ *
+ * The difference_of_dir_entry() that the mimic used before the keyed difference
+ * is measured alongside for reference.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "dir_entry_diff.h"
+
+#define MAX_ENTRIES  1000
+#define MIN_DURATION_US  (200 * 1000)
+
+typedef enum {
+    SCENARIO_UNCHANGED = 0,
+    SCENARIO_RENAME_ONE,
+    SCENARIO_RENAME_ALL,
+    SCENARIO_REPLACE_HALF,
+} scenario_t;
+
+static const char *scenario_name[] = {
+    "unchanged",
+    "rename one",
+    "rename all",
+    "replace half",
+};
+
+static fat_dir_entry_t orig[MAX_ENTRIES + 1];
+static fat_dir_entry_t new[MAX_ENTRIES + 1];
+static dir_entry_diff_t diff[MAX_ENTRIES * 2];
+
+
+static void set_entry(fat_dir_entry_t *entry, char prefix, size_t i, uint16_t cluster) {
+    char name[12];
+    snprintf(name, sizeof(name), "%c%07zuTXT", prefix, i);
+    memset(entry, 0, sizeof(fat_dir_entry_t));
+    memcpy(entry->DIR_Name, name, 11);
+    entry->DIR_Attr = 0x20;
+    entry->DIR_FstClusLO = cluster;
+    entry->DIR_FileSize = 100;
+}
+
+static void setup(size_t num, scenario_t scenario) {
+    memset(orig, 0, sizeof(orig));
+    memset(new, 0, sizeof(new));
+    for (size_t i = 0; i < num; i++) {
+        set_entry(&orig[i], 'F', i, 2 + i);
+        set_entry(&new[i], 'F', i, 2 + i);
+    }
+
+    switch (scenario) {
+    case SCENARIO_UNCHANGED:
+        break;
+    case SCENARIO_RENAME_ONE:
+        set_entry(&new[num / 2], 'R', num / 2, 2 + num / 2);
+        break;
+    case SCENARIO_RENAME_ALL:
+        for (size_t i = 0; i < num; i++)
+            set_entry(&new[i], 'R', i, 2 + i);
+        break;
+    case SCENARIO_REPLACE_HALF:
+        for (size_t i = 0; i < num; i += 2)
+            set_entry(&new[i], 'N', i, 2 + num + i);
+        break;
+    }
+}
+
+/*
+ * The difference of the mimic before the keyed difference
+ *
+ * A copy of difference_of_dir_entry() and the pairing of find_renamed_dir_entry()
+ * from mimic_fat.c, widened from 16 to num entries. Each new entry is compared with
+ * every old entry, then the deleted and added entries are paired as renames.
+ */
+static fat_dir_entry_t update[MAX_ENTRIES + 1];
+static fat_dir_entry_t delete[MAX_ENTRIES + 1];
+
+static void remove_dir_entry_at(fat_dir_entry_t *src, size_t index, size_t num) {
+    memmove(&src[index], &src[index + 1], sizeof(fat_dir_entry_t) * (num - index - 1));
+    memset(&src[num - 1], 0, sizeof(fat_dir_entry_t));
+}
+
+static void legacy_difference_of_dir_entry(fat_dir_entry_t *orig, fat_dir_entry_t *new, size_t num,
+                                           fat_dir_entry_t *update, fat_dir_entry_t *delete)
+{
+    bool is_found = false;
+
+    if (memcmp(orig, new, sizeof(fat_dir_entry_t) * num) == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        if (strncmp((const char *)new[i].DIR_Name, ".          ", 11) == 0
+            || strncmp((const char *)new[i].DIR_Name, "..         ", 11) == 0
+            || (new[i].DIR_Attr & 0x0F) == 0x0F
+            || (new[i].DIR_Attr & 0x08) == 0x08) // volume label
+        {
+            continue;
+        }
+
+        if (new[i].DIR_Name[0] == 0xE5) {
+            for (size_t j = 0; j < num; j++) {
+                if ((orig[j].DIR_Attr & 0x08) == 0x08) // volume label
+                    continue;
+                if (new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO
+                    && new[i].DIR_FileSize == orig[j].DIR_FileSize
+                    && orig[j].DIR_Name[0] != 0xE5
+                    && new[i].DIR_FileSize != 0)
+                {
+                    memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
+                    delete++;
+                    break;
+                }
+
+                if (orig[j].DIR_Attr & 0x10  // directory
+                    && new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO
+                    && new[i].DIR_FileSize == 0
+                    && orig[j].DIR_Name[0] != 0xE5
+                    && i == j)
+                {
+                    memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
+                    delete++;
+                    break;
+                }
+            }
+            continue;
+        }
+
+        is_found = false;
+        for (size_t j = 0; j < num; j++) {
+            if (new[i].DIR_Name[0] == 0xE5
+               || strncmp((const char *)orig[j].DIR_Name, ".          ", 11) == 0
+               || strncmp((const char *)orig[j].DIR_Name, "..         ", 11) == 0
+               || (orig[j].DIR_Attr & 0x0F) == 0x0F
+               || (orig[j].DIR_Attr & 0x08) == 0x08)  // volume label
+            {
+                continue;
+            }
+
+            if (strncmp((const char *)new[i].DIR_Name, (const char *)orig[j].DIR_Name, 11) == 0 &&
+                new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO &&
+                new[i].DIR_FileSize == orig[j].DIR_FileSize)
+            {
+                is_found = true;
+                break;
+            }
+
+            // rename
+            if (i == j &&
+                new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO &&
+                new[i].DIR_FileSize == orig[j].DIR_FileSize)
+            {
+                memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
+                delete++;
+                break;
+            }
+        }
+        if (!is_found) {
+            memcpy(update, &new[i], sizeof(fat_dir_entry_t));
+            update++;
+        }
+    }
+}
+
+static size_t legacy_diff(fat_dir_entry_t *a, fat_dir_entry_t *b, size_t num) {
+    memset(update, 0, sizeof(fat_dir_entry_t) * (num + 1));
+    memset(delete, 0, sizeof(fat_dir_entry_t) * (num + 1));
+    legacy_difference_of_dir_entry(a, b, num, update, delete);
+
+    size_t count = 0;
+    for (size_t i = 0; i < num && delete[i].DIR_Name[0] != '\0'; ) {
+        fat_dir_entry_t *dir = &delete[i];
+        size_t j = 0;
+        for (; j < num && update[j].DIR_Name[0] != '\0'; j++) {
+            if (dir->DIR_FstClusLO != 0
+                && update[j].DIR_FstClusLO == dir->DIR_FstClusLO
+                && update[j].DIR_FileSize == dir->DIR_FileSize
+                && (update[j].DIR_Attr & 0x10) == (dir->DIR_Attr & 0x10))
+            {
+                break;
+            }
+        }
+        if (j == num || update[j].DIR_Name[0] == '\0') {
+            i++;
+            continue;
+        }
+
+        count++;
+        remove_dir_entry_at(update, j, num + 1);
+        remove_dir_entry_at(delete, i, num + 1);
+    }
+    for (size_t i = 0; i < num && update[i].DIR_Name[0] != '\0'; i++)
+        count++;
+    for (size_t i = 0; i < num && delete[i].DIR_Name[0] != '\0'; i++)
+        count++;
+    return count;
+}
+
+static double measure(size_t num, bool is_keyed, size_t *result) {
+    size_t iterations = 0;
+    uint64_t start_at = time_us_64();
+    uint64_t elapsed;
+    do {
+        if (is_keyed)
+            *result = dir_entry_diff(orig, new, num, diff, sizeof(diff) / sizeof(diff[0]));
+        else
+            *result = legacy_diff(orig, new, num);
+        iterations++;
+        elapsed = time_us_64() - start_at;
+    } while (elapsed < MIN_DURATION_US);
+    return (double)elapsed / iterations;
+}
+
+int main(void) {
+    const size_t sizes[] = {1, 10, 16, 100, 1000};
+
+    printf("%-13s %7s %8s %14s %14s\n", "scenario", "entries", "changes", "keyed [us]", "legacy [us]");
+    for (int scenario = SCENARIO_UNCHANGED; scenario <= SCENARIO_REPLACE_HALF; scenario++) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            size_t num = sizes[i];
+            size_t changes;
+            size_t legacy_changes;
+            setup(num, scenario);
+            double keyed_us = measure(num, true, &changes);
+            double legacy_us = measure(num, false, &legacy_changes);
+            printf("%-13s %7zu %8zu %14.3f %14.3f\n",
+                   scenario_name[scenario], num, changes, keyed_us, legacy_us);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Sweep of littlefs geometry parameters over the mimic workload
+ *
+ * littlefs runs on a RAM emulation of the Pico on-board flash, which counts
+ * the operations and converts them to flash time with the typical timing of
+ * the W25Q16JV. The named profiles of littlefs_profile.h are measured first,
+ * then a matrix of read_size, cache_size, lookahead_size and block_cycles.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include <tusb.h>
+#include "mimic_fat.h"
+#include "littlefs_profile.h"
+
+#define READ_OVERHEAD_NS     1000   // command and address
+#define READ_BYTE_NS         40     // about 25 MB/s through the uncached XIP alias
+#define PROG_PAGE_US         400
+#define ERASE_SECTOR_US      45000
+
+#define NUM_DIRECTORIES      4
+#define NUM_SMALL_FILES      12     // per directory, within the 16 entries of a directory cluster
+#define SMALL_FILE_SIZE      100
+#define LARGE_FILE_SIZE      (128 * 1024)
+
+typedef enum {
+    PHASE_SMALL_FILES = 0,
+    PHASE_SEQUENTIAL_WRITE,
+    PHASE_MOUNT,
+    PHASE_CACHE_BUILD,
+    PHASE_SEQUENTIAL_READ,
+    PHASE_NUM,
+} phase_t;
+
+static const char *phase_name[] = {"small", "write", "mount", "cache", "read"};
+
+typedef struct {
+    uint64_t flash_us;
+    uint32_t erases;
+} phase_result_t;
+
+static uint8_t flash[LITTLEFS_BLOCK_COUNT * LITTLEFS_BLOCK_SIZE];
+static uint64_t flash_ns = 0;
+static uint32_t erase_total = 0;
+static uint32_t max_block_erases = 0;
+static uint32_t block_erases[LITTLEFS_BLOCK_COUNT];
+static uint8_t buffer[CFG_TUD_MSC_EP_BUFSIZE];
+
+
+static int emulated_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *data, lfs_size_t size) {
+    memcpy(data, &flash[block * c->block_size + off], size);
+    flash_ns += READ_OVERHEAD_NS + (uint64_t)size * READ_BYTE_NS;
+    return 0;
+}
+
+static int emulated_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *data, lfs_size_t size) {
+    const uint8_t *p = data;
+    uint8_t *dst = &flash[block * c->block_size + off];
+    for (lfs_size_t i = 0; i < size; i++) {
+        if ((dst[i] & p[i]) != p[i]) {
+            printf("emulated_prog: block=%u offset=%u is not erased\n", block, off + i);
+            return LFS_ERR_IO;
+        }
+        dst[i] = p[i];
+    }
+    flash_ns += (uint64_t)((size + LITTLEFS_FLASH_PAGE_SIZE - 1) / LITTLEFS_FLASH_PAGE_SIZE) * PROG_PAGE_US * 1000;
+    return 0;
+}
+
+static int emulated_erase(const struct lfs_config *c, lfs_block_t block) {
+    memset(&flash[block * c->block_size], 0xFF, c->block_size);
+    flash_ns += (uint64_t)ERASE_SECTOR_US * 1000;
+    erase_total++;
+    block_erases[block]++;
+    if (block_erases[block] > max_block_erases)
+        max_block_erases = block_erases[block];
+    return 0;
+}
+
+static int emulated_sync(const struct lfs_config *c) {
+    (void)c;
+    return 0;
+}
+
+static void begin_phase(void) {
+    flash_ns = 0;
+    erase_total = 0;
+}
+
+static void end_phase(phase_result_t *result) {
+    result->flash_us = flash_ns / 1000;
+    result->erases = erase_total;
+}
+
+static void write_file(lfs_t *fs, const char *path, size_t size) {
+    lfs_file_t f;
+    int err = lfs_file_open(fs, &f, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    assert(err == 0);
+    for (size_t offset = 0; offset < size; offset += DISK_SECTOR_SIZE) {
+        size_t n = (size - offset < DISK_SECTOR_SIZE) ? size - offset : DISK_SECTOR_SIZE;
+        lfs_ssize_t s = lfs_file_write(fs, &f, buffer, n);
+        assert(s == (lfs_ssize_t)n);
+    }
+    lfs_file_close(fs, &f);
+}
+
+/*
+ * Run the mimic workload, and return the RAM used by littlefs buffers
+ */
+static size_t run_workload(struct lfs_config *c, phase_result_t *result) {
+    lfs_t fs;
+
+    memset(flash, 0xFF, sizeof(flash));
+    memset(block_erases, 0, sizeof(block_erases));
+    max_block_erases = 0;
+    int err = lfs_format(&fs, c);
+    assert(err == 0);
+    err = lfs_mount(&fs, c);
+    assert(err == 0);
+
+    begin_phase();
+    for (int d = 0; d < NUM_DIRECTORIES; d++) {
+        char path[LFS_NAME_MAX + 1];
+        snprintf(path, sizeof(path), "DIR%d", d);
+        err = lfs_mkdir(&fs, path);
+        assert(err == 0);
+        for (int f = 0; f < NUM_SMALL_FILES; f++) {
+            snprintf(path, sizeof(path), "DIR%d/SMALL%02d.TXT", d, f);
+            write_file(&fs, path, SMALL_FILE_SIZE);
+        }
+    }
+    end_phase(&result[PHASE_SMALL_FILES]);
+
+    begin_phase();
+    write_file(&fs, "LARGE.BIN", LARGE_FILE_SIZE);
+    end_phase(&result[PHASE_SEQUENTIAL_WRITE]);
+    lfs_unmount(&fs);
+
+    begin_phase();
+    err = lfs_mount(&fs, c);
+    assert(err == 0);
+    end_phase(&result[PHASE_MOUNT]);
+    lfs_unmount(&fs);
+
+    begin_phase();
+    err = mimic_fat_init(c);
+    assert(err == 0);
+    mimic_fat_create_cache();
+    end_phase(&result[PHASE_CACHE_BUILD]);
+
+    // In pieces of the MSC endpoint buffer, as READ10 passes them
+    begin_phase();
+    uint32_t total_sectors = mimic_fat_total_sector_size();
+    for (uint32_t sector = 0; sector < total_sectors; sector += sizeof(buffer) / DISK_SECTOR_SIZE) {
+        uint32_t sectors = total_sectors - sector;
+        if (sectors > sizeof(buffer) / DISK_SECTOR_SIZE)
+            sectors = sizeof(buffer) / DISK_SECTOR_SIZE;
+        mimic_fat_read(0, sector, buffer, sectors * DISK_SECTOR_SIZE);
+    }
+    end_phase(&result[PHASE_SEQUENTIAL_READ]);
+    mimic_fat_cleanup_cache();
+
+    // read, prog and lookahead buffers, and the cache of the file the mimic keeps open
+    return c->cache_size * 3 + c->lookahead_size;
+}
+
+static void print_header(void) {
+    printf("%-12s %5s %5s %5s %5s %7s", "profile", "read", "cache", "look", "cycle", "RAM");
+    for (int p = 0; p < PHASE_NUM; p++)
+        printf(" %9s", phase_name[p]);
+    printf(" %7s %6s\n", "erases", "max");
+}
+
+static void run(const char *name, lfs_size_t read_size, lfs_size_t cache_size,
+                lfs_size_t lookahead_size, int32_t block_cycles)
+{
+    // Static, since the mimic keeps littlefs mounted with it until the next run
+    static struct lfs_config c;
+    c = (struct lfs_config){
+        .read = emulated_read,
+        .prog = emulated_prog,
+        .erase = emulated_erase,
+        .sync = emulated_sync,
+        .read_size = read_size,
+        .prog_size = LITTLEFS_PROG_SIZE,
+        .block_size = LITTLEFS_BLOCK_SIZE,
+        .block_count = LITTLEFS_BLOCK_COUNT,
+        .cache_size = cache_size,
+        .lookahead_size = lookahead_size,
+        .block_cycles = block_cycles,
+    };
+    phase_result_t result[PHASE_NUM];
+
+    size_t ram = run_workload(&c, result);
+    uint32_t erases = 0;
+    for (int p = 0; p < PHASE_NUM; p++)
+        erases += result[p].erases;
+
+    printf("%-12s %5u %5u %5u %5d %7zu", name, read_size, cache_size, lookahead_size, block_cycles, ram);
+    for (int p = 0; p < PHASE_NUM; p++)
+        printf(" %9llu", (unsigned long long)result[p].flash_us);
+    printf(" %7u %6u\n", erases, max_block_erases);
+}
+
+int main(void) {
+    const lfs_size_t read_sizes[] = {1, 16, 64, 256};
+    const lfs_size_t cache_sizes[] = {256, 1024, 4096};
+    const lfs_size_t lookahead_sizes[] = {8, 16, 64};
+    const int32_t block_cycles[] = {100, 500, 1000};
+
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (uint8_t)i;
+
+    printf("Flash time per phase in us\n");
+    print_header();
+    run("default", LITTLEFS_DEFAULT_READ_SIZE, LITTLEFS_DEFAULT_CACHE_SIZE,
+        LITTLEFS_DEFAULT_LOOKAHEAD_SIZE, LITTLEFS_DEFAULT_BLOCK_CYCLES);
+    run("throughput", LITTLEFS_THROUGHPUT_READ_SIZE, LITTLEFS_THROUGHPUT_CACHE_SIZE,
+        LITTLEFS_THROUGHPUT_LOOKAHEAD_SIZE, LITTLEFS_THROUGHPUT_BLOCK_CYCLES);
+    run("ram-lean", LITTLEFS_RAM_LEAN_READ_SIZE, LITTLEFS_RAM_LEAN_CACHE_SIZE,
+        LITTLEFS_RAM_LEAN_LOOKAHEAD_SIZE, LITTLEFS_RAM_LEAN_BLOCK_CYCLES);
+    run("wear-lean", LITTLEFS_WEAR_LEAN_READ_SIZE, LITTLEFS_WEAR_LEAN_CACHE_SIZE,
+        LITTLEFS_WEAR_LEAN_LOOKAHEAD_SIZE, LITTLEFS_WEAR_LEAN_BLOCK_CYCLES);
+
+    printf("\n");
+    print_header();
+    for (size_t r = 0; r < sizeof(read_sizes) / sizeof(read_sizes[0]); r++) {
+        for (size_t c = 0; c < sizeof(cache_sizes) / sizeof(cache_sizes[0]); c++) {
+            if (cache_sizes[c] < read_sizes[r])
+                continue;
+            for (size_t l = 0; l < sizeof(lookahead_sizes) / sizeof(lookahead_sizes[0]); l++) {
+                for (size_t b = 0; b < sizeof(block_cycles) / sizeof(block_cycles[0]); b++)
+                    run("sweep", read_sizes[r], cache_sizes[c], lookahead_sizes[l], block_cycles[b]);
+            }
+        }
+    }
+    return 0;
+}
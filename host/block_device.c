@@ -0,0 +1,194 @@
+/*
+ * Block devices that emulate the Raspberry Pi Pico on-board flash on the host
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "block_device.h"
+
+
+static bool is_valid_range(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                           lfs_size_t size, lfs_size_t unit)
+{
+    return block < c->block_count
+        && off + size <= c->block_size
+        && off % unit == 0
+        && size % unit == 0;
+}
+
+/*
+ * Program data over current like the NOR flash: bits can only be cleared
+ */
+static int program(uint8_t *current, const uint8_t *data, lfs_block_t block, lfs_off_t off, lfs_size_t size) {
+    for (lfs_size_t i = 0; i < size; i++) {
+        if ((current[i] & data[i]) != data[i]) {
+            printf("block_device_prog: block=%lu offset=%lu is not erased\n",
+                   (unsigned long)block, (unsigned long)(off + i));
+            return LFS_ERR_CORRUPT;
+        }
+    }
+    memcpy(current, data, size);
+    return LFS_ERR_OK;
+}
+
+static uint8_t *ram_data(const struct lfs_config *c) {
+    ram_block_device_t *device = c->context;
+    if (device->data == NULL) {
+        size_t size = (size_t)c->block_count * c->block_size;
+        device->data = malloc(size);
+        if (device->data == NULL) {
+            printf("ram_block_device: malloc(%zu) failed\n", size);
+            return NULL;
+        }
+        memset(device->data, 0xFF, size);
+    }
+    return device->data;
+}
+
+int ram_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    if (!is_valid_range(c, block, off, size, c->read_size))
+        return LFS_ERR_INVAL;
+    uint8_t *data = ram_data(c);
+    if (data == NULL)
+        return LFS_ERR_NOMEM;
+    memcpy(buffer, &data[block * c->block_size + off], size);
+    return LFS_ERR_OK;
+}
+
+int ram_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+    if (!is_valid_range(c, block, off, size, c->prog_size))
+        return LFS_ERR_INVAL;
+    uint8_t *data = ram_data(c);
+    if (data == NULL)
+        return LFS_ERR_NOMEM;
+    return program(&data[block * c->block_size + off], buffer, block, off, size);
+}
+
+int ram_block_device_erase(const struct lfs_config *c, lfs_block_t block) {
+    if (block >= c->block_count)
+        return LFS_ERR_INVAL;
+    uint8_t *data = ram_data(c);
+    if (data == NULL)
+        return LFS_ERR_NOMEM;
+    memset(&data[block * c->block_size], 0xFF, c->block_size);
+    return LFS_ERR_OK;
+}
+
+int ram_block_device_sync(const struct lfs_config *c) {
+    (void)c;
+    return LFS_ERR_OK;
+}
+
+void ram_block_device_free(const struct lfs_config *c) {
+    ram_block_device_t *device = c->context;
+    free(device->data);
+    device->data = NULL;
+}
+
+
+/*
+ * Open the backing file, creating an erased one if it does not exist
+ */
+static FILE *backing_file(const struct lfs_config *c) {
+    file_block_device_t *device = c->context;
+    if (device->file != NULL)
+        return device->file;
+
+    device->file = fopen(device->path, "r+b");
+    if (device->file != NULL)
+        return device->file;
+
+    device->file = fopen(device->path, "w+b");
+    if (device->file == NULL) {
+        printf("file_block_device: fopen('%s') failed\n", device->path);
+        return NULL;
+    }
+    uint8_t erased[4096];
+    memset(erased, 0xFF, sizeof(erased));
+    size_t size = (size_t)c->block_count * c->block_size;
+    for (size_t written = 0; written < size; written += sizeof(erased)) {
+        size_t n = (size - written < sizeof(erased)) ? size - written : sizeof(erased);
+        fwrite(erased, 1, n, device->file);
+    }
+    return device->file;
+}
+
+static int file_read(FILE *file, long offset, void *buffer, lfs_size_t size) {
+    if (fseek(file, offset, SEEK_SET) != 0 || fread(buffer, 1, size, file) != size)
+        return LFS_ERR_IO;
+    return LFS_ERR_OK;
+}
+
+static int file_write(FILE *file, long offset, const void *buffer, lfs_size_t size) {
+    if (fseek(file, offset, SEEK_SET) != 0 || fwrite(buffer, 1, size, file) != size)
+        return LFS_ERR_IO;
+    return LFS_ERR_OK;
+}
+
+int file_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    if (!is_valid_range(c, block, off, size, c->read_size))
+        return LFS_ERR_INVAL;
+    FILE *file = backing_file(c);
+    if (file == NULL)
+        return LFS_ERR_IO;
+    return file_read(file, (long)block * c->block_size + off, buffer, size);
+}
+
+int file_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+    if (!is_valid_range(c, block, off, size, c->prog_size))
+        return LFS_ERR_INVAL;
+    FILE *file = backing_file(c);
+    if (file == NULL)
+        return LFS_ERR_IO;
+
+    uint8_t current[4096];
+    long offset = (long)block * c->block_size + off;
+    for (lfs_size_t done = 0; done < size; ) {
+        lfs_size_t n = (size - done < sizeof(current)) ? size - done : sizeof(current);
+        int err = file_read(file, offset + done, current, n);
+        if (err != LFS_ERR_OK)
+            return err;
+        err = program(current, (const uint8_t *)buffer + done, block, off + done, n);
+        if (err != LFS_ERR_OK)
+            return err;
+        err = file_write(file, offset + done, current, n);
+        if (err != LFS_ERR_OK)
+            return err;
+        done += n;
+    }
+    return LFS_ERR_OK;
+}
+
+int file_block_device_erase(const struct lfs_config *c, lfs_block_t block) {
+    if (block >= c->block_count)
+        return LFS_ERR_INVAL;
+    FILE *file = backing_file(c);
+    if (file == NULL)
+        return LFS_ERR_IO;
+
+    uint8_t erased[4096];
+    memset(erased, 0xFF, sizeof(erased));
+    for (lfs_size_t done = 0; done < c->block_size; done += sizeof(erased)) {
+        lfs_size_t n = (c->block_size - done < sizeof(erased)) ? c->block_size - done : sizeof(erased);
+        int err = file_write(file, (long)block * c->block_size + done, erased, n);
+        if (err != LFS_ERR_OK)
+            return err;
+    }
+    return LFS_ERR_OK;
+}
+
+int file_block_device_sync(const struct lfs_config *c) {
+    file_block_device_t *device = c->context;
+    if (device->file != NULL && fflush(device->file) != 0)
+        return LFS_ERR_IO;
+    return LFS_ERR_OK;
+}
+
+void file_block_device_close(const struct lfs_config *c) {
+    file_block_device_t *device = c->context;
+    if (device->file != NULL)
+        fclose(device->file);
+    device->file = NULL;
+}
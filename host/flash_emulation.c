@@ -0,0 +1,72 @@
+/*
+ * lfs_pico_flash_config for host builds
+ *
+ * The littlefs area of the on-board flash is emulated in RAM, or in the image
+ * file named by the LITTLEFS_USB_IMAGE environment variable so that a file
+ * system can be kept between runs.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdlib.h>
+#include "block_device.h"
+#include "littlefs_profile.h"
+
+static ram_block_device_t ram_device;
+static file_block_device_t file_device;
+
+
+static const struct lfs_config *backing_config(const struct lfs_config *c) {
+    static struct lfs_config file_config;
+    if (file_device.path == NULL) {
+        file_device.path = getenv("LITTLEFS_USB_IMAGE");
+        if (file_device.path == NULL)
+            file_device.path = "";
+        file_config = *c;
+        file_config.context = &file_device;
+    }
+    return (file_device.path[0] != '\0') ? &file_config : c;
+}
+
+static int host_flash_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    const struct lfs_config *config = backing_config(c);
+    if (config->context == &file_device)
+        return file_block_device_read(config, block, off, buffer, size);
+    return ram_block_device_read(config, block, off, buffer, size);
+}
+
+static int host_flash_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size) {
+    const struct lfs_config *config = backing_config(c);
+    if (config->context == &file_device)
+        return file_block_device_prog(config, block, off, buffer, size);
+    return ram_block_device_prog(config, block, off, buffer, size);
+}
+
+static int host_flash_erase(const struct lfs_config *c, lfs_block_t block) {
+    const struct lfs_config *config = backing_config(c);
+    if (config->context == &file_device)
+        return file_block_device_erase(config, block);
+    return ram_block_device_erase(config, block);
+}
+
+static int host_flash_sync(const struct lfs_config *c) {
+    const struct lfs_config *config = backing_config(c);
+    if (config->context == &file_device)
+        return file_block_device_sync(config);
+    return ram_block_device_sync(config);
+}
+
+const struct lfs_config lfs_pico_flash_config = {
+    .context        = &ram_device,
+    .read           = host_flash_read,
+    .prog           = host_flash_prog,
+    .erase          = host_flash_erase,
+    .sync           = host_flash_sync,
+    .read_size      = LITTLEFS_READ_SIZE,
+    .prog_size      = LITTLEFS_PROG_SIZE,
+    .block_size     = LITTLEFS_BLOCK_SIZE,
+    .block_count    = LITTLEFS_BLOCK_COUNT,
+    .cache_size     = LITTLEFS_CACHE_SIZE,
+    .lookahead_size = LITTLEFS_LOOKAHEAD_SIZE,
+    .block_cycles   = LITTLEFS_BLOCK_CYCLES,
+};
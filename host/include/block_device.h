@@ -0,0 +1,39 @@
+/*
+ * Block devices that emulate the Raspberry Pi Pico on-board flash on the host
+ *
+ * Both devices have the geometry of the flash: programs are page aligned and
+ * can only clear bits, and an erase sets a whole sector to 0xFF. The storage
+ * is allocated, or the file created, on the first access, so a device can be
+ * the context of a statically initialized lfs_config.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_BLOCK_DEVICE_H_
+#define PICO_LITTLEFS_USB_HOST_BLOCK_DEVICE_H_
+
+#include <stdio.h>
+#include <lfs.h>
+
+typedef struct {
+    uint8_t *data;
+} ram_block_device_t;
+
+typedef struct {
+    const char *path;
+    FILE *file;
+} file_block_device_t;
+
+int ram_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+int ram_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+int ram_block_device_erase(const struct lfs_config *c, lfs_block_t block);
+int ram_block_device_sync(const struct lfs_config *c);
+void ram_block_device_free(const struct lfs_config *c);
+
+int file_block_device_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+int file_block_device_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+int file_block_device_erase(const struct lfs_config *c, lfs_block_t block);
+int file_block_device_sync(const struct lfs_config *c);
+void file_block_device_close(const struct lfs_config *c);
+
+#endif
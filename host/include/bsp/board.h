@@ -0,0 +1,13 @@
+/*
+ * Minimal stand-in for the TinyUSB board support header on the host
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_BSP_BOARD_H_
+#define PICO_LITTLEFS_USB_HOST_BSP_BOARD_H_
+
+static inline void board_init(void) {
+}
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * Geometry of the on-board flash for host builds, see block_device.h
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_HARDWARE_FLASH_H_
+#define PICO_LITTLEFS_USB_HOST_HARDWARE_FLASH_H_
+
+#define FLASH_PAGE_SIZE    (1u << 8)
+#define FLASH_SECTOR_SIZE  (1u << 12)
+#define FLASH_BLOCK_SIZE   (1u << 16)
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * Host builds have no memory mapped flash
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_HARDWARE_REGS_ADDRESSMAP_H_
+#define PICO_LITTLEFS_USB_HOST_HARDWARE_REGS_ADDRESSMAP_H_
+
+#endif
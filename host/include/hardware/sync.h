@@ -0,0 +1,20 @@
+/*
+ * Host builds have no interrupts to mask
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_HARDWARE_SYNC_H_
+#define PICO_LITTLEFS_USB_HOST_HARDWARE_SYNC_H_
+
+#include <stdint.h>
+
+static inline uint32_t save_and_disable_interrupts(void) {
+    return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+    (void)status;
+}
+
+#endif
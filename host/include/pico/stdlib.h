@@ -0,0 +1,28 @@
+/*
+ * Minimal stand-in for the Pico SDK header to build device independent modules on the host
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_PICO_STDLIB_H_
+#define PICO_LITTLEFS_USB_HOST_PICO_STDLIB_H_
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline uint64_t time_us_64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline bool stdio_init_all(void) {
+    return true;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Minimal stand-in for the TinyUSB header to build the MSC callbacks on the host
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_HOST_TUSB_H_
+#define PICO_LITTLEFS_USB_HOST_TUSB_H_
+
+#include <pico/stdlib.h>
+
+#define BOARD_TUD_RHPORT  0
+#define CFG_TUD_MSC_EP_BUFSIZE  4096  // as include/tusb_config.h
+
+enum {
+    SCSI_CMD_TEST_UNIT_READY = 0x00,
+    SCSI_CMD_REQUEST_SENSE = 0x03,
+    SCSI_CMD_INQUIRY = 0x12,
+    SCSI_CMD_MODE_SELECT_6 = 0x15,
+    SCSI_CMD_MODE_SENSE_6 = 0x1A,
+    SCSI_CMD_START_STOP_UNIT = 0x1B,
+    SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+    SCSI_CMD_READ_FORMAT_CAPACITY = 0x23,
+    SCSI_CMD_READ_CAPACITY_10 = 0x25,
+    SCSI_CMD_READ_10 = 0x28,
+    SCSI_CMD_WRITE_10 = 0x2A,
+};
+
+enum {
+    SCSI_SENSE_NONE = 0x00,
+    SCSI_SENSE_NOT_READY = 0x02,
+    SCSI_SENSE_ILLEGAL_REQUEST = 0x05,
+    SCSI_SENSE_UNIT_ATTENTION = 0x06,
+    SCSI_SENSE_DATA_PROTECT = 0x07,
+};
+
+bool tud_msc_is_writable_cb(uint8_t lun);
+
+/*
+ * TinyUSB keeps the sense data of the failed command; the host build has no USB stack
+ */
+static inline bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier) {
+    (void)lun;
+    (void)sense_key;
+    (void)add_sense_code;
+    (void)add_sense_qualifier;
+    return true;
+}
+
+static inline bool tud_init(uint8_t rhport) {
+    (void)rhport;
+    return true;
+}
+
+static inline void tud_task(void) {
+}
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ * Network Block Device server exporting the mimic FAT image on the host
+ *
+ * The mimic answers NBD requests on a UNIX domain socket exactly as it answers
+ * USB MSC READ10/WRITE10 on the device, with littlefs on the emulated flash of
+ * flash_emulation.c, so the Linux vfat driver can mount it:
+ *
+ *   ./nbd_server -s /tmp/littlefs-usb.sock littlefs.img
+ *   sudo nbd-client -unix /tmp/littlefs-usb.sock /dev/nbd0 -block-size 512
+ *   sudo mount -t vfat /dev/nbd0 /mnt
+ *
+ * Only the fixed newstyle handshake and the READ, WRITE, FLUSH and DISC
+ * commands are implemented. The server handles one client at a time.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <tusb.h>
+#include "mimic_fat.h"
+
+extern const struct lfs_config lfs_pico_flash_config;  // flash_emulation.c
+
+#define NBD_MAGIC               0x4e42444d41474943ULL  // "NBDMAGIC"
+#define NBD_OPTION_MAGIC        0x49484156454f5054ULL  // "IHAVEOPT"
+#define NBD_REPLY_MAGIC         0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC  0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE  (1 << 0)
+#define NBD_FLAG_NO_ZEROES       (1 << 1)
+#define NBD_FLAG_HAS_FLAGS       (1 << 0)
+#define NBD_FLAG_SEND_FLUSH      (1 << 2)
+
+#define NBD_OPT_EXPORT_NAME  1
+#define NBD_OPT_ABORT        2
+#define NBD_OPT_INFO         6
+#define NBD_OPT_GO           7
+
+#define NBD_REP_ACK        1
+#define NBD_REP_INFO       3
+#define NBD_REP_ERR_UNSUP  0x80000001
+
+#define NBD_INFO_EXPORT      0
+#define NBD_INFO_BLOCK_SIZE  3
+
+#define NBD_CMD_READ   0
+#define NBD_CMD_WRITE  1
+#define NBD_CMD_DISC   2
+#define NBD_CMD_FLUSH  3
+
+#define NBD_EINVAL  22
+
+#define NBD_MAX_REQUEST_SIZE  (32 * 1024 * 1024)
+#define IDLE_POLL_MS          100
+
+typedef struct {
+    uint32_t count;
+    uint64_t bytes;
+    uint64_t elapsed_us;
+    uint64_t max_us;
+} request_stats_t;
+
+static const char *request_name[] = {"read", "write", "disc", "flush"};
+static request_stats_t request_stats[NBD_CMD_FLUSH + 1];
+static uint8_t *request_buffer;
+static size_t request_buffer_size;
+
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    put_be16(p, v >> 16);
+    put_be16(p + 2, v & 0xFFFF);
+}
+
+static void put_be64(uint8_t *p, uint64_t v) {
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v & 0xFFFFFFFF);
+}
+
+static uint16_t get_be16(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)get_be16(p) << 16) | get_be16(p + 2);
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static bool send_all(int fd, const void *buffer, size_t size) {
+    const uint8_t *p = buffer;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *buffer, size_t size) {
+    uint8_t *p = buffer;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static uint8_t *reserve_request_buffer(size_t size) {
+    if (size <= request_buffer_size)
+        return request_buffer;
+    uint8_t *buffer = realloc(request_buffer, size);
+    if (buffer == NULL) {
+        printf("reserve_request_buffer: realloc(%zu) failed\n", size);
+        return NULL;
+    }
+    request_buffer = buffer;
+    request_buffer_size = size;
+    return request_buffer;
+}
+
+static uint64_t export_size(void) {
+    return (uint64_t)mimic_fat_total_sector_size() * DISK_SECTOR_SIZE;
+}
+
+static bool send_option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t size) {
+    uint8_t header[20];
+    put_be64(&header[0], NBD_REPLY_MAGIC);
+    put_be32(&header[8], option);
+    put_be32(&header[12], type);
+    put_be32(&header[16], size);
+    return send_all(fd, header, sizeof(header)) && (size == 0 || send_all(fd, data, size));
+}
+
+/*
+ * Reply to NBD_OPT_INFO and NBD_OPT_GO with the size and the block sizes of the export
+ */
+static bool send_export_info(int fd, uint32_t option) {
+    uint8_t export[12];
+    put_be16(&export[0], NBD_INFO_EXPORT);
+    put_be64(&export[2], export_size());
+    put_be16(&export[10], NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH);
+
+    uint8_t block_size[14];
+    put_be16(&block_size[0], NBD_INFO_BLOCK_SIZE);
+    put_be32(&block_size[2], DISK_SECTOR_SIZE);
+    put_be32(&block_size[6], DISK_SECTOR_SIZE);
+    put_be32(&block_size[10], NBD_MAX_REQUEST_SIZE);
+
+    return send_option_reply(fd, option, NBD_REP_INFO, export, sizeof(export))
+        && send_option_reply(fd, option, NBD_REP_INFO, block_size, sizeof(block_size))
+        && send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+}
+
+/*
+ * Run the fixed newstyle handshake. Returns true when the client moves on to the transmission phase
+ */
+static bool negotiate(int fd) {
+    uint8_t greeting[18];
+    put_be64(&greeting[0], NBD_MAGIC);
+    put_be64(&greeting[8], NBD_OPTION_MAGIC);
+    put_be16(&greeting[16], NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    if (!send_all(fd, greeting, sizeof(greeting)))
+        return false;
+
+    uint8_t client_flags[4];
+    if (!recv_all(fd, client_flags, sizeof(client_flags)))
+        return false;
+    bool no_zeroes = get_be32(client_flags) & NBD_FLAG_NO_ZEROES;
+
+    while (true) {
+        uint8_t header[16];
+        if (!recv_all(fd, header, sizeof(header)))
+            return false;
+        if (get_be64(&header[0]) != NBD_OPTION_MAGIC) {
+            printf("negotiate: bad option magic\n");
+            return false;
+        }
+        uint32_t option = get_be32(&header[8]);
+        uint32_t size = get_be32(&header[12]);
+        if (size > 4096) {
+            printf("negotiate: option=%u length=%u is too long\n", option, size);
+            return false;
+        }
+        uint8_t data[4096];
+        if (!recv_all(fd, data, size))  // the export name and information requests are ignored
+            return false;
+
+        switch (option) {
+        case NBD_OPT_EXPORT_NAME: {
+            uint8_t reply[10 + 124] = {0};
+            put_be64(&reply[0], export_size());
+            put_be16(&reply[8], NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH);
+            return send_all(fd, reply, no_zeroes ? 10 : sizeof(reply));
+        }
+        case NBD_OPT_ABORT:
+            send_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+            return false;
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            if (!send_export_info(fd, option))
+                return false;
+            if (option == NBD_OPT_GO)
+                return true;
+            break;
+        default:
+            if (!send_option_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0))
+                return false;
+            break;
+        }
+    }
+}
+
+static bool send_simple_reply(int fd, uint32_t error, const uint8_t *handle, const void *data, size_t size) {
+    uint8_t reply[16];
+    put_be32(&reply[0], NBD_SIMPLE_REPLY_MAGIC);
+    put_be32(&reply[4], error);
+    memcpy(&reply[8], handle, 8);
+    return send_all(fd, reply, sizeof(reply)) && (size == 0 || send_all(fd, data, size));
+}
+
+static bool is_valid_request(uint64_t offset, uint32_t length) {
+    return offset % DISK_SECTOR_SIZE == 0
+        && length % DISK_SECTOR_SIZE == 0
+        && length <= NBD_MAX_REQUEST_SIZE
+        && offset + length <= export_size();
+}
+
+/*
+ * Pass the request to the mimic in pieces of the MSC endpoint buffer, as READ10 and WRITE10 do
+ */
+static void read_sectors(uint32_t sector, uint8_t *buffer, uint32_t length) {
+    for (uint32_t offset = 0; offset < length; offset += CFG_TUD_MSC_EP_BUFSIZE) {
+        uint32_t size = length - offset < CFG_TUD_MSC_EP_BUFSIZE ? length - offset : CFG_TUD_MSC_EP_BUFSIZE;
+        mimic_fat_read(0, sector + offset / DISK_SECTOR_SIZE, &buffer[offset], size);
+    }
+}
+
+static void write_sectors(uint32_t sector, uint8_t *buffer, uint32_t length) {
+    for (uint32_t offset = 0; offset < length; offset += CFG_TUD_MSC_EP_BUFSIZE) {
+        uint32_t size = length - offset < CFG_TUD_MSC_EP_BUFSIZE ? length - offset : CFG_TUD_MSC_EP_BUFSIZE;
+        mimic_fat_write(0, sector + offset / DISK_SECTOR_SIZE, &buffer[offset], size);
+    }
+}
+
+/*
+ * Serve one request. Returns false when the client disconnects
+ */
+static bool serve_request(int fd) {
+    uint8_t request[28];
+    if (!recv_all(fd, request, sizeof(request)))
+        return false;
+    if (get_be32(&request[0]) != NBD_REQUEST_MAGIC) {
+        printf("serve_request: bad request magic\n");
+        return false;
+    }
+    uint16_t type = get_be16(&request[6]);
+    const uint8_t *handle = &request[8];
+    uint64_t offset = get_be64(&request[16]);
+    uint32_t length = get_be32(&request[24]);
+    uint64_t start_at = time_us_64();
+    bool is_ok = true;
+
+    switch (type) {
+    case NBD_CMD_READ: {
+        uint8_t *buffer = reserve_request_buffer(length);
+        if (buffer == NULL || !is_valid_request(offset, length)) {
+            is_ok = send_simple_reply(fd, NBD_EINVAL, handle, NULL, 0);
+            break;
+        }
+        read_sectors(offset / DISK_SECTOR_SIZE, buffer, length);
+        is_ok = send_simple_reply(fd, 0, handle, buffer, length);
+        break;
+    }
+    case NBD_CMD_WRITE: {
+        if (length > NBD_MAX_REQUEST_SIZE)
+            return false;
+        uint8_t *buffer = reserve_request_buffer(length);
+        if (buffer == NULL || !recv_all(fd, buffer, length))
+            return false;
+        if (!is_valid_request(offset, length)) {
+            is_ok = send_simple_reply(fd, NBD_EINVAL, handle, NULL, 0);
+            break;
+        }
+        write_sectors(offset / DISK_SECTOR_SIZE, buffer, length);
+        is_ok = send_simple_reply(fd, 0, handle, NULL, 0);
+        break;
+    }
+    case NBD_CMD_FLUSH:
+        mimic_fat_flush();
+        is_ok = send_simple_reply(fd, 0, handle, NULL, 0);
+        break;
+    case NBD_CMD_DISC:
+        return false;
+    default:
+        return send_simple_reply(fd, NBD_EINVAL, handle, NULL, 0);
+    }
+
+    uint64_t elapsed = time_us_64() - start_at;
+    request_stats_t *stats = &request_stats[type];
+    stats->count++;
+    stats->bytes += (type == NBD_CMD_FLUSH) ? 0 : length;
+    stats->elapsed_us += elapsed;
+    if (elapsed > stats->max_us)
+        stats->max_us = elapsed;
+    return is_ok;
+}
+
+static void print_request_stats(void) {
+    printf("%-6s %8s %12s %10s %10s\n", "", "count", "bytes", "mean [us]", "max [us]");
+    for (int type = NBD_CMD_READ; type <= NBD_CMD_FLUSH; type++) {
+        request_stats_t *stats = &request_stats[type];
+        if (type == NBD_CMD_DISC)
+            continue;
+        printf("%-6s %8u %12llu %10.1f %10llu\n", request_name[type], stats->count,
+               (unsigned long long)stats->bytes,
+               stats->count ? (double)stats->elapsed_us / stats->count : 0.0,
+               (unsigned long long)stats->max_us);
+    }
+    mimic_fat_write_stats_t write_stats;
+    mimic_fat_write_stats(&write_stats);
+    printf("sector writes=%lu suppressed=%lu\n",
+           (unsigned long)write_stats.count, (unsigned long)write_stats.suppressed);
+}
+
+/*
+ * Serve a client, running the idle work of the mimic while the client is quiet
+ */
+static void serve_client(int fd) {
+    memset(request_stats, 0, sizeof(request_stats));
+    mimic_fat_update_usb_device_is_enabled(true);
+    mimic_fat_create_cache();
+
+    while (true) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int rc = poll(&pfd, 1, IDLE_POLL_MS);
+        if (rc < 0 && errno != EINTR)
+            break;
+        if (rc <= 0) {
+            mimic_fat_task();
+            continue;
+        }
+        if (!serve_request(fd))
+            break;
+    }
+
+    // The client went away, as if the drive was ejected
+    mimic_fat_flush();
+    mimic_fat_cleanup_cache();
+    mimic_fat_update_usb_device_is_enabled(false);
+    lfs_pico_flash_config.sync(&lfs_pico_flash_config);
+    print_request_stats();
+}
+
+static void format_if_necessary(void) {
+    if (mimic_fat_init(&lfs_pico_flash_config) == LFS_ERR_OK)
+        return;
+    printf("Format the emulated flash memory with littlefs\n");
+    mimic_fat_lock();
+    int err = mimic_fat_format();
+    if (err != LFS_ERR_OK)
+        printf("format_if_necessary: mimic_fat_format error=%d\n", err);
+    mimic_fat_unlock();
+}
+
+static int listen_socket(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("listen_socket: path '%s' is too long\n", path);
+        close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s [-s socket] [-1] [image]\n", name);
+    printf("  -s socket  UNIX domain socket to listen on (default /tmp/littlefs-usb.sock)\n");
+    printf("  -1         exit after the first client disconnects\n");
+    printf("  image      flash image file, kept in RAM if omitted\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket_path = "/tmp/littlefs-usb.sock";
+    bool is_oneshot = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:1h")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case '1':
+            is_oneshot = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc)
+        setenv("LITTLEFS_USB_IMAGE", argv[optind], 1);
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    format_if_necessary();
+
+    int server = listen_socket(socket_path);
+    if (server < 0)
+        return 1;
+    printf("Listening on %s, %llu bytes\n", socket_path, (unsigned long long)export_size());
+
+    do {
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+        if (negotiate(fd))
+            serve_client(fd);
+        close(fd);
+    } while (!is_oneshot);
+
+    close(server);
+    unlink(socket_path);
+    return 0;
+}
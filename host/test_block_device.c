@@ -0,0 +1,117 @@
+/*
+ * Test of the flash semantics of the RAM and file backed block devices
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "block_device.h"
+
+#define PAGE_SIZE    256
+#define SECTOR_SIZE  4096
+#define BLOCK_COUNT  4
+
+typedef struct {
+    int (*read)(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+    int (*prog)(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+    int (*erase)(const struct lfs_config *c, lfs_block_t block);
+} device_ops_t;
+
+static uint8_t page[PAGE_SIZE];
+static uint8_t buffer[SECTOR_SIZE];
+
+
+static struct lfs_config device_config(void *context) {
+    struct lfs_config config = {
+        .context = context,
+        .read_size = 1,
+        .prog_size = PAGE_SIZE,
+        .block_size = SECTOR_SIZE,
+        .block_count = BLOCK_COUNT,
+    };
+    return config;
+}
+
+static bool is_erased(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+static void test_device(const struct lfs_config *c, const device_ops_t *ops) {
+    // A new device is erased
+    assert(ops->read(c, BLOCK_COUNT - 1, 0, buffer, SECTOR_SIZE) == LFS_ERR_OK);
+    assert(is_erased(buffer, SECTOR_SIZE));
+
+    // Program a page and clear more bits of it
+    memset(page, 0xF0, sizeof(page));
+    assert(ops->prog(c, 1, PAGE_SIZE, page, PAGE_SIZE) == LFS_ERR_OK);
+    memset(page, 0x30, sizeof(page));
+    assert(ops->prog(c, 1, PAGE_SIZE, page, PAGE_SIZE) == LFS_ERR_OK);
+    assert(ops->read(c, 1, 0, buffer, SECTOR_SIZE) == LFS_ERR_OK);
+    assert(is_erased(buffer, PAGE_SIZE));
+    assert(buffer[PAGE_SIZE] == 0x30 && buffer[PAGE_SIZE * 2 - 1] == 0x30);
+    assert(is_erased(&buffer[PAGE_SIZE * 2], SECTOR_SIZE - PAGE_SIZE * 2));
+
+    // Programming can not set bits
+    memset(page, 0x31, sizeof(page));
+    assert(ops->prog(c, 1, PAGE_SIZE, page, PAGE_SIZE) == LFS_ERR_CORRUPT);
+    assert(ops->read(c, 1, PAGE_SIZE, buffer, 1) == LFS_ERR_OK);
+    assert(buffer[0] == 0x30);
+
+    // Erase sets the whole sector to 0xFF
+    assert(ops->erase(c, 1) == LFS_ERR_OK);
+    assert(ops->read(c, 1, 0, buffer, SECTOR_SIZE) == LFS_ERR_OK);
+    assert(is_erased(buffer, SECTOR_SIZE));
+    assert(ops->prog(c, 1, PAGE_SIZE, page, PAGE_SIZE) == LFS_ERR_OK);
+
+    // Unaligned and out of range requests
+    assert(ops->prog(c, 0, 1, page, PAGE_SIZE) == LFS_ERR_INVAL);
+    assert(ops->prog(c, 0, 0, page, PAGE_SIZE / 2) == LFS_ERR_INVAL);
+    assert(ops->prog(c, BLOCK_COUNT, 0, page, PAGE_SIZE) == LFS_ERR_INVAL);
+    assert(ops->read(c, 0, SECTOR_SIZE - 1, buffer, 2) == LFS_ERR_INVAL);
+    assert(ops->erase(c, BLOCK_COUNT) == LFS_ERR_INVAL);
+}
+
+static void test_ram_block_device(void) {
+    const device_ops_t ops = {ram_block_device_read, ram_block_device_prog, ram_block_device_erase};
+    ram_block_device_t device = {0};
+    struct lfs_config config = device_config(&device);
+
+    test_device(&config, &ops);
+    ram_block_device_free(&config);
+}
+
+static void test_file_block_device(void) {
+    const device_ops_t ops = {file_block_device_read, file_block_device_prog, file_block_device_erase};
+    char path[] = "/tmp/block_device_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    file_block_device_t device = {.path = path};
+    struct lfs_config config = device_config(&device);
+    test_device(&config, &ops);
+    assert(file_block_device_sync(&config) == LFS_ERR_OK);
+    file_block_device_close(&config);
+
+    // The image is kept between runs
+    assert(file_block_device_read(&config, 1, PAGE_SIZE, buffer, PAGE_SIZE) == LFS_ERR_OK);
+    assert(buffer[0] == 0x31 && buffer[PAGE_SIZE - 1] == 0x31);
+    file_block_device_close(&config);
+    unlink(path);
+}
+
+int main(void) {
+    test_ram_block_device();
+    test_file_block_device();
+
+    printf("block_device ...........ok\n");
+    return 0;
+}
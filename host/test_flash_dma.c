@@ -0,0 +1,52 @@
+/*
+ * Test of the splitting of flash_dma_read() into CPU and DMA copies
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include "flash_dma.h"
+
+#define FLASH_SIZE  4096
+
+static uint8_t flash[FLASH_SIZE] __attribute__((aligned(4)));
+static uint8_t buffer[FLASH_SIZE + 8] __attribute__((aligned(4)));
+
+
+static void test_read(size_t src_offset, size_t dst_offset, size_t size) {
+    flash_dma_stats_t before, after;
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    flash_dma_stats(&before);
+    flash_dma_read(flash + src_offset, buffer + dst_offset, size);
+    flash_dma_stats(&after);
+
+    assert(memcmp(buffer + dst_offset, flash + src_offset, size) == 0);
+    for (size_t i = 0; i < dst_offset; i++)
+        assert(buffer[i] == 0xAA);
+    assert(buffer[dst_offset + size] == 0xAA);
+
+    uint32_t dma_bytes = after.dma_bytes - before.dma_bytes;
+    uint32_t memcpy_bytes = after.memcpy_bytes - before.memcpy_bytes;
+    assert(dma_bytes + memcpy_bytes == size);
+    if (size < FLASH_DMA_THRESHOLD || (src_offset & 0x3) != (dst_offset & 0x3))
+        assert(dma_bytes == 0);
+    else
+        assert(dma_bytes % 4 == 0 && memcpy_bytes <= 6);
+}
+
+int main(void) {
+    for (size_t i = 0; i < FLASH_SIZE; i++)
+        flash[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    const size_t sizes[] = {0, 1, 3, FLASH_DMA_THRESHOLD - 1, FLASH_DMA_THRESHOLD, 255, 256, 2048};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t src_offset = 0; src_offset < 4; src_offset++) {
+            for (size_t dst_offset = 0; dst_offset < 4; dst_offset++)
+                test_read(src_offset + 1024, dst_offset, sizes[s]);
+        }
+    }
+
+    printf("flash_dma ..............ok\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Keyed difference of FAT directory entries
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_DIR_ENTRY_DIFF_H_
+#define PICO_LITTLEFS_USB_DIR_ENTRY_DIFF_H_
+
+#include "mimic_fat.h"
+
+/*
+ * Maximum number of directory entries in one image
+ */
+#ifndef DIR_ENTRY_DIFF_MAX_ENTRIES
+#define DIR_ENTRY_DIFF_MAX_ENTRIES  (DISK_SECTOR_SIZE / sizeof(fat_dir_entry_t))
+#endif
+
+typedef enum {
+    DIR_ENTRY_DIFF_CREATE = 0,
+    DIR_ENTRY_DIFF_DELETE,
+    DIR_ENTRY_DIFF_RENAME,   // same first cluster, different name
+    DIR_ENTRY_DIFF_RESIZE,   // same name, different first cluster or size
+    DIR_ENTRY_DIFF_ATTR,     // same name, cluster and size, different attributes
+} dir_entry_diff_type_t;
+
+/*
+ * One logical change. orig and new point to the short filename entries in the
+ * images passed to dir_entry_diff(); orig is NULL for a create and new is NULL
+ * for a delete.
+ */
+typedef struct {
+    dir_entry_diff_type_t type;
+    const fat_dir_entry_t *orig;
+    const fat_dir_entry_t *new;
+} dir_entry_diff_t;
+
+size_t dir_entry_diff(const fat_dir_entry_t *orig, const fat_dir_entry_t *new, size_t num,
+                      dir_entry_diff_t *result, size_t result_size);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Flash reads through the XIP streaming interface and DMA
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_FLASH_DMA_H_
+#define PICO_LITTLEFS_USB_FLASH_DMA_H_
+
+#include <pico/stdlib.h>
+
+/*
+ * Reads shorter than this are copied by the CPU
+ */
+#ifndef FLASH_DMA_THRESHOLD
+#define FLASH_DMA_THRESHOLD  64
+#endif
+
+/*
+ * Number of bytes read by DMA and by the CPU
+ */
+typedef struct {
+    uint32_t dma_bytes;
+    uint32_t memcpy_bytes;
+} flash_dma_stats_t;
+
+void flash_dma_read(const void *xip_addr, void *buffer, size_t size);
+void flash_dma_stats(flash_dma_stats_t *stats);
+
+#endif
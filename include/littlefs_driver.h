@@ -0,0 +1,64 @@
+/*
+ * Driver for Raspberry Pi Pico on-board flash with littlefs file system
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_LITTLEFS_DRIVER_H_
+#define PICO_LITTLEFS_USB_LITTLEFS_DRIVER_H_
+
+#include <pico/stdlib.h>
+#include <lfs.h>
+
+/*
+ * Number of free blocks kept erased ahead of the littlefs allocator
+ */
+#ifndef PRE_ERASE_POOL_SIZE
+#define PRE_ERASE_POOL_SIZE  8
+#endif
+
+/*
+ * Erase requests from littlefs served from the pre-erased pool (hits) or
+ * erased on demand (misses), and the erase time taken off or left on the
+ * write path
+ */
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint64_t hidden_us;
+    uint64_t exposed_us;
+} littlefs_erase_stats_t;
+
+/*
+ * Block device operations, bytes transferred and time spent with interrupts
+ * disabled. histogram[op][i] counts the operations that took less than 2^i us.
+ */
+#define LITTLEFS_FLASH_HISTOGRAM_SIZE  24
+
+typedef enum {
+    LITTLEFS_FLASH_OP_READ = 0,
+    LITTLEFS_FLASH_OP_PROG,
+    LITTLEFS_FLASH_OP_ERASE,
+    LITTLEFS_FLASH_OP_SYNC,
+    LITTLEFS_FLASH_OP_NUM,
+} littlefs_flash_op_t;
+
+typedef struct {
+    uint32_t count[LITTLEFS_FLASH_OP_NUM];
+    uint32_t histogram[LITTLEFS_FLASH_OP_NUM][LITTLEFS_FLASH_HISTOGRAM_SIZE];
+    uint64_t read_bytes;
+    uint64_t prog_bytes;
+    uint64_t interrupts_disabled_us;
+    uint32_t interrupts_disabled_max_us;
+} littlefs_flash_stats_t;
+
+extern const struct lfs_config lfs_pico_flash_config;
+
+void littlefs_pre_erase_task(lfs_t *fs);
+void littlefs_bulk_erase(lfs_block_t block, lfs_size_t count);
+void littlefs_erase_stats(littlefs_erase_stats_t *stats);
+void littlefs_flash_stats(littlefs_flash_stats_t *stats);
+uint32_t littlefs_erase_count(lfs_block_t block);
+void littlefs_print_flash_stats(void);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * littlefs geometry profiles for the Raspberry Pi Pico on-board flash
+ *
+ * Select a profile at build time with LITTLEFS_PROFILE:
+ *
+ *   LITTLEFS_PROFILE_DEFAULT     balanced settings used so far
+ *   LITTLEFS_PROFILE_THROUGHPUT  larger reads and lookahead, fewer relocations
+ *   LITTLEFS_PROFILE_RAM_LEAN    page sized caches and a small lookahead
+ *   LITTLEFS_PROFILE_WEAR_LEAN   more frequent relocation of metadata blocks
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_LITTLEFS_PROFILE_H_
+#define PICO_LITTLEFS_USB_LITTLEFS_PROFILE_H_
+
+#define LITTLEFS_PROFILE_DEFAULT     0
+#define LITTLEFS_PROFILE_THROUGHPUT  1
+#define LITTLEFS_PROFILE_RAM_LEAN    2
+#define LITTLEFS_PROFILE_WEAR_LEAN   3
+
+#ifndef LITTLEFS_PROFILE
+#define LITTLEFS_PROFILE  LITTLEFS_PROFILE_DEFAULT
+#endif
+
+// Geometry of the flash, FLASH_PAGE_SIZE and FLASH_SECTOR_SIZE of the Pico SDK
+#define LITTLEFS_FLASH_PAGE_SIZE    256
+#define LITTLEFS_FLASH_SECTOR_SIZE  4096
+
+#define LITTLEFS_PROG_SIZE    LITTLEFS_FLASH_PAGE_SIZE
+#define LITTLEFS_BLOCK_SIZE   LITTLEFS_FLASH_SECTOR_SIZE
+#define LITTLEFS_BLOCK_COUNT  460  // 1.8 MB at the end of the 2 MB flash
+
+// read_size, cache_size, lookahead_size and block_cycles of each profile
+#define LITTLEFS_DEFAULT_READ_SIZE          1
+#define LITTLEFS_DEFAULT_CACHE_SIZE         LITTLEFS_FLASH_SECTOR_SIZE
+#define LITTLEFS_DEFAULT_LOOKAHEAD_SIZE     16
+#define LITTLEFS_DEFAULT_BLOCK_CYCLES       500
+
+#define LITTLEFS_THROUGHPUT_READ_SIZE       64
+#define LITTLEFS_THROUGHPUT_CACHE_SIZE      LITTLEFS_FLASH_SECTOR_SIZE
+#define LITTLEFS_THROUGHPUT_LOOKAHEAD_SIZE  64
+#define LITTLEFS_THROUGHPUT_BLOCK_CYCLES    1000
+
+#define LITTLEFS_RAM_LEAN_READ_SIZE         1
+#define LITTLEFS_RAM_LEAN_CACHE_SIZE        LITTLEFS_FLASH_PAGE_SIZE
+#define LITTLEFS_RAM_LEAN_LOOKAHEAD_SIZE    8
+#define LITTLEFS_RAM_LEAN_BLOCK_CYCLES      500
+
+#define LITTLEFS_WEAR_LEAN_READ_SIZE        1
+#define LITTLEFS_WEAR_LEAN_CACHE_SIZE       LITTLEFS_FLASH_SECTOR_SIZE
+#define LITTLEFS_WEAR_LEAN_LOOKAHEAD_SIZE   16
+#define LITTLEFS_WEAR_LEAN_BLOCK_CYCLES     100
+
+#if LITTLEFS_PROFILE == LITTLEFS_PROFILE_THROUGHPUT
+#define LITTLEFS_READ_SIZE       LITTLEFS_THROUGHPUT_READ_SIZE
+#define LITTLEFS_CACHE_SIZE      LITTLEFS_THROUGHPUT_CACHE_SIZE
+#define LITTLEFS_LOOKAHEAD_SIZE  LITTLEFS_THROUGHPUT_LOOKAHEAD_SIZE
+#define LITTLEFS_BLOCK_CYCLES    LITTLEFS_THROUGHPUT_BLOCK_CYCLES
+#elif LITTLEFS_PROFILE == LITTLEFS_PROFILE_RAM_LEAN
+#define LITTLEFS_READ_SIZE       LITTLEFS_RAM_LEAN_READ_SIZE
+#define LITTLEFS_CACHE_SIZE      LITTLEFS_RAM_LEAN_CACHE_SIZE
+#define LITTLEFS_LOOKAHEAD_SIZE  LITTLEFS_RAM_LEAN_LOOKAHEAD_SIZE
+#define LITTLEFS_BLOCK_CYCLES    LITTLEFS_RAM_LEAN_BLOCK_CYCLES
+#elif LITTLEFS_PROFILE == LITTLEFS_PROFILE_WEAR_LEAN
+#define LITTLEFS_READ_SIZE       LITTLEFS_WEAR_LEAN_READ_SIZE
+#define LITTLEFS_CACHE_SIZE      LITTLEFS_WEAR_LEAN_CACHE_SIZE
+#define LITTLEFS_LOOKAHEAD_SIZE  LITTLEFS_WEAR_LEAN_LOOKAHEAD_SIZE
+#define LITTLEFS_BLOCK_CYCLES    LITTLEFS_WEAR_LEAN_BLOCK_CYCLES
+#else
+#define LITTLEFS_READ_SIZE       LITTLEFS_DEFAULT_READ_SIZE
+#define LITTLEFS_CACHE_SIZE      LITTLEFS_DEFAULT_CACHE_SIZE
+#define LITTLEFS_LOOKAHEAD_SIZE  LITTLEFS_DEFAULT_LOOKAHEAD_SIZE
+#define LITTLEFS_BLOCK_CYCLES    LITTLEFS_DEFAULT_BLOCK_CYCLES
+#endif
+
+#endif
@@ -45,14 +45,64 @@ typedef struct {
 
 #define DISK_SECTOR_SIZE   512
 
+/*
+ * Files registered with mimic_fat_set_growing_file(), the clusters reserved past
+ * the end of each of them, and how long a file may stop growing before its
+ * reserve is given back
+ */
+#ifndef MIMIC_FAT_GROWING_FILE_MAX
+#define MIMIC_FAT_GROWING_FILE_MAX      2
+#endif
+#ifndef MIMIC_FAT_GROWING_FILE_RESERVE
+#define MIMIC_FAT_GROWING_FILE_RESERVE  64
+#endif
+#ifndef MIMIC_FAT_GROWING_FILE_IDLE_US
+#define MIMIC_FAT_GROWING_FILE_IDLE_US  (10 * 1000 * 1000)
+#endif
+
+/*
+ * Number and duration of sync points at which host writes are applied to littlefs
+ */
+typedef struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+} mimic_fat_sync_stats_t;
+
+/*
+ * Number of sectors written by the host, and of those dropped because the content was unchanged
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t suppressed;
+} mimic_fat_write_stats_t;
+
 
-void mimic_fat_init(const struct lfs_config *c);
+int mimic_fat_init(const struct lfs_config *c);
+int mimic_fat_format(void);
 size_t mimic_fat_total_sector_size(void);
 void mimic_fat_create_cache(void);
 void mimic_fat_cleanup_cache(void);
 void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize);
 void mimic_fat_write(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize);
+void mimic_fat_task(void);
+void mimic_fat_flush(void);
+void mimic_fat_notify_changed(const char *path);
+bool mimic_fat_medium_changed(void);
+bool mimic_fat_set_growing_file(const char *path);
+bool mimic_fat_close_growing_file(const char *path);
+bool mimic_fat_is_idle(void);
+lfs_t *mimic_fat_filesystem(void);
+lfs_t *mimic_fat_read_filesystem(void);
+lfs_t *mimic_fat_lock(void);
+void mimic_fat_unlock(void);
+bool mimic_fat_is_locked(void);
+void mimic_fat_sync_stats(mimic_fat_sync_stats_t *stats);
+void mimic_fat_write_stats(mimic_fat_write_stats_t *stats);
 bool mimic_fat_usb_device_is_enabled(void);
 void mimic_fat_update_usb_device_is_enabled(bool enable);
+void mimic_fat_boot_sector(void *buffer, size_t total_sector_size);
+fat_dir_entry_t *mimic_fat_append_dir_entry(fat_dir_entry_t *entry, struct lfs_info *finfo, uint32_t cluster);
+void set_volume_label_entry(fat_dir_entry_t *dir, const char *name);
 
 #endif
@@ -0,0 +1,36 @@
+/*
+ * Read-only FAT12 snapshot of the littlefs tree
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_SNAPSHOT_FAT_H_
+#define PICO_LITTLEFS_USB_SNAPSHOT_FAT_H_
+
+#include <pico/stdlib.h>
+#include <lfs.h>
+#include "mimic_fat.h"
+
+/*
+ * Capacity of the in-RAM index: files and directories, FAT directory entries
+ * including long filename entries, and bytes of file names
+ */
+#ifndef SNAPSHOT_FAT_NODE_MAX
+#define SNAPSHOT_FAT_NODE_MAX       256
+#endif
+#ifndef SNAPSHOT_FAT_DIR_ENTRY_MAX
+#define SNAPSHOT_FAT_DIR_ENTRY_MAX  512
+#endif
+#ifndef SNAPSHOT_FAT_NAME_POOL_SIZE
+#define SNAPSHOT_FAT_NAME_POOL_SIZE 4096
+#endif
+
+
+void snapshot_fat_init(const struct lfs_config *c);
+bool snapshot_fat_create(void);
+void snapshot_fat_release(void);
+bool snapshot_fat_is_created(void);
+size_t snapshot_fat_total_sector_size(void);
+void snapshot_fat_read(uint32_t sector, void *buffer, uint32_t bufsize);
+
+#endif
@@ -104,8 +104,11 @@
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
-// MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE   512
+// MSC Buffer size of Device Mass storage, a multiple of the 512 bytes sector.
+// READ10/WRITE10 callbacks receive up to this many bytes at a time.
+#ifndef CFG_TUD_MSC_EP_BUFSIZE
+#define CFG_TUD_MSC_EP_BUFSIZE   4096
+#endif
 
 #ifdef __cplusplus
  }
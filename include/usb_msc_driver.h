@@ -0,0 +1,29 @@
+/*
+ * USB mass storage class driver that mimics littlefs to FAT12 file system.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_USB_MSC_DRIVER_H_
+#define PICO_LITTLEFS_USB_USB_MSC_DRIVER_H_
+
+#include <pico/stdlib.h>
+
+/*
+ * LUN 0 is the writable mimic of littlefs, LUN 1 a read-only snapshot of it
+ */
+#define USB_MSC_LUN_MIMIC     0
+#define USB_MSC_LUN_SNAPSHOT  1
+#define USB_MSC_LUN_NUM       2
+
+/*
+ * Number of READ10/WRITE10 endpoint buffers queued for usb_msc_driver_task()
+ */
+#ifndef USB_MSC_REQUEST_QUEUE_SIZE
+#define USB_MSC_REQUEST_QUEUE_SIZE  4
+#endif
+
+void usb_msc_driver_task(void);
+bool usb_msc_driver_is_idle(void);
+
+#endif
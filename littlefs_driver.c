@@ -8,9 +8,41 @@
 #include <hardware/sync.h>
 #include <hardware/regs/addressmap.h>
 #include <lfs.h>
+#include "flash_dma.h"
+#include "littlefs_driver.h"
+#include "littlefs_profile.h"
 
+_Static_assert(LITTLEFS_FLASH_PAGE_SIZE == FLASH_PAGE_SIZE, "flash page size mismatch");
+_Static_assert(LITTLEFS_FLASH_SECTOR_SIZE == FLASH_SECTOR_SIZE, "flash sector size mismatch");
 
-#define FS_SIZE (1.8 * 1024 * 1024)
+#define PRE_ERASE_MAX_BLOCKS  512
+#define PRE_ERASE_IDLE_US     (500 * 1000)
+
+/*
+ * Build with LITTLEFS_XIP_CACHED to read through the cached XIP alias.
+ * Repeated reads of littlefs metadata then hit the XIP cache instead of QSPI.
+ * flash_range_program() and flash_range_erase() flush the cache on return, so
+ * cached reads stay coherent with the flash.
+ */
+#ifndef LITTLEFS_XIP_CACHED
+#define LITTLEFS_XIP_CACHED  0
+#endif
+
+
+/*
+ * Blocks erased before littlefs asks for them, and the time each erase took
+ */
+static uint32_t pre_erased_block[PRE_ERASE_MAX_BLOCKS / 32];
+static uint16_t pre_erase_us[PRE_ERASE_MAX_BLOCKS];
+static size_t num_pre_erased = 0;
+static uint32_t used_block[PRE_ERASE_MAX_BLOCKS / 32];
+static lfs_block_t last_erased_block = 0;
+static uint64_t last_access_at = 0;
+static littlefs_erase_stats_t erase_stats = {0};
+
+static littlefs_flash_stats_t flash_stats = {0};
+static uint32_t erase_count[PRE_ERASE_MAX_BLOCKS];
+static uint64_t interrupts_disabled_at = 0;
 
 
 static uint32_t fs_base(const struct lfs_config *c) {
@@ -18,6 +50,34 @@ static uint32_t fs_base(const struct lfs_config *c) {
     return PICO_FLASH_SIZE_BYTES - storage_size;
 }
 
+/*
+ * Count one block device operation in the log2 latency histogram of its type
+ */
+static void record_flash_op(littlefs_flash_op_t op, uint64_t start_at) {
+    uint32_t elapsed = time_us_64() - start_at;
+    size_t bucket = 0;
+    while (elapsed > 0 && bucket < LITTLEFS_FLASH_HISTOGRAM_SIZE - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+    flash_stats.count[op]++;
+    flash_stats.histogram[op][bucket]++;
+}
+
+static uint32_t disable_interrupts(void) {
+    uint32_t ints = save_and_disable_interrupts();
+    interrupts_disabled_at = time_us_64();
+    return ints;
+}
+
+static void enable_interrupts(uint32_t ints) {
+    uint32_t elapsed = time_us_64() - interrupts_disabled_at;
+    restore_interrupts(ints);
+    flash_stats.interrupts_disabled_us += elapsed;
+    if (elapsed > flash_stats.interrupts_disabled_max_us)
+        flash_stats.interrupts_disabled_max_us = elapsed;
+}
+
 static int pico_read(const struct lfs_config* c,
                      lfs_block_t block,
                      lfs_off_t off,
@@ -26,11 +86,41 @@ static int pico_read(const struct lfs_config* c,
 {
     (void)c;
 
+    uint64_t start_at = time_us_64();
+    last_access_at = start_at;
+#if LITTLEFS_XIP_CACHED
+    uint8_t* p = (uint8_t*)(XIP_BASE + fs_base(c) + (block * FLASH_SECTOR_SIZE) + off);
+    memcpy(buffer, p, size);  // the stream engine would bypass the cache
+#else
     uint8_t* p = (uint8_t*)(XIP_NOCACHE_NOALLOC_BASE + fs_base(c) + (block * FLASH_SECTOR_SIZE) + off);
-    memcpy(buffer, p, size);
+    flash_dma_read(p, buffer, size);
+#endif
+    flash_stats.read_bytes += size;
+    record_flash_op(LITTLEFS_FLASH_OP_READ, start_at);
     return 0;
 }
 
+static bool is_pre_erased(lfs_block_t block) {
+    if (block >= PRE_ERASE_MAX_BLOCKS)
+        return false;
+    return (pre_erased_block[block / 32] & (1u << (block % 32))) != 0;
+}
+
+static void set_pre_erased(lfs_block_t block, uint32_t erase_us) {
+    if (block >= PRE_ERASE_MAX_BLOCKS || is_pre_erased(block))
+        return;
+    pre_erased_block[block / 32] |= 1u << (block % 32);
+    pre_erase_us[block] = erase_us > UINT16_MAX ? UINT16_MAX : erase_us;
+    num_pre_erased++;
+}
+
+static void clear_pre_erased(lfs_block_t block) {
+    if (!is_pre_erased(block))
+        return;
+    pre_erased_block[block / 32] &= ~(1u << (block % 32));
+    num_pre_erased--;
+}
+
 static int pico_prog(const struct lfs_config* c,
                      lfs_block_t block,
                      lfs_off_t off,
@@ -38,24 +128,68 @@ static int pico_prog(const struct lfs_config* c,
                      lfs_size_t size)
 {
     (void)c;
+    clear_pre_erased(block);
+
+    uint64_t start_at = time_us_64();
+    last_access_at = start_at;
     uint32_t p = (block * FLASH_SECTOR_SIZE) + off;
-    uint32_t ints = save_and_disable_interrupts();
+    uint32_t ints = disable_interrupts();
     flash_range_program(fs_base(c) + p, buffer, size);
-    restore_interrupts(ints);
+    enable_interrupts(ints);
+    flash_stats.prog_bytes += size;
+    record_flash_op(LITTLEFS_FLASH_OP_PROG, start_at);
     return 0;
 }
 
-static int pico_erase(const struct lfs_config* c, lfs_block_t block) {
-    (void)c;
+/*
+ * Erase count blocks from block, and return the elapsed time
+ *
+ * flash_range_erase() uses the 64 KB block erase for every 64 KB aligned part of
+ * the range, which is several times faster per byte than the 4 KB sector erase.
+ */
+static uint32_t erase_blocks(const struct lfs_config *c, lfs_block_t block, lfs_size_t count) {
+    uint64_t start_at = time_us_64();
     uint32_t off = block * FLASH_SECTOR_SIZE;
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(fs_base(c) + off, FLASH_SECTOR_SIZE);
-    restore_interrupts(ints);
+    uint32_t ints = disable_interrupts();
+    flash_range_erase(fs_base(c) + off, count * FLASH_SECTOR_SIZE);
+    enable_interrupts(ints);
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (block + i < PRE_ERASE_MAX_BLOCKS)
+            erase_count[block + i]++;
+    }
+    return time_us_64() - start_at;
+}
+
+/*
+ * Number of blocks from block to the next 64 KB boundary of the flash
+ */
+static lfs_size_t blocks_to_block_erase_boundary(const struct lfs_config *c, lfs_block_t block) {
+    uint32_t sectors_per_block = FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE;
+    uint32_t sector = (fs_base(c) / FLASH_SECTOR_SIZE) + block;
+    return (sectors_per_block - sector % sectors_per_block) % sectors_per_block;
+}
+
+static int pico_erase(const struct lfs_config* c, lfs_block_t block) {
+    uint64_t start_at = time_us_64();
+    last_erased_block = block;
+    last_access_at = start_at;
+
+    if (is_pre_erased(block)) {
+        erase_stats.hits++;
+        erase_stats.hidden_us += pre_erase_us[block];
+        clear_pre_erased(block);
+    } else {
+        erase_stats.misses++;
+        erase_stats.exposed_us += erase_blocks(c, block, 1);
+    }
+    record_flash_op(LITTLEFS_FLASH_OP_ERASE, start_at);
     return 0;
 }
 
 static int pico_sync(const struct lfs_config* c) {
     (void)c;
+    uint64_t start_at = time_us_64();
+    record_flash_op(LITTLEFS_FLASH_OP_SYNC, start_at);
     return 0;
 }
 
@@ -64,11 +198,135 @@ const struct lfs_config lfs_pico_flash_config = {
     .prog  = pico_prog,
     .erase = pico_erase,
     .sync  = pico_sync,
-    .read_size      = 1,
-    .prog_size      = FLASH_PAGE_SIZE,
-    .block_size     = FLASH_SECTOR_SIZE,
-    .block_count    = FS_SIZE / FLASH_SECTOR_SIZE,
-    .cache_size     = FLASH_SECTOR_SIZE,
-    .lookahead_size = 16,
-    .block_cycles   = 500,
+    .read_size      = LITTLEFS_READ_SIZE,
+    .prog_size      = LITTLEFS_PROG_SIZE,
+    .block_size     = LITTLEFS_BLOCK_SIZE,
+    .block_count    = LITTLEFS_BLOCK_COUNT,
+    .cache_size     = LITTLEFS_CACHE_SIZE,
+    .lookahead_size = LITTLEFS_LOOKAHEAD_SIZE,
+    .block_cycles   = LITTLEFS_BLOCK_CYCLES,
 };
+
+static int mark_used_block(void *data, lfs_block_t block) {
+    (void)data;
+    if (block < PRE_ERASE_MAX_BLOCKS)
+        used_block[block / 32] |= 1u << (block % 32);
+    return 0;
+}
+
+static bool is_used_block(lfs_block_t block) {
+    return (used_block[block / 32] & (1u << (block % 32))) != 0;
+}
+
+/*
+ * Erase count free blocks from block ahead of littlefs
+ *
+ * The 64 KB aligned runs are erased with one block erase each, and the erased
+ * blocks are added to the pre-erased pool, so the later erase requests from
+ * littlefs for them return at once. The caller guarantees the blocks are free,
+ * for example the whole storage right before lfs_format().
+ */
+void littlefs_bulk_erase(lfs_block_t block, lfs_size_t count) {
+    const struct lfs_config *c = &lfs_pico_flash_config;
+    uint32_t sectors_per_block = FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE;
+
+    while (count > 0) {
+        // Up to the next 64 KB boundary, then 64 KB at a time
+        lfs_size_t n = blocks_to_block_erase_boundary(c, block);
+        if (n == 0)
+            n = sectors_per_block;
+        if (n > count)
+            n = count;
+
+        uint32_t elapsed = erase_blocks(c, block, n);
+        for (lfs_size_t i = 0; i < n; i++)
+            set_pre_erased(block + i, elapsed / n);
+        block += n;
+        count -= n;
+    }
+    last_access_at = time_us_64();
+}
+
+/*
+ * Erase free blocks that littlefs is likely to allocate next
+ *
+ * Call from the main loop with the lfs_t whose files are open; blocks of an
+ * open file are only known to the lfs_t that opened it. The littlefs allocator
+ * hands out free blocks in ascending order from the one it allocated last,
+ * so the blocks following the last erased block are erased first.
+ * Runs only after PRE_ERASE_IDLE_US without flash access, since the erase
+ * stalls the CPU with interrupts disabled. Only one 4 KB sector is erased per
+ * call, so the host waits at most one sector erase; the 64 KB block erase is
+ * left to littlefs_bulk_erase() before lfs_format().
+ */
+void littlefs_pre_erase_task(lfs_t *fs) {
+    const struct lfs_config *c = &lfs_pico_flash_config;
+
+    if (num_pre_erased >= PRE_ERASE_POOL_SIZE || c->block_count > PRE_ERASE_MAX_BLOCKS)
+        return;
+    if (time_us_64() - last_access_at < PRE_ERASE_IDLE_US)
+        return;
+
+    memset(used_block, 0, sizeof(used_block));
+    int err = lfs_fs_traverse(fs, mark_used_block, NULL);
+    if (err < 0) {
+        printf("littlefs_pre_erase_task: lfs_fs_traverse error=%d\n", err);
+        return;
+    }
+
+    for (lfs_block_t i = 1; i < c->block_count; i++) {
+        lfs_block_t block = (last_erased_block + i) % c->block_count;
+        if (is_used_block(block) || is_pre_erased(block))
+            continue;
+
+        set_pre_erased(block, erase_blocks(c, block, 1));
+        break;
+    }
+    last_access_at = time_us_64() - PRE_ERASE_IDLE_US;  // not an access by littlefs
+}
+
+void littlefs_erase_stats(littlefs_erase_stats_t *stats) {
+    memcpy(stats, &erase_stats, sizeof(erase_stats));
+}
+
+void littlefs_flash_stats(littlefs_flash_stats_t *stats) {
+    memcpy(stats, &flash_stats, sizeof(flash_stats));
+}
+
+uint32_t littlefs_erase_count(lfs_block_t block) {
+    if (block >= PRE_ERASE_MAX_BLOCKS)
+        return 0;
+    return erase_count[block];
+}
+
+/*
+ * Print the flash statistics to stdio, which is the USB CDC on this firmware
+ */
+void littlefs_print_flash_stats(void) {
+    static const char *op_name[] = {"read", "prog", "erase", "sync"};
+    const struct lfs_config *c = &lfs_pico_flash_config;
+
+    printf("flash: read %llu bytes, prog %llu bytes\n", flash_stats.read_bytes, flash_stats.prog_bytes);
+    printf("flash: interrupts disabled %llu us, max %lu us\n",
+           flash_stats.interrupts_disabled_us, flash_stats.interrupts_disabled_max_us);
+    printf("flash: pre-erase hits %lu, misses %lu, hidden %llu us, exposed %llu us\n",
+           erase_stats.hits, erase_stats.misses, erase_stats.hidden_us, erase_stats.exposed_us);
+
+    for (int op = 0; op < LITTLEFS_FLASH_OP_NUM; op++) {
+        printf("flash: %-5s %8lu ops, us <", op_name[op], flash_stats.count[op]);
+        for (size_t i = 0; i < LITTLEFS_FLASH_HISTOGRAM_SIZE; i++) {
+            if (flash_stats.histogram[op][i] > 0)
+                printf(" %lu:%lu", 1ul << i, flash_stats.histogram[op][i]);
+        }
+        printf("\n");
+    }
+
+    uint32_t max_count = 0;
+    uint32_t total_count = 0;
+    for (lfs_block_t block = 0; block < c->block_count && block < PRE_ERASE_MAX_BLOCKS; block++) {
+        total_count += erase_count[block];
+        if (erase_count[block] > max_count)
+            max_count = erase_count[block];
+    }
+    printf("flash: erase count total %lu, max %lu per block\n", total_count, max_count);
+}
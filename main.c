@@ -17,11 +17,11 @@
 #include <tusb.h>
 #include <lfs.h>
 #include "bootsel_button.h"
+#include "littlefs_driver.h"
 #include "mimic_fat.h"
+#include "usb_msc_driver.h"
 
 
-extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-
 #define FILENAME  "SENSOR.TXT"
 
 #define README_TXT \
@@ -37,26 +37,24 @@ extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
 #define ANSI_CLEAR "\e[0m"
 
 
-lfs_t fs;
-
 /*
  * Format the file system if it does not exist
  */
 static void test_filesystem_and_format_if_necessary(bool force_format) {
-   if (force_format || (lfs_mount(&fs, &lfs_pico_flash_config) != 0)) {
+    if (force_format || mimic_fat_init(&lfs_pico_flash_config) != 0) {
         printf("Format the onboard flash memory with littlefs\n");
 
-        lfs_format(&fs, &lfs_pico_flash_config);
-        lfs_mount(&fs, &lfs_pico_flash_config);
+        lfs_t *fs = mimic_fat_lock();
+        littlefs_bulk_erase(0, lfs_pico_flash_config.block_count);
+        mimic_fat_format();
 
         lfs_file_t f;
-        lfs_file_open(&fs, &f, "README.TXT", LFS_O_RDWR|LFS_O_CREAT);
-        lfs_file_write(&fs, &f, README_TXT, strlen(README_TXT));
-        lfs_file_close(&fs, &f);
+        lfs_file_open(fs, &f, "README.TXT", LFS_O_RDWR|LFS_O_CREAT);
+        lfs_file_write(fs, &f, README_TXT, strlen(README_TXT));
+        lfs_file_close(fs, &f);
+        mimic_fat_unlock();
 
-        if (mimic_fat_usb_device_is_enabled()) {
-            mimic_fat_create_cache();
-        }
+        mimic_fat_notify_changed(NULL);
     }
 }
 
@@ -74,13 +72,16 @@ static void sensor_logging_task(void) {
         count += 1;
         printf("Update %s\n", FILENAME);
 
+        lfs_t *fs = mimic_fat_lock();
         lfs_file_t f;
-        lfs_file_open(&fs, &f, FILENAME, LFS_O_RDWR|LFS_O_APPEND|LFS_O_CREAT);
+        lfs_file_open(fs, &f, FILENAME, LFS_O_RDWR|LFS_O_APPEND|LFS_O_CREAT);
         uint8_t buffer[512];
         snprintf((char *)buffer, sizeof(buffer), "click=%d\n", count);
-        lfs_file_write(&fs, &f, buffer, strlen((char *)buffer));
+        lfs_file_write(fs, &f, buffer, strlen((char *)buffer));
         printf((char *)buffer);
-        lfs_file_close(&fs, &f);
+        lfs_file_close(fs, &f);
+        mimic_fat_unlock();
+        mimic_fat_notify_changed(FILENAME);
     }
     last_status = button;
 
@@ -96,6 +97,15 @@ static void sensor_logging_task(void) {
     }
 }
 
+/*
+ * Print the flash statistics when 's' is received on the USB serial console
+ */
+static void flash_stats_task(void) {
+    int c = getchar_timeout_us(0);
+    if (c == 's')
+        littlefs_print_flash_stats();
+}
+
 int main(void) {
     //set_sys_clock_khz(250000, false);
 
@@ -104,8 +114,17 @@ int main(void) {
     stdio_init_all();
 
     test_filesystem_and_format_if_necessary(false);
+    mimic_fat_set_growing_file(FILENAME);
     while (true) {
         sensor_logging_task();
         tud_task();
+        usb_msc_driver_task();
+        mimic_fat_task();
+        flash_stats_task();
+
+        if (!usb_msc_driver_is_idle())
+            continue;
+        if (mimic_fat_is_idle() || !mimic_fat_usb_device_is_enabled())
+            littlefs_pre_erase_task(mimic_fat_filesystem());
     }
 }
@@ -5,6 +5,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 #include "mimic_fat.h"
+#include "dir_entry_diff.h"
 
 
 #define ANSI_RED "\e[31m"
@@ -85,13 +86,14 @@ static uint8_t fat_disk_image[1][DISK_SECTOR_SIZE] = {
 };
 
 static lfs_t real_filesystem;
+static bool is_mounted = false;
+static bool is_locked = false;
 static bool usb_device_is_enabled = false;
 
 static lfs_file_t fat_cache;
+static bool fat_cache_is_open = false;
 
-void mimic_fat_init(const struct lfs_config *c) {
-    littlefs_lfs_config = c;
-}
+static mimic_fat_sync_stats_t sync_stats = {0};
 
 bool mimic_fat_usb_device_is_enabled(void) {
     return usb_device_is_enabled;
@@ -101,6 +103,65 @@ void mimic_fat_update_usb_device_is_enabled(bool enable) {
     usb_device_is_enabled = enable;
 }
 
+/*
+ * Files that the firmware keeps appending to, such as logs
+ */
+typedef struct {
+    char path[LFS_NAME_MAX + 1];
+    bool is_reserved;     // the chain in the cache runs past the end of the file
+    uint64_t grown_at;
+} growing_file_t;
+
+static growing_file_t growing_file[MIMIC_FAT_GROWING_FILE_MAX];
+static size_t growing_file_num = 0;
+
+static growing_file_t *growing_file_find(const char *path) {
+    for (size_t i = 0; i < growing_file_num; i++) {
+        if (strcmp(growing_file[i].path, path) == 0)
+            return &growing_file[i];
+    }
+    return NULL;
+}
+
+/*
+ * Bytes reserved past the end of the file path
+ */
+static size_t growing_file_reserve(const char *path) {
+    return growing_file_find(path) != NULL ? MIMIC_FAT_GROWING_FILE_RESERVE * DISK_SECTOR_SIZE : 0;
+}
+
+/*
+ * Record that the chain of path has been laid out with the reserve
+ */
+static void growing_file_touch(const char *path) {
+    growing_file_t *file = growing_file_find(path);
+    if (file == NULL)
+        return;
+    file->is_reserved = true;
+    file->grown_at = time_us_64();
+}
+
+/*
+ * Register path as a growing file
+ *
+ * MIMIC_FAT_GROWING_FILE_RESERVE clusters are laid out past the end of the file, so
+ * that appending to it only changes the size in its directory entry. Call before
+ * the cache is built.
+ */
+bool mimic_fat_set_growing_file(const char *path) {
+    while (*path == '/')
+        path++;
+    if (growing_file_reserve(path) > 0)
+        return true;
+    if (growing_file_num >= MIMIC_FAT_GROWING_FILE_MAX || strlen(path) > LFS_NAME_MAX)
+        return false;
+    growing_file_t *file = &growing_file[growing_file_num++];
+    strcpy(file->path, path);
+    file->is_reserved = false;
+    return true;
+}
+
+
 
 static void print_block(uint8_t *buffer, size_t l) {
     size_t offset = 0;
@@ -191,6 +252,31 @@ static int is_fat_sfn_symbol(uint8_t c) {
     }
 }
 
+/*
+ * Allocation state of each cluster, mirrored from the FAT
+ *
+ * Lets reads of free clusters be answered without following the FAT chains
+ * and searching the directory entries.
+ */
+#define ALLOCATED_CLUSTER_MAX  4096  // FAT12
+
+static uint32_t allocated_cluster[ALLOCATED_CLUSTER_MAX / 32];
+
+static void set_allocated_cluster(uint32_t cluster, uint16_t value) {
+    if (cluster >= ALLOCATED_CLUSTER_MAX)
+        return;
+    if (value != 0)
+        allocated_cluster[cluster / 32] |= 1u << (cluster % 32);
+    else
+        allocated_cluster[cluster / 32] &= ~(1u << (cluster % 32));
+}
+
+static bool is_allocated_cluster(uint32_t cluster) {
+    if (cluster >= ALLOCATED_CLUSTER_MAX)
+        return true;
+    return (allocated_cluster[cluster / 32] & (1u << (cluster % 32))) != 0;
+}
+
 static uint16_t read_fat(int cluster) {
     uint16_t offset = (uint16_t)floor((float)cluster + ((float)cluster / 2));
     lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
@@ -243,7 +329,9 @@ static void update_fat(uint32_t cluster, uint16_t value) {
     s = lfs_file_write(&real_filesystem, &fat_cache, previous, sizeof(previous));
     if (s != sizeof(previous)) {
         printf("update_fat: lfs_file_write error=%ld\n", s);
+        return;
     }
+    set_allocated_cluster(cluster, value);
 }
 
 #define BUFFER_SIZE  512
@@ -296,19 +384,18 @@ static size_t bulk_update_fat(uint32_t start_cluster, size_t size) {
         int buffer_index = offset % sector_size;
 
         next_cluster = (i < num_clusters - 1) ? current_cluster + 1 : END_OF_CLUSTER_CHAIN;
-        if (current_cluster & 0x01) {
+        set_allocated_cluster(current_cluster, next_cluster);
+        if (current_cluster & 0x01)
             buffer[buffer_index] = (buffer[buffer_index] & 0x0F) | (next_cluster << 4);
-            buffer[buffer_index + 1] = (next_cluster >> 4) & 0xFF;
-        } else {
+        else
             buffer[buffer_index] = next_cluster & 0xFF;
-            buffer[buffer_index + 1] = (buffer[buffer_index + 1] & 0xF0) | ((next_cluster >> 8) & 0x0F);
-        }
-
-        // FAT12 sector boundaries
-        if (((current_cluster & 0x01) && buffer_index + 2 >= sector_size) ||
-             (buffer_index + 1 >= sector_size))
-        {
 
+        if (buffer_index + 1 < sector_size) {
+            if (current_cluster & 0x01)
+                buffer[buffer_index + 1] = (next_cluster >> 4) & 0xFF;
+            else
+                buffer[buffer_index + 1] = (buffer[buffer_index + 1] & 0xF0) | ((next_cluster >> 8) & 0x0F);
+        } else {  // FAT12 entry across the sector boundary
             size_t write = bulk_update_fat_buffer_write(initial_sector * BUFFER_SIZE, buffer, sizeof(buffer));
             if (write == 0)
                 return 0;
@@ -349,8 +436,15 @@ static void init_fat(void) {
         }
     }
 
+    if (fat_cache_is_open)
+        lfs_file_close(&real_filesystem, &fat_cache);
     err = lfs_file_open(&real_filesystem, &fat_cache, ".mimic/FAT", LFS_O_RDWR|LFS_O_CREAT);
     assert(err == 0);
+    fat_cache_is_open = true;
+
+    memset(allocated_cluster, 0, sizeof(allocated_cluster));
+    set_allocated_cluster(0, 0xFF8);  // media descriptor
+    set_allocated_cluster(1, 0xFFF);  // root directory
 
     uint8_t head[3] = {0xF8, 0xFF, 0xFF};
     head[0] = 0xF8;
@@ -650,10 +744,263 @@ static bool save_temporary_file(uint32_t cluster, void *buffer) {
     return 1;
 }
 
+/*
+ * Flash blocks of the file last read by the host
+ *
+ * littlefs stores a file as a CTZ skip-list, and lfs_file_read() walks the list and
+ * copies through the littlefs cache for every sector. The list is followed once per
+ * file to map each block index to its flash block, and file data is then read
+ * directly with the block device read function into the USB buffer.
+ * The map is invalidated when the mapped file, or a directory above it, is written,
+ * truncated, renamed or removed, and when the application takes littlefs.
+ */
+#define BLOCK_MAP_SIZE  512
+
+typedef struct {
+    bool is_valid;
+    uint32_t base_cluster;
+    char path[LFS_NAME_MAX + 1];
+    lfs_size_t size;
+    lfs_block_t block[BLOCK_MAP_SIZE];
+} block_map_t;
+
+static block_map_t block_map;
+
+static void block_map_invalidate(void) {
+    block_map.is_valid = false;
+}
+
+static void block_map_invalidate_path(const char *path) {
+    size_t length = strlen(path);
+    if (block_map.is_valid
+        && strncmp(block_map.path, path, length) == 0
+        && (block_map.path[length] == '\0' || block_map.path[length] == '/'))
+    {
+        block_map.is_valid = false;
+    }
+}
+
+/*
+ * Index of the CTZ block that holds the file offset *off, and the offset within the block
+ *
+ * Same as lfs_ctz_index() of littlefs.
+ */
+static lfs_size_t block_map_index(lfs_off_t *off) {
+    lfs_off_t size = *off;
+    lfs_off_t b = littlefs_lfs_config->block_size - 2 * 4;
+    lfs_off_t i = size / b;
+    if (i == 0)
+        return 0;
+
+    i = (size - 4 * (__builtin_popcount(i - 1) + 2)) / b;
+    *off = size - b * i - 4 * __builtin_popcount(i);
+    return i;
+}
+
+static bool block_map_build(const char *path, uint32_t base_cluster) {
+    block_map.is_valid = false;
+
+    lfs_file_t f;
+    int err = lfs_file_open(&real_filesystem, &f, path, LFS_O_RDONLY);
+    if (err != LFS_ERR_OK) {
+        printf("block_map_build: lfs_file_open('%s') error=%d\n", path, err);
+        return false;
+    }
+    bool is_inline = (f.flags & LFS_F_INLINE) != 0;
+    lfs_block_t head = f.ctz.head;
+    lfs_size_t size = f.ctz.size;
+    lfs_file_close(&real_filesystem, &f);
+    if (is_inline || size == 0)
+        return false;
+
+    lfs_off_t off = size - 1;
+    lfs_size_t last = block_map_index(&off);
+    if (last >= BLOCK_MAP_SIZE)
+        return false;
+
+    // The first pointer of each block refers to the previous block
+    block_map.block[last] = head;
+    for (lfs_size_t i = last; i > 0; i--) {
+        uint32_t prev;
+        err = littlefs_lfs_config->read(littlefs_lfs_config, block_map.block[i], 0, &prev, sizeof(prev));
+        if (err != LFS_ERR_OK) {
+            printf("block_map_build: read(block=%lu) error=%d\n", block_map.block[i], err);
+            return false;
+        }
+        block_map.block[i - 1] = LITTLE_ENDIAN32(prev);
+    }
+
+    block_map.base_cluster = base_cluster;
+    strncpy(block_map.path, path, sizeof(block_map.path) - 1);
+    block_map.path[sizeof(block_map.path) - 1] = '\0';
+    block_map.size = size;
+    block_map.is_valid = true;
+    return true;
+}
+
+/*
+ * Clusters written by the host whose contents are not yet reflected in littlefs
+ */
+#define DIRTY_CLUSTER_MAX  4096  // FAT12
+
+static uint32_t dirty_cluster[DIRTY_CLUSTER_MAX / 32];
+
+static void set_dirty_cluster(uint32_t cluster, bool is_dirty) {
+    if (cluster >= DIRTY_CLUSTER_MAX)
+        return;
+    if (is_dirty)
+        dirty_cluster[cluster / 32] |= 1u << (cluster % 32);
+    else
+        dirty_cluster[cluster / 32] &= ~(1u << (cluster % 32));
+}
+
+static bool is_dirty_cluster(uint32_t cluster) {
+    if (cluster >= DIRTY_CLUSTER_MAX)
+        return true;
+    return (dirty_cluster[cluster / 32] & (1u << (cluster % 32))) != 0;
+}
+
+/*
+ * Files kept open while the host streams data sectors into them
+ *
+ * Consecutive sectors of the same file are written through one handle, so that
+ * littlefs commits its metadata only when the handle is closed: on idle timeout,
+ * before directory entries are updated, or on mimic_fat_flush().
+ */
+#define WRITE_HANDLE_SIZE             2
+#define WRITE_HANDLE_IDLE_TIMEOUT_US  (200 * 1000)
+
+typedef struct {
+    bool is_opened;
+    uint32_t base_cluster;
+    char path[LFS_NAME_MAX + 1];
+    lfs_file_t file;
+    size_t next_offset;
+    uint64_t updated_at;
+} write_handle_t;
+
+static write_handle_t write_handle[WRITE_HANDLE_SIZE];
+
+static write_handle_t *write_handle_find(uint32_t base_cluster, const char *path) {
+    for (size_t i = 0; i < WRITE_HANDLE_SIZE; i++) {
+        if (write_handle[i].is_opened
+            && write_handle[i].base_cluster == base_cluster
+            && strcmp(write_handle[i].path, path) == 0)
+        {
+            return &write_handle[i];
+        }
+    }
+    return NULL;
+}
+
+static void write_handle_close(write_handle_t *handle) {
+    if (!handle->is_opened)
+        return;
+
+    TRACE(ANSI_RED "write_handle_close('%s')\n" ANSI_CLEAR, handle->path);
+    handle->is_opened = false;
+    block_map_invalidate_path(handle->path);
+    int err = lfs_file_close(&real_filesystem, &handle->file);
+    if (err != LFS_ERR_OK) {
+        printf("write_handle_close: lfs_file_close('%s') error=%d\n", handle->path, err);
+    }
+}
+
+static void write_handle_close_all(void) {
+    for (size_t i = 0; i < WRITE_HANDLE_SIZE; i++) {
+        write_handle_close(&write_handle[i]);
+    }
+}
+
+/*
+ * Open path for writing. A rewrite from the beginning keeps the current content,
+ * since sectors the host rewrites unchanged are skipped; the file is cut to the
+ * size in the directory entry once its last cluster is written.
+ */
+static write_handle_t *write_handle_open(uint32_t base_cluster, const char *path, bool create) {
+    write_handle_t *handle = &write_handle[0];
+    for (size_t i = 0; i < WRITE_HANDLE_SIZE; i++) {
+        if (!write_handle[i].is_opened) {
+            handle = &write_handle[i];
+            break;
+        }
+        if (write_handle[i].updated_at < handle->updated_at)
+            handle = &write_handle[i];
+    }
+    write_handle_close(handle);
+
+    TRACE(ANSI_RED "write_handle_open('%s', base_cluster=%lu, create=%d)\n" ANSI_CLEAR, path, base_cluster, create);
+    block_map_invalidate_path(path);
+    int flags = create ? LFS_O_WRONLY|LFS_O_CREAT : LFS_O_WRONLY;
+    int err = lfs_file_open(&real_filesystem, &handle->file, path, flags);
+    if (err != LFS_ERR_OK) {
+        printf("write_handle_open: lfs_file_open('%s') error=%d\n", path, err);
+        return NULL;
+    }
+    handle->is_opened = true;
+    handle->base_cluster = base_cluster;
+    strncpy(handle->path, path, sizeof(handle->path) - 1);
+    handle->path[sizeof(handle->path) - 1] = '\0';
+    handle->next_offset = 0;
+    handle->updated_at = time_us_64();
+    return handle;
+}
+
+/*
+ * Journal of directory entry sectors written by the host but not yet applied to littlefs.
+ *
+ * Hosts rewrite the same directory sector several times while creating or updating
+ * a single file. Only the latest image of each sector is kept, and the difference
+ * from the committed image is applied to littlefs when the host moves on to file data,
+ * on idle timeout or on mimic_fat_flush().
+ */
+#define DIR_JOURNAL_SIZE             4
+#define DIR_JOURNAL_IDLE_TIMEOUT_US  (500 * 1000)
+
+typedef struct {
+    bool is_pending;
+    uint32_t cluster;
+    uint32_t sequence;
+    uint64_t updated_at;
+    fat_dir_entry_t entry[DISK_SECTOR_SIZE / sizeof(fat_dir_entry_t)];
+} dir_journal_t;
+
+static dir_journal_t dir_journal[DIR_JOURNAL_SIZE];
+static uint32_t dir_journal_sequence = 0;
+static bool dir_journal_is_committing = false;
+
+static dir_journal_t *dir_journal_find(uint32_t cluster) {
+    if (cluster == 0)
+        cluster = 1;  // root directory
+    for (size_t i = 0; i < DIR_JOURNAL_SIZE; i++) {
+        if (dir_journal[i].is_pending && dir_journal[i].cluster == cluster)
+            return &dir_journal[i];
+    }
+    return NULL;
+}
+
+static void dir_journal_commit_all(void);
+static void deleted_entry_reset(void);
+static void sector_hash_reset(void);
+static void apply_changed_entry(const char *path, bool keep_reserve);
+
+static void dir_journal_reset(void) {
+    memset(dir_journal, 0, sizeof(dir_journal));
+    dir_journal_is_committing = false;
+}
+
 static int read_temporary_file(uint32_t cluster, void *buffer) {
     lfs_file_t f;
     char filename[LFS_NAME_MAX + 1];
 
+    // Pending directory entries take precedence over the committed cache,
+    // except while the pending entries are being applied to littlefs.
+    dir_journal_t *journal = dir_journal_is_committing ? NULL : dir_journal_find(cluster);
+    if (journal != NULL) {
+        memcpy(buffer, journal->entry, sizeof(journal->entry));
+        return LFS_ERR_OK;
+    }
+
     int tens = (cluster/ 10) % 10;
     int hundreds = (cluster/ 100) % 10;
     int thousands = (cluster/ 1000) % 10;
@@ -794,6 +1141,16 @@ static fat_dir_entry_t *append_dir_entry_file(fat_dir_entry_t *entry, struct lfs
     return entry;
 }
 
+/*
+ * Append the long filename entries and the short filename entry of a littlefs
+ * file or directory. Returns the position following the appended entries
+ */
+fat_dir_entry_t *mimic_fat_append_dir_entry(fat_dir_entry_t *entry, struct lfs_info *finfo, uint32_t cluster) {
+    if (finfo->type == LFS_TYPE_DIR)
+        return append_dir_entry_directory(entry, finfo, cluster);
+    return append_dir_entry_file(entry, finfo, cluster);
+}
+
 /*
  * Create a directory entry cache corresponding to the base file system
  *
@@ -868,8 +1225,15 @@ static int create_dir_entry_cache(const char *path, uint32_t parent_cluster, uin
 
         } else if (finfo.type == LFS_TYPE_REG) {
             uint32_t file_cluster = *allocated_cluster + 1;
-            if (finfo.size > 0)
-                *allocated_cluster = bulk_update_fat(file_cluster, finfo.size);
+            if (parent_cluster == 0)
+                strncpy(directory_path, finfo.name, sizeof(directory_path));
+            else
+                snprintf(directory_path, sizeof(directory_path), "%s/%s", path, finfo.name);
+            directory_path[LFS_NAME_MAX] = '\0';
+            if (finfo.size > 0) {
+                *allocated_cluster = bulk_update_fat(file_cluster, finfo.size + growing_file_reserve(directory_path));
+                growing_file_touch(directory_path);
+            }
             entry = append_dir_entry_file(entry, &finfo, file_cluster);
         }
     }
@@ -878,6 +1242,55 @@ static int create_dir_entry_cache(const char *path, uint32_t parent_cluster, uin
     return 0;
 }
 
+/*
+ * Mount littlefs on c
+ *
+ * The mounted lfs_t is the only instance on the device; the application uses it
+ * through mimic_fat_lock(). Files the mimic keeps open are dropped when it is
+ * mounted again.
+ */
+int mimic_fat_init(const struct lfs_config *c) {
+    if (is_mounted) {
+        write_handle_close_all();
+        lfs_unmount(&real_filesystem);
+        is_mounted = false;
+    }
+    fat_cache_is_open = false;
+    littlefs_lfs_config = c;
+
+    int err = lfs_mount(&real_filesystem, littlefs_lfs_config);
+    if (err < 0) {
+        printf("mimic_fat_init: lfs_mount error=%d\n", err);
+        return err;
+    }
+    is_mounted = true;
+    return LFS_ERR_OK;
+}
+
+/*
+ * Format littlefs and mount it again. Call while holding mimic_fat_lock().
+ */
+int mimic_fat_format(void) {
+    if (is_mounted) {
+        lfs_unmount(&real_filesystem);
+        is_mounted = false;
+    }
+    fat_cache_is_open = false;
+
+    int err = lfs_format(&real_filesystem, littlefs_lfs_config);
+    if (err < 0) {
+        printf("mimic_fat_format: lfs_format error=%d\n", err);
+        return err;
+    }
+    err = lfs_mount(&real_filesystem, littlefs_lfs_config);
+    if (err < 0) {
+        printf("mimic_fat_format: lfs_mount error=%d\n", err);
+        return err;
+    }
+    is_mounted = true;
+    return LFS_ERR_OK;
+}
+
 /*
  * Rebuild the directory entry cache.
  *
@@ -886,14 +1299,18 @@ static int create_dir_entry_cache(const char *path, uint32_t parent_cluster, uin
 void mimic_fat_create_cache(void) {
     TRACE(ANSI_RED "mimic_fat_create_cache()\n" ANSI_CLEAR);
 
-    lfs_unmount(&real_filesystem);
-    int err = lfs_mount(&real_filesystem, littlefs_lfs_config);
-    if (err < 0) {
-        printf("mimic_fat_create_cache: lfs_mount error=%d\n", err);
+    if (!is_mounted) {
+        printf("mimic_fat_create_cache: littlefs is not mounted\n");
         return;
     }
+    write_handle_close_all();
 
     mimic_fat_cleanup_cache();
+    dir_journal_reset();
+    block_map_invalidate();
+    deleted_entry_reset();
+    memset(dirty_cluster, 0, sizeof(dirty_cluster));
+    sector_hash_reset();
 
     init_fat();
 
@@ -927,6 +1344,7 @@ static void delete_directory(const char *path) {
         snprintf((char *)filename, sizeof(filename), "%s/%s", path, finfo.name);
         if (finfo.type == LFS_TYPE_DIR)
             delete_directory((const char *)filename);
+        block_map_invalidate_path((const char *)filename);
         err = lfs_remove(&real_filesystem, (const char *)filename);
         if (err != LFS_ERR_OK) {
             printf("delete_directory: lfs_remove('%s') error=%d\n", filename, err);
@@ -942,6 +1360,10 @@ void mimic_fat_cleanup_cache(void) {
     lfs_dir_t dir;
     struct lfs_info finfo;
 
+    if (fat_cache_is_open) {
+        lfs_file_close(&real_filesystem, &fat_cache);
+        fat_cache_is_open = false;
+    }
     int err = lfs_dir_open(&real_filesystem, &dir, ".mimic");
     if (err != LFS_ERR_OK) {
         return;
@@ -990,17 +1412,26 @@ size_t mimic_fat_total_sector_size(void) {
 static void read_boot_sector(void *buffer, uint32_t bufsize) {
     TRACE("\e[36mRead read_boot_sector()\e[0m\n");
 
+    uint8_t boot_sector[DISK_SECTOR_SIZE];
+    mimic_fat_boot_sector(boot_sector, mimic_fat_total_sector_size());
+    memcpy(buffer, boot_sector, bufsize);
+}
+
+/*
+ * Build the boot sector of a FAT image of total_sector_size sectors
+ */
+void mimic_fat_boot_sector(void *buffer, size_t total_sector_size) {
+    uint8_t *sector = buffer;
+    memcpy(sector, fat_disk_image[0], DISK_SECTOR_SIZE);
+
     // BPB_TotSec16
-    fat_disk_image[0][19] = (uint8_t)(mimic_fat_total_sector_size() & 0xFF);
-    fat_disk_image[0][20] = (uint8_t)(mimic_fat_total_sector_size() >> 8);
+    sector[19] = (uint8_t)(total_sector_size & 0xFF);
+    sector[20] = (uint8_t)(total_sector_size >> 8);
 
     // BPB_FATSz16
-    size_t fat_size = ceil((double)mimic_fat_total_sector_size() / DISK_SECTOR_SIZE);
-    fat_disk_image[0][22] = fat_size & 0xFF;
-    fat_disk_image[0][23] = (fat_size & 0xFF00) >> 8;
-
-    uint8_t const *addr = fat_disk_image[0];
-    memcpy(buffer, addr, bufsize);
+    size_t fat_size = ceil((double)total_sector_size / DISK_SECTOR_SIZE);
+    sector[22] = fat_size & 0xFF;
+    sector[23] = (fat_size & 0xFF00) >> 8;
 }
 
 /*
@@ -1025,7 +1456,7 @@ static void read_fat_sector(uint32_t sector, void *buffer, uint32_t bufsize) {
 }
 
 static void save_fat_sector(uint32_t request_block, void *buffer, size_t bufsize) {
-    size_t offset = (request_block - 1) * bufsize;
+    size_t offset = (request_block - 1) * DISK_SECTOR_SIZE;
     lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
     if (o < 0) {
         printf("save_fat_sector: lfs_file_seek error=%ld\n", o);
@@ -1034,7 +1465,48 @@ static void save_fat_sector(uint32_t request_block, void *buffer, size_t bufsize
     lfs_ssize_t s = lfs_file_write(&real_filesystem, &fat_cache, buffer, bufsize);
     if (s != (lfs_ssize_t)bufsize) {
         printf("save_fat_sector: lfs_file_read error=%ld\n", s);
+        return;
     }
+
+    // FAT12 entry n occupies the bytes n * 3 / 2 and n * 3 / 2 + 1
+    const uint8_t *p = buffer;
+    for (size_t n = offset * 2 / 3; n < cluster_size() && n * 3 / 2 < offset + bufsize; n++) {
+        size_t i = n * 3 / 2;
+        if (i < offset || i + 1 >= offset + bufsize) {  // entry across sectors
+            set_allocated_cluster(n, read_fat(n));
+            continue;
+        }
+        i -= offset;
+        uint16_t value = (n & 0x01) ? (p[i] >> 4) | ((uint16_t)p[i + 1] << 4)
+                                    : p[i] | ((uint16_t)(p[i + 1] & 0x0F) << 8);
+        set_allocated_cluster(n, value);
+    }
+}
+
+typedef enum {
+    SECTOR_TYPE_BOOT = 0,
+    SECTOR_TYPE_FAT,
+    SECTOR_TYPE_ROOT,
+    SECTOR_TYPE_FREE,
+    SECTOR_TYPE_ALLOCATED,
+    SECTOR_TYPE_OUT_OF_RANGE,
+} sector_type_t;
+
+/*
+ * Classify a sector from its position and the allocation state of its cluster
+ */
+static sector_type_t sector_type(uint32_t sector) {
+    if (sector == 0)
+        return SECTOR_TYPE_BOOT;
+    if (is_fat_sector(sector))
+        return SECTOR_TYPE_FAT;
+    if (sector >= mimic_fat_total_sector_size())
+        return SECTOR_TYPE_OUT_OF_RANGE;
+
+    uint32_t cluster = sector - fat_sector_size();
+    if (cluster == 1)
+        return SECTOR_TYPE_ROOT;
+    return is_allocated_cluster(cluster) ? SECTOR_TYPE_ALLOCATED : SECTOR_TYPE_FREE;
 }
 
 /*
@@ -1383,154 +1855,163 @@ static void create_blank_dir_entry_cache(uint32_t cluster, uint32_t parent_dir_c
 }
 
 /*
+ * Read file data at pos through the block map; returns false if the file can not be mapped
  */
-void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize) {
+static bool block_map_read(const char *path, uint32_t base_cluster, lfs_off_t pos, void *buffer, uint32_t bufsize) {
+    if (!block_map.is_valid
+        || block_map.base_cluster != base_cluster
+        || strcmp(block_map.path, path) != 0)
+    {
+        if (!block_map_build(path, base_cluster))
+            return false;
+    }
+
+    uint8_t *p = buffer;
+    while (bufsize > 0 && pos < block_map.size) {
+        lfs_off_t off = pos;
+        lfs_size_t index = block_map_index(&off);
+        lfs_size_t size = littlefs_lfs_config->block_size - off;
+        if (size > bufsize)
+            size = bufsize;
+        if (size > block_map.size - pos)
+            size = block_map.size - pos;
+
+        int err = littlefs_lfs_config->read(littlefs_lfs_config, block_map.block[index], off, p, size);
+        if (err != LFS_ERR_OK) {
+            printf("block_map_read: read(block=%lu) error=%d\n", block_map.block[index], err);
+            block_map_invalidate();
+            return false;
+        }
+        p += size;
+        pos += size;
+        bufsize -= size;
+    }
+    memset(p, 0, bufsize);  // past the end of the file
+    return true;
+}
+
+/*
+ * Number of sectors from sector, up to max, that have the same type
+ */
+static uint32_t sector_type_run(uint32_t sector, uint32_t max) {
+    sector_type_t type = sector_type(sector);
+    uint32_t n = 1;
+    while (n < max && sector_type(sector + n) == type)
+        n++;
+    return n;
+}
+
+/*
+ * Number of clusters from cluster, up to max, that follow each other in the FAT chain
+ */
+static uint32_t contiguous_cluster_run(uint32_t cluster, uint32_t max) {
+    uint32_t n = 1;
+    while (n < max && read_fat(cluster + n - 1) == cluster + n)
+        n++;
+    return n;
+}
+
+static uint32_t run_bytes(uint32_t sectors, uint32_t bufsize) {
+    return (sectors * DISK_SECTOR_SIZE < bufsize) ? sectors * DISK_SECTOR_SIZE : bufsize;
+}
+
+/*
+ * Read the run of sectors from sector that is served with one operation: the FAT,
+ * free space, or contiguous clusters of one file. Returns the number of bytes read.
+ */
+static uint32_t read_sector_run(uint32_t sector, void *buffer, uint32_t bufsize) {
     TRACE("\e[36mRead sector=%lu mimic_fat_read()\e[0m\n", sector);
-    (void)lun;
 
-    if (sector == 0) {
-        read_boot_sector(buffer, bufsize);
-        return;
-    } else if (is_fat_sector(sector)) {
-        read_fat_sector(sector, buffer, bufsize);
-        return;
+    uint32_t max_sectors = (bufsize + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+    uint32_t size = run_bytes(1, bufsize);
+
+    switch (sector_type(sector)) {
+    case SECTOR_TYPE_BOOT:
+        read_boot_sector(buffer, size);
+        return size;
+    case SECTOR_TYPE_FAT:
+        size = run_bytes(sector_type_run(sector, max_sectors), bufsize);
+        read_fat_sector(sector, buffer, size);
+        return size;
+    case SECTOR_TYPE_ROOT:
+        if (read_temporary_file(1, buffer) != 0)
+            memset(buffer, 0, size);
+        return size;
+    case SECTOR_TYPE_FREE:
+    case SECTOR_TYPE_OUT_OF_RANGE:
+        size = run_bytes(sector_type_run(sector, max_sectors), bufsize);
+        memset(buffer, 0, size);
+        return size;
+    case SECTOR_TYPE_ALLOCATED:
+        break;
     }
 
     uint32_t cluster = sector - fat_sector_size();
     size_t offset = 0;
     find_dir_entry_cache_result_t result = {0};
 
-    if (cluster == 1) {
-        read_temporary_file(cluster, buffer);
-        return;
-    }
-
     uint32_t base_cluster = find_base_cluster_and_offset(cluster, &offset);
     if (base_cluster == 0) { // is not allocated
-        return;
+        memset(buffer, 0, size);
+        return size;
     }
 
     find_dir_entry_cache_return_t r = find_dir_entry_cache(&result, 1, base_cluster);
-    if (r != FIND_DIR_ENTRY_CACHE_RESULT_FOUND)
-        return;
+    if (r != FIND_DIR_ENTRY_CACHE_RESULT_FOUND) {
+        memset(buffer, 0, size);
+        return size;
+    }
     if (result.is_directory) {
-        read_temporary_file(cluster, buffer);
-        return;
+        if (read_temporary_file(cluster, buffer) != 0)
+            memset(buffer, 0, size);
+        return size;
     }
 
     TRACE("mimic_fat_read: result.path='%s'\n", result.path);
 
+    dir_journal_commit_all();
+    write_handle_close_all();
+
+    size = run_bytes(contiguous_cluster_run(cluster, max_sectors), bufsize);
+    if (block_map_read(result.path, base_cluster, offset * DISK_SECTOR_SIZE, buffer, size))
+        return size;
+
+    memset(buffer, 0, size);  // past the end of the file
     lfs_file_t f;
     int err = lfs_file_open(&real_filesystem, &f, result.path, LFS_O_RDONLY);
     if (err != LFS_ERR_OK) {
         printf("mimic_fat_read_cluster: lfs_file_open('%s') error=%d\n", result.path, err);
-        return;
+        return size;
     }
 
     lfs_soff_t seek = lfs_file_seek(&real_filesystem, &f, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET);
     if (seek < 0) {
         printf("mimic_fat_read: lfs_file_seek(path='%s', offset=%u) error=%ld\n", result.path, offset * DISK_SECTOR_SIZE, seek);
     }
-    lfs_ssize_t size = lfs_file_read(&real_filesystem, &f, buffer, bufsize);
-    if (size < 0) {
-        printf("mimic_fat_read: lfs_file_read(path='%s', offset=%u) error=%ld\n", result.path, offset, seek);
+    lfs_ssize_t read_size = lfs_file_read(&real_filesystem, &f, buffer, size);
+    if (read_size < 0) {
+        printf("mimic_fat_read: lfs_file_read(path='%s', offset=%u) error=%ld\n", result.path, offset, read_size);
     }
     lfs_file_close(&real_filesystem, &f);
+    return size;
 }
 
-static void difference_of_dir_entry(fat_dir_entry_t *orig, fat_dir_entry_t *new,
-                                    fat_dir_entry_t *update,
-                                    fat_dir_entry_t *delete)
-{
-    bool is_found = false;
-    TRACE("difference_of_dir_entry-----\n");
-    print_dir_entry(orig);
-    TRACE("----------------------------\n");
-    print_dir_entry(new);
-    TRACE("----------------------------\n");
-
-    if (memcmp(orig, new, sizeof(fat_dir_entry_t) * 16) == 0) {
-        return;
+/*
+ * Read bufsize bytes from sector, which may span several sectors of different types
+ */
+static void read_sector(uint32_t sector, void *buffer, uint32_t bufsize) {
+    uint8_t *p = buffer;
+    while (bufsize > 0) {
+        uint32_t size = read_sector_run(sector, p, bufsize);
+        sector += size / DISK_SECTOR_SIZE;
+        p += size;
+        bufsize -= size;
     }
+}
 
-    for (int i = 0; i < 16; i++) {
-        if (strncmp((const char *)new[i].DIR_Name, ".          ", 11) == 0
-            || strncmp((const char *)new[i].DIR_Name, "..         ", 11) == 0
-            || (new[i].DIR_Attr & 0x0F) == 0x0F
-            || (new[i].DIR_Attr & 0x08) == 0x08) // volume label
-        {
-            continue;
-        }
-
-        if (new[i].DIR_Name[0] == 0xE5) {
-            for (int j = 0; j < 16; j++) {
-                if ((orig[j].DIR_Attr & 0x08) == 0x08) // volume label
-                    continue;
-                if (new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO
-                    && new[i].DIR_FileSize == orig[j].DIR_FileSize
-                    && orig[j].DIR_Name[0] != 0xE5
-                    && new[i].DIR_FileSize != 0)
-                {
-                    // `delete` or `rename`.
-                    memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
-                    delete++;
-                    break;
-                }
-
-                if (orig[j].DIR_Attr & 0x10  // directory
-                    && new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO
-                    && new[i].DIR_FileSize == 0
-                    && orig[j].DIR_Name[0] != 0xE5
-                    && i == j)
-                {
-                    // `delete` or `rename`.
-                    memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
-                    delete++;
-                    break;
-                }
-            }
-            continue;
-        }
-
-        is_found = false;
-        for (int j = 0; j < 16; j++) {
-            if (new[i].DIR_Name[0] == 0xE5
-               || strncmp((const char *)orig[j].DIR_Name, ".          ", 11) == 0
-               || strncmp((const char *)orig[j].DIR_Name, "..         ", 11) == 0
-               || (orig[j].DIR_Attr & 0x0F) == 0x0F
-               || (orig[j].DIR_Attr & 0x08) == 0x08)  // volume label
-            {
-                continue;
-            }
-
-            if (strncmp((const char *)new[i].DIR_Name, (const char *)orig[j].DIR_Name, 11) == 0 &&
-                new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO &&
-                new[i].DIR_FileSize == orig[j].DIR_FileSize)
-            {
-                is_found = true;
-                break;
-            }
-
-            // rename
-            if (i == j &&
-                new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO &&
-                new[i].DIR_FileSize == orig[j].DIR_FileSize)
-            {
-                memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
-                delete++;
-                break;
-            }
-        }
-        if (!is_found) {
-            memcpy(update, &new[i], sizeof(fat_dir_entry_t));
-            update++;
-        }
-    }
-}
-
-static int littlefs_mkdir(const char *filename) {
-    TRACE(ANSI_RED "littlefs_mkdir('%s')\n" ANSI_CLEAR, filename);
-    struct lfs_info finfo;
+static int littlefs_mkdir(const char *filename) {
+    TRACE(ANSI_RED "littlefs_mkdir('%s')\n" ANSI_CLEAR, filename);
+    struct lfs_info finfo;
 
     int err = lfs_stat(&real_filesystem, filename, &finfo);
     if (err == LFS_ERR_OK) {
@@ -1546,8 +2027,17 @@ static int littlefs_mkdir(const char *filename) {
     return LFS_ERR_OK;
 }
 
-static int littlefs_write(const char *filename, uint32_t cluster, size_t size) {
-    TRACE(ANSI_RED "littlefs_write('%s', cluster=%lu, size=%u)\n" ANSI_CLEAR, filename, cluster, size);
+/*
+ * Write the cluster chain starting at cluster to filename
+ *
+ * If the file keeps its first cluster (orig_cluster == cluster), the clusters within
+ * the current littlefs file size that the host has not written are left as they are,
+ * so only rewritten and appended clusters are copied. Pass orig_cluster = 0 to rewrite
+ * the whole chain.
+ */
+static int littlefs_write(const char *filename, uint32_t cluster, size_t size, uint32_t orig_cluster) {
+    TRACE(ANSI_RED "littlefs_write('%s', cluster=%lu, size=%u, orig_cluster=%lu)\n" ANSI_CLEAR,
+          filename, cluster, size, orig_cluster);
 
     uint8_t buffer[512];
 
@@ -1556,6 +2046,7 @@ static int littlefs_write(const char *filename, uint32_t cluster, size_t size) {
         return -1;
     }
 
+    block_map_invalidate_path(filename);
     lfs_file_t f;
     int err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_RDWR|LFS_O_CREAT);
     if (err != LFS_ERR_OK) {
@@ -1563,19 +2054,40 @@ static int littlefs_write(const char *filename, uint32_t cluster, size_t size) {
         return err;
     }
 
-    while (true) {
-        err = read_temporary_file(cluster, buffer);
-        if (err != LFS_ERR_OK) {
-            TRACE("littlefs_write: read_temporary_file error=%d\n", err);
-            lfs_file_close(&real_filesystem, &f);
-            return err;
-        }
-        size_t s = lfs_file_write(&real_filesystem, &f, buffer, sizeof(buffer));
-        if (s != 512) {
-            TRACE("littlefs_write: lfs_file_write, %u < %u\n", s, 512);
-            lfs_file_close(&real_filesystem, &f);
-            return -1;
+    size_t written_size = 0;  // contents of littlefs that match the chain
+    if (orig_cluster == cluster) {
+        lfs_soff_t file_size = lfs_file_size(&real_filesystem, &f);
+        if (file_size > 0)
+            written_size = file_size;
+    }
+
+    size_t offset = 0;
+    while (offset < size) {
+        if (offset + sizeof(buffer) > written_size || is_dirty_cluster(cluster)) {
+            err = read_temporary_file(cluster, buffer);
+            if (err != LFS_ERR_OK) {
+                TRACE("littlefs_write: read_temporary_file error=%d\n", err);
+                lfs_file_close(&real_filesystem, &f);
+                return err;
+            }
+            if ((size_t)lfs_file_tell(&real_filesystem, &f) != offset) {
+                lfs_soff_t seek = lfs_file_seek(&real_filesystem, &f, offset, LFS_SEEK_SET);
+                if (seek < 0) {
+                    printf("littlefs_write: lfs_file_seek('%s') error=%ld\n", filename, seek);
+                    lfs_file_close(&real_filesystem, &f);
+                    return seek;
+                }
+            }
+            size_t s = lfs_file_write(&real_filesystem, &f, buffer, sizeof(buffer));
+            if (s != 512) {
+                TRACE("littlefs_write: lfs_file_write, %u < %u\n", s, 512);
+                lfs_file_close(&real_filesystem, &f);
+                return -1;
+            }
+            set_dirty_cluster(cluster, false);
         }
+        offset += sizeof(buffer);
+
         int next_cluster = read_fat(cluster);
         if (next_cluster == 0x00) // not allocated
             break;
@@ -1583,11 +2095,13 @@ static int littlefs_write(const char *filename, uint32_t cluster, size_t size) {
             break;
         cluster = next_cluster;
     }
-    err = lfs_file_truncate(&real_filesystem, &f, size);
-    if (err != LFS_ERR_OK) {
-        TRACE("littlefs_write: lfs_file_truncate err=%d\n", err);
-        lfs_file_close(&real_filesystem, &f);
-        return err;
+    if ((size_t)lfs_file_size(&real_filesystem, &f) != size) {
+        err = lfs_file_truncate(&real_filesystem, &f, size);
+        if (err != LFS_ERR_OK) {
+            TRACE("littlefs_write: lfs_file_truncate err=%d\n", err);
+            lfs_file_close(&real_filesystem, &f);
+            return err;
+        }
     }
     lfs_file_close(&real_filesystem, &f);
     return 0;
@@ -1600,6 +2114,7 @@ static int littlefs_remove(const char *filename) {
         TRACE("littlefs_remove: not allow brank filename\n");
         return LFS_ERR_INVAL;
     }
+    block_map_invalidate_path(filename);
     int err = lfs_remove(&real_filesystem, filename);
     if (err != LFS_ERR_OK) {
         TRACE("littlefs_remove: lfs_remove: err=%d\n", err);
@@ -1612,9 +2127,22 @@ static int littlefs_remove(const char *filename) {
 /*
  * Update a file or directory from the difference indicated by *src in dir_cluster_id
  *
- * *src is an array of differences created by diff_dir_entry()
+ * *src is an array of differences created by difference_of_dir_entry(), and *orig is
+ * the directory entry before the update.
  */
-static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_cluster_id) {
+static uint32_t find_orig_cluster(fat_dir_entry_t *orig, fat_dir_entry_t *dir) {
+    for (int i = 0; i < 16; i++) {
+        if (orig[i].DIR_Name[0] == '\0')
+            break;
+        if ((orig[i].DIR_Attr & 0x0F) == 0x0F || (orig[i].DIR_Attr & 0x18))
+            continue;
+        if (memcmp(orig[i].DIR_Name, dir->DIR_Name, 11) == 0)
+            return orig[i].DIR_FstClusLO;
+    }
+    return 0;
+}
+
+static void update_lfs_file_or_directory(fat_dir_entry_t *src, fat_dir_entry_t *orig, uint32_t dir_cluster_id) {
     TRACE("update_lfs_file_or_directory(dir_cluster_id=%lu)\n", dir_cluster_id);
     char filename[LFS_NAME_MAX + 1];
     char directory[LFS_NAME_MAX + 1];
@@ -1652,8 +2180,6 @@ static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_clus
             } else {
                 restore_from_short_dirname(filename, (const char *)dir->DIR_Name);
             }
-            // FIXME: If there is a directory to be deleted with the same name,
-            //        the files in the directory must be copied.
             restore_directory_from(directory, dir_cluster_id, dir->DIR_FstClusLO);
             littlefs_mkdir(directory);
             create_blank_dir_entry_cache(dir->DIR_FstClusLO, dir_cluster_id);
@@ -1670,11 +2196,13 @@ static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_clus
 
             if (dir->DIR_FstClusLO == 0) {
                 TRACE(" Files not yet assigned cluster=0\n");
-                break;
+                is_long_filename = false;
+                continue;
             }
 
             restore_file_from(filename, dir_cluster_id,  dir->DIR_FstClusLO);
-            littlefs_write((const char *)filename, dir->DIR_FstClusLO, dir->DIR_FileSize);
+            littlefs_write((const char *)filename, dir->DIR_FstClusLO, dir->DIR_FileSize,
+                           find_orig_cluster(orig, dir));
             is_long_filename = false;
             continue;
         } else {
@@ -1703,7 +2231,7 @@ static void save_file_clusters(uint32_t cluster, const char *filename) {
     lfs_soff_t seek_pos;
     lfs_ssize_t read_bytes;
     int offset = 0;
-    while (next_cluster < 0xFF8) {
+    while (next_cluster >= 2 && next_cluster < 0xFF8) {  // the host may have already freed the chain
         next_cluster = read_fat(cluster);
 
         seek_pos = lfs_file_seek(&real_filesystem, &f, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET);
@@ -1725,152 +2253,610 @@ static void save_file_clusters(uint32_t cluster, const char *filename) {
     lfs_file_close(&real_filesystem, &f);
 }
 
+/*
+ * Entries deleted by the host, kept for a short time in case they reappear in another directory
+ *
+ * A move is written as a deletion in the source directory followed by an addition in
+ * the destination directory. The deleted file or directory is parked in .mimic/deleted
+ * under its first cluster, so that the addition can be applied with lfs_rename().
+ * Entries that do not reappear are removed on timeout or on mimic_fat_flush().
+ * The cluster chain is recorded as runs when the entry is parked, since the host
+ * may free and reuse the chain in the FAT before the entry is removed.
+ */
+#define DELETED_ENTRY_SIZE        8
+#define DELETED_ENTRY_TIMEOUT_US  (2000 * 1000)
+#define DELETED_ENTRY_RUN_SIZE    8
+
+typedef struct {
+    uint16_t cluster;
+    uint16_t length;
+} cluster_run_t;
+
+typedef struct {
+    bool is_deleted;
+    bool is_directory;
+    uint32_t cluster;
+    uint32_t size;
+    uint64_t deleted_at;
+    size_t run_num;
+    cluster_run_t run[DELETED_ENTRY_RUN_SIZE];
+} deleted_entry_t;
+
+static deleted_entry_t deleted_entry[DELETED_ENTRY_SIZE];
+
+static void deleted_entry_path(char *path, size_t size, uint32_t cluster) {
+    snprintf(path, size, ".mimic/deleted/%04lu", cluster);
+}
+
+/*
+ * Record the cluster chain starting at cluster as runs of contiguous clusters
+ *
+ * Returns false if the chain is too fragmented to be recorded.
+ */
+static bool deleted_entry_record_chain(deleted_entry_t *entry, uint32_t cluster) {
+    entry->run_num = 0;
+    while (cluster >= 2 && cluster < 0xFF8) {  // the host may have already freed the chain
+        cluster_run_t *last = entry->run_num > 0 ? &entry->run[entry->run_num - 1] : NULL;
+        if (last != NULL && last->cluster + last->length == cluster) {
+            last->length++;
+        } else {
+            if (entry->run_num >= DELETED_ENTRY_RUN_SIZE)
+                return false;
+            entry->run[entry->run_num].cluster = cluster;
+            entry->run[entry->run_num].length = 1;
+            entry->run_num++;
+        }
+        cluster = read_fat(cluster);
+    }
+    return true;
+}
+
+static bool deleted_entry_has_cluster(deleted_entry_t *entry, uint32_t cluster) {
+    for (size_t i = 0; i < entry->run_num; i++) {
+        if (cluster >= entry->run[i].cluster && cluster < entry->run[i].cluster + entry->run[i].length)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Save the contents of a parked file in the cluster cache along its recorded chain
+ */
+static void deleted_entry_save_clusters(deleted_entry_t *entry, const char *path) {
+    uint8_t buffer[DISK_SECTOR_SIZE];
+    lfs_file_t f;
+
+    int err = lfs_file_open(&real_filesystem, &f, path, LFS_O_RDONLY);
+    if (err != LFS_ERR_OK) {
+        printf("deleted_entry_save_clusters: lfs_file_open('%s') error=%d\n", path, err);
+        return;
+    }
+    for (size_t i = 0; i < entry->run_num; i++) {
+        for (uint32_t j = 0; j < entry->run[i].length; j++) {
+            memset(buffer, 0, sizeof(buffer));
+            lfs_ssize_t read_bytes = lfs_file_read(&real_filesystem, &f, buffer, sizeof(buffer));
+            if (read_bytes < 0) {
+                printf("deleted_entry_save_clusters: lfs_file_read() error=%d\n", (int)read_bytes);
+                lfs_file_close(&real_filesystem, &f);
+                return;
+            }
+            save_temporary_file(entry->run[i].cluster + j, buffer);
+        }
+    }
+    lfs_file_close(&real_filesystem, &f);
+}
+
+static deleted_entry_t *deleted_entry_find(uint32_t cluster, uint32_t size, bool is_directory) {
+    for (size_t i = 0; i < DELETED_ENTRY_SIZE; i++) {
+        deleted_entry_t *entry = &deleted_entry[i];
+        if (entry->is_deleted
+            && entry->cluster == cluster
+            && entry->size == size
+            && entry->is_directory == is_directory)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Remove a parked entry from littlefs
+ *
+ * The file contents are copied to the cluster cache first when keep_clusters is set,
+ * since they are needed if the file is added again after the window has passed.
+ * The chain recorded when the entry was parked is used, not the current FAT.
+ */
+static void deleted_entry_finalize(deleted_entry_t *entry, bool keep_clusters) {
+    char path[LFS_NAME_MAX + 1];
+
+    deleted_entry_path(path, sizeof(path), entry->cluster);
+    TRACE("deleted_entry_finalize('%s')\n", path);
+    entry->is_deleted = false;
+
+    if (entry->is_directory)
+        delete_directory(path);
+    else if (keep_clusters)
+        deleted_entry_save_clusters(entry, path);
+    littlefs_remove(path);
+}
+
+static void deleted_entry_finalize_all(void) {
+    for (size_t i = 0; i < DELETED_ENTRY_SIZE; i++) {
+        if (deleted_entry[i].is_deleted)
+            deleted_entry_finalize(&deleted_entry[i], true);
+    }
+}
+
+/*
+ * Drop a parked entry any of whose clusters is reused by the host for other contents
+ *
+ * A moved directory may have its `..` entry rewritten, which is not a reuse.
+ */
+static void deleted_entry_discard(uint32_t cluster, void *buffer) {
+    for (size_t i = 0; i < DELETED_ENTRY_SIZE; i++) {
+        deleted_entry_t *entry = &deleted_entry[i];
+        if (!entry->is_deleted || !deleted_entry_has_cluster(entry, cluster))
+            continue;
+
+        if (entry->is_directory && entry->cluster == cluster) {
+            fat_dir_entry_t orig[16];
+            if (read_temporary_file(cluster, orig) == 0
+                && memcmp(&orig[2], (fat_dir_entry_t *)buffer + 2, sizeof(fat_dir_entry_t) * 14) == 0)
+            {
+                continue;
+            }
+        }
+        deleted_entry_finalize(entry, false);
+    }
+}
+
+static void deleted_entry_reset(void) {
+    memset(deleted_entry, 0, sizeof(deleted_entry));
+}
+
+static deleted_entry_t *deleted_entry_alloc(uint32_t cluster) {
+    deleted_entry_t *unused = NULL;
+    for (size_t i = 0; i < DELETED_ENTRY_SIZE; i++) {
+        deleted_entry_t *entry = &deleted_entry[i];
+        if (entry->is_deleted && entry->cluster == cluster) {
+            deleted_entry_finalize(entry, false);
+            return entry;
+        }
+        if (!entry->is_deleted)
+            unused = entry;
+    }
+    if (unused != NULL)
+        return unused;
+
+    deleted_entry_t *oldest = &deleted_entry[0];
+    for (size_t i = 1; i < DELETED_ENTRY_SIZE; i++) {
+        if (deleted_entry[i].deleted_at < oldest->deleted_at)
+            oldest = &deleted_entry[i];
+    }
+    deleted_entry_finalize(oldest, true);
+    return oldest;
+}
+
 static void delete_dir_entry_cache(fat_dir_entry_t *src, uint32_t dir_cluster_id) {
     char filename[LFS_NAME_MAX + 1];
+    char path[LFS_NAME_MAX + 1];
 
     for (int i = 0; i < 16; i++) {
         fat_dir_entry_t *dir = &src[i];
         if (dir->DIR_Name[0] == '\0')
             break;
 
-        if (dir->DIR_Attr & 0x10) {
+        bool is_directory = (dir->DIR_Attr & 0x10) ? true : false;
+        if (is_directory) {
             restore_directory_from(filename, dir_cluster_id, dir->DIR_FstClusLO);
         } else {
             restore_file_from(filename, dir_cluster_id, dir->DIR_FstClusLO);
+        }
+
+        deleted_entry_t *entry = deleted_entry_alloc(dir->DIR_FstClusLO);
+        if (!deleted_entry_record_chain(entry, dir->DIR_FstClusLO) && !is_directory) {
+            // Too fragmented to be parked; the clusters are kept in the cache instead
             save_file_clusters(dir->DIR_FstClusLO, filename);
+            littlefs_remove(filename);
+            continue;
+        }
+        littlefs_mkdir(".mimic/deleted");
+        deleted_entry_path(path, sizeof(path), dir->DIR_FstClusLO);
+        block_map_invalidate_path(filename);
+        int err = lfs_rename(&real_filesystem, filename, path);
+        if (err != LFS_ERR_OK) {
+            printf("delete_dir_entry_cache: lfs_rename('%s', '%s') error=%d\n", filename, path, err);
+            if (!is_directory)
+                save_file_clusters(dir->DIR_FstClusLO, filename);
+            littlefs_remove(filename);
+            continue;
         }
-        littlefs_remove(filename);
+        entry->is_deleted = true;
+        entry->is_directory = is_directory;
+        entry->cluster = dir->DIR_FstClusLO;
+        entry->size = dir->DIR_FileSize;
+        entry->deleted_at = time_us_64();
+    }
+}
+
+typedef struct {
+    uint32_t cluster;
+    bool is_directory;
+    char path[LFS_NAME_MAX + 1];
+} renamed_entry_t;
+
+static renamed_entry_t renamed_entry[16];
+
+static void remove_dir_entry_at(fat_dir_entry_t *src, int index) {
+    memmove(&src[index], &src[index + 1], sizeof(fat_dir_entry_t) * (16 - index - 1));
+    memset(&src[15], 0, sizeof(fat_dir_entry_t));
+}
+
+/*
+ * Sort the changes between the committed and the new directory entry
+ *
+ * Created and resized entries are stored in *update and deleted entries in *delete.
+ * For renamed entries the current path is kept in renamed_entry[] so that the rename
+ * can be applied with lfs_rename(); the number of renamed entries is returned.
+ */
+static size_t difference_of_dir_entry(fat_dir_entry_t *orig, fat_dir_entry_t *new,
+                                      fat_dir_entry_t *update, fat_dir_entry_t *delete,
+                                      uint32_t dir_cluster_id)
+{
+    static dir_entry_diff_t diff[16 * 2];
+    size_t num = 0;
+
+    TRACE("difference_of_dir_entry-----\n");
+    print_dir_entry(orig);
+    TRACE("----------------------------\n");
+    print_dir_entry(new);
+    TRACE("----------------------------\n");
 
-        // Cluster cache is needed at the rename destination, so do not delete it.
-        /*
-        uint32_t next_cluster = dir->DIR_FstClusLO;
-        while (true) {
-            delete_temporary_file(next_cluster);
-            next_cluster = read_fat(next_cluster);
-            if (next_cluster >= 0xFF8) {
+    size_t diff_num = dir_entry_diff(orig, new, 16, diff, sizeof(diff) / sizeof(diff[0]));
+    for (size_t i = 0; i < diff_num; i++) {
+        const fat_dir_entry_t *a = diff[i].orig;
+        const fat_dir_entry_t *b = diff[i].new;
+        switch (diff[i].type) {
+        case DIR_ENTRY_DIFF_CREATE:
+        case DIR_ENTRY_DIFF_RESIZE:
+            memcpy(update++, b, sizeof(fat_dir_entry_t));
+            break;
+        case DIR_ENTRY_DIFF_DELETE:
+            if (a->DIR_FstClusLO != 0)  // empty files can not be resolved by cluster
+                memcpy(delete++, a, sizeof(fat_dir_entry_t));
+            break;
+        case DIR_ENTRY_DIFF_RENAME:
+            if (a->DIR_FileSize != b->DIR_FileSize) {  // renamed and rewritten
+                memcpy(delete++, a, sizeof(fat_dir_entry_t));
+                memcpy(update++, b, sizeof(fat_dir_entry_t));
                 break;
             }
+            renamed_entry_t *renamed = &renamed_entry[num++];
+            renamed->cluster = a->DIR_FstClusLO;
+            renamed->is_directory = (a->DIR_Attr & 0x10) ? true : false;
+            if (renamed->is_directory)
+                restore_directory_from(renamed->path, dir_cluster_id, renamed->cluster);
+            else
+                restore_file_from(renamed->path, dir_cluster_id, renamed->cluster);
+            break;
+        case DIR_ENTRY_DIFF_ATTR:
+            break;
         }
-        */
-        continue;
     }
+    return num;
 }
 
-static void update_dir_entry(uint32_t cluster, void *buffer) {
+/*
+ * Pair added entries with entries recently deleted from another directory as moves
+ */
+static size_t find_moved_dir_entry(fat_dir_entry_t *update, size_t num) {
+    for (int i = 0; i < 16 && update[i].DIR_Name[0] != '\0'; ) {
+        fat_dir_entry_t *dir = &update[i];
+        bool is_directory = (dir->DIR_Attr & 0x10) ? true : false;
+        deleted_entry_t *entry = NULL;
+        if (dir->DIR_FstClusLO != 0)
+            entry = deleted_entry_find(dir->DIR_FstClusLO, dir->DIR_FileSize, is_directory);
+        if (entry == NULL) {
+            i++;
+            continue;
+        }
+
+        renamed_entry_t *renamed = &renamed_entry[num++];
+        renamed->cluster = entry->cluster;
+        renamed->is_directory = is_directory;
+        deleted_entry_path(renamed->path, sizeof(renamed->path), entry->cluster);
+        entry->is_deleted = false;
+
+        remove_dir_entry_at(update, i);
+    }
+    return num;
+}
+
+static void renamed_entry_target(char *filename, renamed_entry_t *renamed, uint32_t dir_cluster_id) {
+    if (renamed->is_directory)
+        restore_directory_from(filename, dir_cluster_id, renamed->cluster);
+    else
+        restore_file_from(filename, dir_cluster_id, renamed->cluster);
+}
+
+/*
+ * Move the entries whose current name is the new name of another entry in the batch out of the way
+ *
+ * Swapped or cyclically renamed entries would otherwise overwrite each other, so
+ * they are parked under a temporary name in .mimic/ before the renames are applied.
+ */
+static void park_renamed_entry_sources(size_t num, uint32_t dir_cluster_id) {
+    char filename[LFS_NAME_MAX + 1];
+
+    for (size_t i = 0; i < num; i++) {
+        renamed_entry_t *renamed = &renamed_entry[i];
+        bool is_target = false;
+        for (size_t j = 0; j < num && !is_target; j++) {
+            if (j == i)
+                continue;
+            renamed_entry_target(filename, &renamed_entry[j], dir_cluster_id);
+            is_target = strcmp(filename, renamed->path) == 0;
+        }
+        if (!is_target)
+            continue;
+
+        snprintf(filename, sizeof(filename), ".mimic/renaming%04lu", renamed->cluster);
+        TRACE(ANSI_RED "lfs_rename('%s', '%s')\n" ANSI_CLEAR, renamed->path, filename);
+        block_map_invalidate_path(renamed->path);
+        block_map_invalidate_path(filename);
+        int err = lfs_rename(&real_filesystem, renamed->path, filename);
+        if (err != LFS_ERR_OK) {
+            printf("park_renamed_entry_sources: lfs_rename('%s', '%s') error=%d\n", renamed->path, filename, err);
+            continue;
+        }
+        snprintf(renamed->path, sizeof(renamed->path), "%s", filename);
+    }
+}
+
+/*
+ * Rename the entries paired by find_renamed_dir_entry() to the names in the saved directory entry
+ */
+static void rename_dir_entry_cache(size_t num, uint32_t dir_cluster_id) {
+    char filename[LFS_NAME_MAX + 1];
+
+    park_renamed_entry_sources(num, dir_cluster_id);
+    for (size_t i = 0; i < num; i++) {
+        renamed_entry_t *renamed = &renamed_entry[i];
+        renamed_entry_target(filename, renamed, dir_cluster_id);
+
+        if (renamed->is_directory) {
+            // A moved directory refers to its new parent
+            fat_dir_entry_t entry[16];
+            uint32_t parent = dir_cluster_id == 1 ? 0 : dir_cluster_id;
+            if (read_temporary_file(renamed->cluster, entry) == 0
+                && memcmp(entry[1].DIR_Name, "..         ", 11) == 0
+                && entry[1].DIR_FstClusLO != parent)
+            {
+                entry[1].DIR_FstClusLO = parent;
+                save_temporary_file(renamed->cluster, entry);
+            }
+        }
+
+        TRACE(ANSI_RED "lfs_rename('%s', '%s')\n" ANSI_CLEAR, renamed->path, filename);
+        block_map_invalidate_path(renamed->path);
+        block_map_invalidate_path(filename);
+        int err = lfs_rename(&real_filesystem, renamed->path, filename);
+        if (err != LFS_ERR_OK)
+            printf("rename_dir_entry_cache: lfs_rename('%s', '%s') error=%d\n", renamed->path, filename, err);
+    }
+}
+
+/*
+ * Apply the difference between the committed and the pending directory entry to littlefs
+ */
+static void dir_journal_commit(dir_journal_t *journal) {
     fat_dir_entry_t orig[16] = {0};
-    fat_dir_entry_t *new = buffer;
+    fat_dir_entry_t new[16] = {0};
     fat_dir_entry_t dir_update[16] = {0};
     fat_dir_entry_t dir_delete[16] = {0};
+    uint32_t cluster = journal->cluster;
+
+    TRACE("dir_journal_commit(cluster=%lu)\n", cluster);
+    write_handle_close_all();
+    memcpy(new, journal->entry, sizeof(new));
+    journal->is_pending = false;
 
+    // Resolve file names against the committed directory entries, which match littlefs
+    dir_journal_is_committing = true;
     if (read_temporary_file(cluster, orig) != 0) {
-        printf("update_dir_entry: entry not found cluster=%lu\n", cluster);
+        printf("dir_journal_commit: entry not found cluster=%lu\n", cluster);
+        dir_journal_is_committing = false;
         return;
     }
 
-    difference_of_dir_entry(orig, new, dir_update, dir_delete);
+    size_t renamed = difference_of_dir_entry(orig, new, dir_update, dir_delete, cluster);
+    renamed = find_moved_dir_entry(dir_update, renamed);
     delete_dir_entry_cache(dir_delete, cluster);
 
-    save_temporary_file(cluster, buffer);
-    update_lfs_file_or_directory(dir_update, cluster);
+    save_temporary_file(cluster, new);
+    if (cluster == 1)
+        save_temporary_file(0, new); // FIXME
+
+    rename_dir_entry_cache(renamed, cluster);
+    update_lfs_file_or_directory(dir_update, orig, cluster);
+    dir_journal_is_committing = false;
+}
+
+/*
+ * Apply all pending directory entries in the order in which they were first written
+ */
+static void dir_journal_commit_all(void) {
+    while (true) {
+        dir_journal_t *oldest = NULL;
+        for (size_t i = 0; i < DIR_JOURNAL_SIZE; i++) {
+            if (!dir_journal[i].is_pending)
+                continue;
+            if (oldest == NULL || dir_journal[i].sequence < oldest->sequence)
+                oldest = &dir_journal[i];
+        }
+        if (oldest == NULL)
+            break;
+        dir_journal_commit(oldest);
+    }
+}
+
+static dir_journal_t *dir_journal_alloc(void) {
+    for (size_t i = 0; i < DIR_JOURNAL_SIZE; i++) {
+        if (!dir_journal[i].is_pending)
+            return &dir_journal[i];
+    }
+
+    dir_journal_t *oldest = &dir_journal[0];
+    for (size_t i = 1; i < DIR_JOURNAL_SIZE; i++) {
+        if (dir_journal[i].sequence < oldest->sequence)
+            oldest = &dir_journal[i];
+    }
+    dir_journal_commit(oldest);
+    return oldest;
+}
+
+/*
+ * Record a directory entry sector written by the host in the journal
+ *
+ * A later write to the same sector replaces the pending image, so that
+ * only the final state is applied to littlefs.
+ */
+static void update_dir_entry(uint32_t cluster, void *buffer) {
+    write_handle_close_all();
+
+    dir_journal_t *journal = dir_journal_find(cluster);
+
+    if (journal == NULL) {
+        fat_dir_entry_t orig[16] = {0};
+        if (read_temporary_file(cluster, orig) != 0) {
+            // The directory itself may be created by a pending update of its parent
+            dir_journal_commit_all();
+            if (read_temporary_file(cluster, orig) != 0) {
+                printf("update_dir_entry: entry not found cluster=%lu\n", cluster);
+                return;
+            }
+        }
+        if (memcmp(orig, buffer, sizeof(orig)) == 0)
+            return;
+
+        journal = dir_journal_alloc();
+        journal->cluster = cluster;
+        journal->sequence = ++dir_journal_sequence;
+        journal->is_pending = true;
+    } else {
+        TRACE("update_dir_entry: supersede pending entry cluster=%lu\n", cluster);
+    }
+
+    memcpy(journal->entry, buffer, sizeof(journal->entry));
+    journal->updated_at = time_us_64();
 }
 
 /*
  * Save request_blocks not associated with a resource in a temporary file
  */
 static void update_file_entry(uint32_t cluster, void *buffer, uint32_t bufsize,
-                              find_dir_entry_cache_result_t *result, size_t offset)
+                              find_dir_entry_cache_result_t *result,
+                              uint32_t base_cluster, size_t offset)
 {
-    save_temporary_file(cluster, buffer);
+    uint32_t clusters = (bufsize + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+    for (uint32_t i = 0; i < clusters; i++)
+        save_temporary_file(cluster + i, (uint8_t *)buffer + i * DISK_SECTOR_SIZE);
     if (!result->is_found)
         return;
 
-    TRACE(ANSI_RED "lfs_file_open('%s', cluster=%lu, offset=%u)\n" ANSI_CLEAR, result->path, cluster, offset);
-    lfs_file_t f;
-    int err;
-    if (offset == 0) {
-        err = lfs_file_open(&real_filesystem, &f, result->path, LFS_O_WRONLY|LFS_O_CREAT|LFS_O_TRUNC);
-        if (err != LFS_ERR_OK) {
-            printf("update_file_entry: lfs_file_open('%s') error=%d\n", result->path, err);
+    write_handle_t *handle = write_handle_find(base_cluster, result->path);
+    if (handle != NULL && offset == 0) {
+        // The host rewrites the file from the beginning
+        write_handle_close(handle);
+        handle = NULL;
+    }
+    if (handle == NULL) {
+        handle = write_handle_open(base_cluster, result->path, offset == 0);
+        if (handle == NULL)
             return;
-        }
-    } else {
-        err = lfs_file_open(&real_filesystem, &f, result->path, LFS_O_WRONLY);
-        if (err != LFS_ERR_OK) {
-            printf("update_file_entry: lfs_file_open('%s') error=%d\n", result->path, err);
+    }
+
+    int err;
+    if (handle->next_offset != offset) {
+        lfs_soff_t seek = lfs_file_seek(&real_filesystem, &handle->file, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET);
+        if (seek < 0) {
+            printf("update_file_entry: lfs_file_seek('%s') error=%ld\n", result->path, seek);
+            write_handle_close(handle);
             return;
         }
-        lfs_file_seek(&real_filesystem, &f, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET);
     }
 
-    lfs_ssize_t size = lfs_file_write(&real_filesystem, &f, buffer, bufsize);
-    if (size < 0 || size != 512) {
+    lfs_ssize_t size = lfs_file_write(&real_filesystem, &handle->file, buffer, bufsize);
+    if (size < 0 || size != (lfs_ssize_t)bufsize) {
         printf("update_file_entry: lfs_file_write('%s') error=%ld\n", result->path, size);
-        lfs_file_close(&real_filesystem, &f);
+        write_handle_close(handle);
         return;
     }
+    handle->next_offset = offset + clusters;
+    handle->updated_at = time_us_64();
+    for (uint32_t i = 0; i < clusters; i++)
+        set_dirty_cluster(cluster + i, false);
 
-    if ((1 + offset) * 512 >= result->size) {
-        err = lfs_file_truncate(&real_filesystem, &f, result->size);
+    if ((clusters + offset) * 512 >= result->size) {
+        err = lfs_file_truncate(&real_filesystem, &handle->file, result->size);
         if (err != LFS_ERR_OK) {
             printf("update_file_entry: lfs_file_truncate('%s') error=%d\n", result->path, err);
-            lfs_file_close(&real_filesystem, &f);
+            write_handle_close(handle);
             return;
         }
     }
-    err = lfs_file_close(&real_filesystem, &f);
-    if (err != LFS_ERR_OK) {
-        printf("update_file_entry: lfs_file_close('%s') error=%d\n", result->path, err);
-        return;
-    }
 }
 
-void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t bufsize) {
-    (void)lun;
+/*
+ * Write the run of sectors from request_block that is applied with one operation:
+ * the FAT, or contiguous clusters of one file. Returns the number of bytes written.
+ */
+static uint32_t write_sector_run(uint32_t request_block, void *buffer, uint32_t bufsize) {
     find_dir_entry_cache_result_t result;
+    uint32_t max_sectors = (bufsize + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+    uint32_t size = run_bytes(1, bufsize);
 
     if (request_block == 0) // master boot record
-        return;
+        return size;
 
     if (is_fat_sector(request_block)) { // FAT table
         TRACE("\e[35mWrite FAT table\n" ANSI_CLEAR);
-        save_fat_sector(request_block, buffer, bufsize);
-        return;
+        uint32_t n = 1;
+        while (n < max_sectors && is_fat_sector(request_block + n))
+            n++;
+        size = run_bytes(n, bufsize);
+        save_fat_sector(request_block, buffer, size);
+        return size;
     }
 
     uint32_t cluster = request_block - fat_sector_size();
     TRACE("\e[35mWrite cluster=%lu\e[0m\n", cluster);
     if (cluster == 1) { // root dir entry
         TRACE("mimic_fat_write: update root dir_entry\n");
-
-        fat_dir_entry_t orig[16] = {0};
-        fat_dir_entry_t dir_update[16] = {0};
-        fat_dir_entry_t dir_delete[16] = {0};
-
-        read_temporary_file(cluster, orig);
-        difference_of_dir_entry(&orig[0], (fat_dir_entry_t *)buffer, dir_update, dir_delete);
-
-        delete_dir_entry_cache(dir_delete, cluster);
-
-        save_temporary_file(cluster, buffer);
-        save_temporary_file(0, buffer); // FIXME
-
-        update_lfs_file_or_directory(dir_update, cluster);
+        update_dir_entry(cluster, buffer);
     } else { // data or directory entry
+        deleted_entry_discard(cluster, buffer);
+        set_dirty_cluster(cluster, true);
+
         size_t offset = 0;
         uint32_t base_cluster = find_base_cluster_and_offset(cluster, &offset);
 
         if (base_cluster == 0) {
             TRACE("mimic_fat_write: not allocated cluster\n");
-            save_temporary_file(cluster, buffer);
 
             // For hosts that write to unallocated space first
             find_dir_entry_cache_return_t r = find_dir_entry_cache(&result, 1, cluster);
+            if (r == FIND_DIR_ENTRY_CACHE_RESULT_FOUND)
+                dir_journal_commit_all();
+            save_temporary_file(cluster, buffer);
             if (r != FIND_DIR_ENTRY_CACHE_RESULT_FOUND)  // error or not found
-                return;
+                return size;
             if (result.is_found && !result.is_directory) {
-                littlefs_write(result.path, cluster, result.size);
+                write_handle_close_all();
+                littlefs_write(result.path, cluster, result.size, cluster);
             }
-            return;
+            return size;
         }
 
         find_dir_entry_cache_return_t r = find_dir_entry_cache(&result, 1, base_cluster);
@@ -1878,17 +2864,648 @@ void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t
         if (r == FIND_DIR_ENTRY_CACHE_RESULT_ERROR) {
             TRACE("mimic_fat_write: find_dir_entry_cache(1, base_cluster=%lu) error=%d\n",
                    base_cluster, r);
-            return;
+            return size;
         }
         if (r == FIND_DIR_ENTRY_CACHE_RESULT_NOT_FOUND) {
             TRACE(ANSI_RED "find_dir_entry_cache not found cluster=%lu\n" ANSI_CLEAR, base_cluster);
             save_temporary_file(cluster, buffer);
-            return;
+            return size;
         }
 
-        if (result.is_directory)
+        if (result.is_directory) {
             update_dir_entry(cluster, buffer);
+        } else {
+            // The following clusters of the chain belong to the same file
+            uint32_t n = contiguous_cluster_run(cluster, max_sectors);
+            for (uint32_t i = 1; i < n; i++) {
+                deleted_entry_discard(cluster + i, (uint8_t *)buffer + i * DISK_SECTOR_SIZE);
+                set_dirty_cluster(cluster + i, true);
+            }
+            size = run_bytes(n, bufsize);
+            dir_journal_commit_all();
+            update_file_entry(cluster, buffer, size, &result, base_cluster, offset);
+        }
+    }
+    return size;
+}
+
+/*
+ * Write bufsize bytes from request_block, which may span several sectors of different types
+ */
+static void write_sector(uint32_t request_block, void *buffer, uint32_t bufsize) {
+    uint8_t *p = buffer;
+    while (bufsize > 0) {
+        uint32_t size = write_sector_run(request_block, p, bufsize);
+        request_block += size / DISK_SECTOR_SIZE;
+        p += size;
+        bufsize -= size;
+    }
+}
+
+/*
+ * CRC32 of sectors recently read or written by the host
+ *
+ * A write whose CRC32 matches the last known content of the sector is compared with
+ * the current content and dropped if identical, which saves flash program and erase
+ * cycles when hosts rewrite unchanged data. Only sectors whose content is defined by
+ * the FAT, a directory entry or an allocated file are compared.
+ */
+#define SECTOR_HASH_SIZE  256
+
+typedef struct {
+    uint32_t sector;
+    uint32_t crc;
+} sector_hash_t;
+
+static sector_hash_t sector_hash[SECTOR_HASH_SIZE];
+static mimic_fat_write_stats_t write_stats = {0};
+
+static uint32_t crc32(const uint8_t *data, size_t size) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+static void sector_hash_reset(void) {
+    memset(sector_hash, 0, sizeof(sector_hash));
+}
+
+static void sector_hash_record(uint32_t sector, const void *buffer, uint32_t bufsize) {
+    if (sector == 0 || bufsize != DISK_SECTOR_SIZE)
+        return;
+    sector_hash_t *hash = &sector_hash[sector % SECTOR_HASH_SIZE];
+    hash->sector = sector;
+    hash->crc = crc32(buffer, bufsize);
+}
+
+/*
+ * Read the current contents of a sector mapped to littlefs without side effects
+ *
+ * Unlike read_sector(), pending directory entries are not committed and write
+ * handles are not closed. Returns false if the sector is not mapped, or if its
+ * file is open for writing and littlefs may not hold the latest contents.
+ */
+static bool read_mapped_sector(uint32_t sector, uint8_t *buffer) {
+    switch (sector_type(sector)) {
+    case SECTOR_TYPE_FAT:
+    case SECTOR_TYPE_ROOT:
+        read_sector(sector, buffer, DISK_SECTOR_SIZE);
+        return true;
+    case SECTOR_TYPE_ALLOCATED:
+        break;
+    default:
+        return false;
+    }
+    uint32_t cluster = sector - fat_sector_size();
+
+    size_t offset = 0;
+    uint32_t base_cluster = find_base_cluster_and_offset(cluster, &offset);
+    if (base_cluster == 0)
+        return false;
+    find_dir_entry_cache_result_t result = {0};
+    if (find_dir_entry_cache(&result, 1, base_cluster) != FIND_DIR_ENTRY_CACHE_RESULT_FOUND)
+        return false;
+    if (result.is_directory)
+        return read_temporary_file(cluster, buffer) == 0;
+    if (write_handle_find(base_cluster, result.path) != NULL)
+        return false;
+
+    lfs_file_t f;
+    if (lfs_file_open(&real_filesystem, &f, result.path, LFS_O_RDONLY) != LFS_ERR_OK)
+        return false;
+    lfs_ssize_t size = -1;
+    if (lfs_file_seek(&real_filesystem, &f, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET) >= 0)
+        size = lfs_file_read(&real_filesystem, &f, buffer, DISK_SECTOR_SIZE);
+    lfs_file_close(&real_filesystem, &f);
+    return size >= 0;
+}
+
+static bool is_unchanged_sector(uint32_t sector, const void *buffer, uint32_t bufsize) {
+    static uint8_t current[DISK_SECTOR_SIZE];
+
+    if (sector == 0 || bufsize != DISK_SECTOR_SIZE)
+        return false;
+    sector_hash_t *hash = &sector_hash[sector % SECTOR_HASH_SIZE];
+    if (hash->sector != sector || hash->crc != crc32(buffer, bufsize))
+        return false;
+
+    // The content may have changed since it was hashed, compare it to be sure
+    memset(current, 0, sizeof(current));
+    if (!read_mapped_sector(sector, current))
+        return false;
+    return memcmp(current, buffer, bufsize) == 0;
+}
+
+/*
+ * Read bufsize bytes from sector; a multi-sector buffer is served run by run
+ */
+void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize) {
+    (void)lun;
+
+    read_sector(sector, buffer, bufsize);
+    for (uint32_t i = 0; i < bufsize / DISK_SECTOR_SIZE; i++)
+        sector_hash_record(sector + i, (uint8_t *)buffer + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+}
+
+/*
+ * Write bufsize bytes from request_block. Unchanged sectors are dropped and the
+ * changed runs in between are written with as few operations as possible.
+ */
+void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t bufsize) {
+    (void)lun;
+
+    uint8_t *p = buffer;
+    uint32_t sectors = (bufsize + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+    uint32_t changed = 0;  // first sector of the pending run of changed sectors
+    for (uint32_t i = 0; i < sectors; i++) {
+        uint32_t size = run_bytes(1, bufsize - i * DISK_SECTOR_SIZE);
+        write_stats.count++;
+        if (!is_unchanged_sector(request_block + i, &p[i * DISK_SECTOR_SIZE], size))
+            continue;
+
+        TRACE("\e[35mWrite sector=%lu is unchanged\e[0m\n", request_block + i);
+        write_stats.suppressed++;
+        if (changed < i)
+            write_sector(request_block + changed, &p[changed * DISK_SECTOR_SIZE], (i - changed) * DISK_SECTOR_SIZE);
+        changed = i + 1;
+    }
+    if (changed < sectors)
+        write_sector(request_block + changed, &p[changed * DISK_SECTOR_SIZE], bufsize - changed * DISK_SECTOR_SIZE);
+
+    for (uint32_t i = 0; i < sectors; i++)
+        sector_hash_record(request_block + i, &p[i * DISK_SECTOR_SIZE], run_bytes(1, bufsize - i * DISK_SECTOR_SIZE));
+}
+
+/*
+ * Close write handles, apply pending directory entries and remove deleted entries
+ * in littlefs once the host has been idle
+ *
+ * Call periodically from the main loop.
+ */
+void mimic_fat_task(void) {
+    if (is_locked)
+        return;
+
+    uint64_t now = time_us_64();
+    for (size_t i = 0; i < WRITE_HANDLE_SIZE; i++) {
+        if (write_handle[i].is_opened && now - write_handle[i].updated_at >= WRITE_HANDLE_IDLE_TIMEOUT_US)
+            write_handle_close(&write_handle[i]);
+    }
+    for (size_t i = 0; i < DIR_JOURNAL_SIZE; i++) {
+        if (dir_journal[i].is_pending && now - dir_journal[i].updated_at >= DIR_JOURNAL_IDLE_TIMEOUT_US) {
+            dir_journal_commit_all();
+            break;
+        }
+    }
+    for (size_t i = 0; i < DELETED_ENTRY_SIZE; i++) {
+        if (deleted_entry[i].is_deleted && now - deleted_entry[i].deleted_at >= DELETED_ENTRY_TIMEOUT_US)
+            deleted_entry_finalize(&deleted_entry[i], true);
+    }
+    for (size_t i = 0; i < growing_file_num; i++) {
+        growing_file_t *file = &growing_file[i];
+        if (usb_device_is_enabled && file->is_reserved && now - file->grown_at >= MIMIC_FAT_GROWING_FILE_IDLE_US) {
+            // stopped growing, the next append lays out a new reserve
+            file->is_reserved = false;
+            apply_changed_entry(file->path, false);
+        }
+    }
+}
+
+/*
+ * True while the cache is in use and no host write is held outside littlefs
+ */
+bool mimic_fat_is_idle(void) {
+    if (!usb_device_is_enabled)
+        return false;
+    for (size_t i = 0; i < WRITE_HANDLE_SIZE; i++) {
+        if (write_handle[i].is_opened)
+            return false;
+    }
+    for (size_t i = 0; i < DIR_JOURNAL_SIZE; i++) {
+        if (dir_journal[i].is_pending)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * The littlefs instance shared by the mimic and the application
+ */
+lfs_t *mimic_fat_filesystem(void) {
+    return &real_filesystem;
+}
+
+/*
+ * The shared littlefs instance for reading only, or NULL while the application holds it
+ *
+ * Unlike mimic_fat_lock(), changes written by the host are left pending, so readers
+ * such as the snapshot LUN do not disturb the write handles and journal of the mimic.
+ */
+lfs_t *mimic_fat_read_filesystem(void) {
+    if (is_locked || !is_mounted)
+        return NULL;
+    return &real_filesystem;
+}
+
+/*
+ * Take the shared littlefs instance for the application
+ *
+ * Changes written by the host are applied first, so that the application sees the
+ * tree the host sees, and the mimic does not touch littlefs until mimic_fat_unlock().
+ * Do not hold the lock across tud_task(). Call mimic_fat_notify_changed() after
+ * unlocking for the files changed while locked.
+ */
+lfs_t *mimic_fat_lock(void) {
+    if (!is_locked) {
+        dir_journal_commit_all();
+        write_handle_close_all();
+        deleted_entry_finalize_all();
+        block_map_invalidate();
+        is_locked = true;
+    }
+    return &real_filesystem;
+}
+
+void mimic_fat_unlock(void) {
+    is_locked = false;
+}
+
+bool mimic_fat_is_locked(void) {
+    return is_locked;
+}
+
+/*
+ * Apply all changes written by the host to littlefs
+ *
+ * Called at sync points such as SCSI SYNCHRONIZE CACHE, eject and suspend.
+ */
+void mimic_fat_flush(void) {
+    TRACE(ANSI_RED "mimic_fat_flush()\n" ANSI_CLEAR);
+    uint64_t start_at = time_us_64();
+
+    dir_journal_commit_all();
+    write_handle_close_all();
+    deleted_entry_finalize_all();
+
+    uint32_t elapsed = time_us_64() - start_at;
+    sync_stats.count++;
+    sync_stats.total_us += elapsed;
+    if (elapsed > sync_stats.max_us)
+        sync_stats.max_us = elapsed;
+    TRACE("mimic_fat_flush: %lu us\n", elapsed);
+}
+
+/*
+ * Changes made to littlefs by the firmware while USB is mounted
+ *
+ * The entry of the changed file is updated in the directory entry cache and its
+ * cluster chain is resized in the FAT, so that only the directory sector, the FAT
+ * sectors and the clusters of the file change in the image. Changes that can not be
+ * applied in place, such as a removed directory, rebuild the whole cache.
+ */
+static bool medium_changed = false;
+
+/*
+ * Index of the short filename entry of name in a directory cluster, or -1 if not found.
+ * *first is set to the first entry of its long filename chain.
+ */
+static int find_dir_entry_by_name(fat_dir_entry_t *dir, const char *name, int *first) {
+    uint16_t long_filename[LFS_NAME_MAX + 1];
+    char filename[LFS_NAME_MAX + 1];
+    int chain = -1;
+
+    for (int i = 0; i < 16; i++) {
+        if (dir[i].DIR_Name[0] == '\0')
+            break;
+        if (dir[i].DIR_Name[0] == 0xE5) {
+            chain = -1;
+            continue;
+        }
+        if ((dir[i].DIR_Attr & 0x0F) == 0x0F) {
+            fat_lfn_t *long_file = (fat_lfn_t *)&dir[i];
+            if (long_file->LDIR_Ord & 0x40) {
+                memset(long_filename, 0xFF, sizeof(long_filename));
+                chain = i;
+            }
+            int offset = (long_file->LDIR_Ord & 0x1F) - 1;
+            if (chain < 0 || offset < 0 || (offset + 1) * FAT_LONG_FILENAME_CHUNK_MAX > LFS_NAME_MAX + 1)
+                continue;
+            memcpy(&long_filename[offset * 13 + 0], long_file->LDIR_Name1, sizeof(uint16_t) * 5);
+            memcpy(&long_filename[offset * 13 + 5], long_file->LDIR_Name2, sizeof(uint16_t) * 6);
+            memcpy(&long_filename[offset * 13 + 5 + 6], long_file->LDIR_Name3, sizeof(uint16_t) * 2);
+            continue;
+        }
+        if ((dir[i].DIR_Attr & 0x08) || dir[i].DIR_Name[0] == '.') {  // volume label, `.` or `..`
+            chain = -1;
+            continue;
+        }
+
+        if (chain >= 0)
+            utf16le_to_utf8(filename, sizeof(filename), long_filename, sizeof(long_filename));
+        else if (dir[i].DIR_Attr & 0x10)
+            restore_from_short_dirname(filename, (const char *)dir[i].DIR_Name);
         else
-            update_file_entry(cluster, buffer, bufsize, &result, offset);
+            restore_from_short_filename(filename, (const char *)dir[i].DIR_Name);
+        if (strcmp(filename, name) == 0) {
+            if (first != NULL)
+                *first = chain >= 0 ? chain : i;
+            return i;
+        }
+        chain = -1;
     }
+    return -1;
+}
+
+/*
+ * Cluster of the directory entries of the littlefs directory path, or 0 if not cached
+ */
+static uint32_t find_directory_cluster(const char *path) {
+    char buffer[LFS_NAME_MAX + 1];
+    fat_dir_entry_t dir[16];
+    uint32_t cluster = 1;
+
+    snprintf(buffer, sizeof(buffer), "%s", path);
+    for (char *name = strtok(buffer, "/"); name != NULL; name = strtok(NULL, "/")) {
+        if (read_temporary_file(cluster, dir) != LFS_ERR_OK)
+            return 0;
+        int index = find_dir_entry_by_name(dir, name, NULL);
+        if (index < 0 || (dir[index].DIR_Attr & 0x10) == 0)
+            return 0;
+        cluster = dir[index].DIR_FstClusLO;
+    }
+    return cluster;
+}
+
+/*
+ * A free cluster, hint if it is free, or 0 if the image is full
+ */
+static uint32_t find_free_cluster(uint32_t hint) {
+    uint32_t limit = mimic_fat_total_sector_size() - fat_sector_size();
+
+    if (hint >= 2 && hint < limit && !is_allocated_cluster(hint) && !is_dirty_cluster(hint))
+        return hint;
+    for (uint32_t cluster = 2; cluster < limit; cluster++) {
+        if (!is_allocated_cluster(cluster) && !is_dirty_cluster(cluster))
+            return cluster;
+    }
+    return 0;
+}
+
+/*
+ * Resize the cluster chain starting at *first to hold size bytes
+ *
+ * The chain is cut or extended with free clusters, preferably the ones following it.
+ * *first is set to 0 for an empty file. Returns false if the image is full.
+ */
+static bool resize_cluster_chain(uint32_t *first, size_t size) {
+    size_t num = (size + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+    size_t limit = cluster_size();
+    uint32_t cluster = *first;
+    uint32_t last = 0;
+    size_t n = 0;
+
+    while (cluster >= 2 && cluster < 0xFF8 && n < num && limit-- > 0) {
+        last = cluster;
+        cluster = read_fat(cluster);
+        n++;
+    }
+    while (cluster >= 2 && cluster < 0xFF8 && limit-- > 0) {  // past the new end
+        uint32_t next = read_fat(cluster);
+        update_fat(cluster, 0x000);
+        cluster = next;
+    }
+    for (; n < num; n++) {
+        uint32_t next = find_free_cluster(last + 1);
+        if (next == 0) {
+            if (last != 0)
+                update_fat(last, END_OF_CLUSTER_CHAIN);
+            return false;
+        }
+        update_fat(next, END_OF_CLUSTER_CHAIN);
+        if (last == 0)
+            *first = next;
+        else
+            update_fat(last, next);
+        last = next;
+    }
+    if (last == 0)
+        *first = 0;
+    else
+        update_fat(last, END_OF_CLUSTER_CHAIN);
+    return true;
+}
+
+static size_t cluster_chain_length(uint32_t cluster) {
+    size_t limit = cluster_size();
+    size_t n = 0;
+    while (cluster >= 2 && cluster < 0xFF8 && n < limit) {
+        cluster = read_fat(cluster);
+        n++;
+    }
+    return n;
+}
+
+static int find_free_dir_entries(fat_dir_entry_t *dir, size_t num) {
+    for (size_t i = 0; i + num <= 16; i++) {
+        size_t n = 0;
+        while (n < num && (dir[i + n].DIR_Name[0] == '\0' || dir[i + n].DIR_Name[0] == 0xE5))
+            n++;
+        if (n == num)
+            return i;
+    }
+    return -1;
+}
+
+static bool is_empty_directory(const char *path) {
+    lfs_dir_t dir;
+    struct lfs_info finfo;
+    bool is_empty = true;
+
+    if (lfs_dir_open(&real_filesystem, &dir, path) != LFS_ERR_OK)
+        return false;
+    while (lfs_dir_read(&real_filesystem, &dir, &finfo) > 0) {
+        if (strcmp(finfo.name, ".") != 0 && strcmp(finfo.name, "..") != 0) {
+            is_empty = false;
+            break;
+        }
+    }
+    lfs_dir_close(&real_filesystem, &dir);
+    return is_empty;
+}
+
+/*
+ * Reflect the littlefs file or directory path in the cache. Returns false if the
+ * change can not be applied in place.
+ *
+ * The chain of a growing file keeps its reserve if keep_reserve is set, and is
+ * trimmed to the size of the file otherwise.
+ */
+static bool update_changed_entry(const char *path, bool keep_reserve) {
+    char directory[LFS_NAME_MAX + 1];
+    fat_dir_entry_t dir[16];
+    struct lfs_info finfo;
+
+    while (*path == '/')
+        path++;
+    const char *name = strrchr(path, '/');
+    if (name == NULL) {
+        directory[0] = '\0';
+        name = path;
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(name - path), path);
+        name++;
+    }
+    if (strlen(name) == 0 || strcmp(name, ".mimic") == 0)
+        return false;
+
+    uint32_t dir_cluster = find_directory_cluster(directory);
+    if (dir_cluster == 0 || read_temporary_file(dir_cluster, dir) != LFS_ERR_OK)
+        return false;
+
+    int first = 0;
+    int index = find_dir_entry_by_name(dir, name, &first);
+    int err = lfs_stat(&real_filesystem, path, &finfo);
+    if (err != LFS_ERR_OK && err != LFS_ERR_NOENT) {
+        printf("mimic_fat_notify_changed: lfs_stat('%s') error=%d\n", path, err);
+        return false;
+    }
+    bool is_exists = (err == LFS_ERR_OK);
+
+    if (index >= 0 && (dir[index].DIR_Attr & 0x10)) {
+        // a directory that still exists is unchanged in the image, a removed one is rebuilt
+        return is_exists && finfo.type == LFS_TYPE_DIR;
+    }
+    if (index >= 0 && !is_exists) {
+        TRACE("mimic_fat_notify_changed: remove '%s'\n", path);
+        uint32_t cluster = dir[index].DIR_FstClusLO;
+        if (!resize_cluster_chain(&cluster, 0))
+            return false;
+        for (int i = first; i <= index; i++)
+            dir[i].DIR_Name[0] = 0xE5;
+        return save_temporary_file(dir_cluster, dir);
+    }
+    if (index >= 0) {
+        if (finfo.type != LFS_TYPE_REG)
+            return false;
+        TRACE("mimic_fat_notify_changed: resize '%s' %lu -> %lu\n", path, dir[index].DIR_FileSize, finfo.size);
+        uint32_t cluster = dir[index].DIR_FstClusLO;
+        size_t reserve = keep_reserve ? growing_file_reserve(path) : 0;
+        if (reserve > 0 && finfo.size > 0 && cluster_chain_length(cluster) * DISK_SECTOR_SIZE >= finfo.size) {
+            dir[index].DIR_FileSize = finfo.size;  // within the reserved clusters
+            growing_file_t *file = growing_file_find(path);
+            if (file != NULL)
+                file->grown_at = time_us_64();
+            return save_temporary_file(dir_cluster, dir);
+        }
+        if (!resize_cluster_chain(&cluster, finfo.size > 0 ? finfo.size + reserve : 0))
+            return false;
+        if (reserve > 0 && finfo.size > 0)
+            growing_file_touch(path);
+        dir[index].DIR_FstClusLO = cluster;
+        dir[index].DIR_FileSize = finfo.size;
+        return save_temporary_file(dir_cluster, dir);
+    }
+    if (!is_exists)
+        return true;  // created and removed again
+
+    TRACE("mimic_fat_notify_changed: create '%s'\n", path);
+    fat_dir_entry_t entry[LFS_NAME_MAX / FAT_LONG_FILENAME_CHUNK_MAX + 2];
+    uint32_t cluster = 0;
+    if (finfo.type == LFS_TYPE_DIR) {
+        if (!is_empty_directory(path))
+            return false;
+        cluster = find_free_cluster(0);
+        if (cluster == 0)
+            return false;
+        update_fat(cluster, END_OF_CLUSTER_CHAIN);
+        create_blank_dir_entry_cache(cluster, dir_cluster);
+    } else if (!resize_cluster_chain(&cluster, finfo.size > 0 ? finfo.size + growing_file_reserve(path) : 0)) {
+        return false;
+    } else if (finfo.size > 0) {
+        growing_file_touch(path);
+    }
+    size_t num = mimic_fat_append_dir_entry(entry, &finfo, cluster) - entry;
+    int slot = find_free_dir_entries(dir, num);
+    if (slot < 0)
+        return false;
+    memcpy(&dir[slot], entry, sizeof(fat_dir_entry_t) * num);
+    return save_temporary_file(dir_cluster, dir);
+}
+
+/*
+ * Apply the pending host writes, then update the cache for path, or rebuild it
+ */
+static void apply_changed_entry(const char *path, bool keep_reserve) {
+    dir_journal_commit_all();
+    write_handle_close_all();
+    deleted_entry_finalize_all();
+
+    if (path == NULL || !update_changed_entry(path, keep_reserve)) {
+        mimic_fat_create_cache();
+    } else {
+        block_map_invalidate();
+        memset(&base_cluster_cache, 0, sizeof(base_cluster_cache));
+        sector_hash_reset();
+    }
+    medium_changed = true;
+}
+
+/*
+ * Tell the mimic that the firmware has changed the file or directory path in littlefs
+ *
+ * Call after the change is written and littlefs is unlocked. The directory
+ * entry and the FAT chain of path are updated, and the next TEST UNIT READY reports
+ * UNIT ATTENTION so that the host drops the sectors it has cached. Pass NULL when the
+ * whole file system has changed, such as after a format.
+ */
+void mimic_fat_notify_changed(const char *path) {
+    TRACE(ANSI_RED "mimic_fat_notify_changed('%s')\n" ANSI_CLEAR, path != NULL ? path : "(null)");
+    if (!usb_device_is_enabled)
+        return;  // the cache is built when USB is connected
+    apply_changed_entry(path, true);
+}
+
+/*
+ * Give back the reserved clusters of a growing file and stop reserving for it
+ *
+ * Call when the firmware closes the file for good, after littlefs is unlocked. The
+ * chain is trimmed to the size of the file, so that the FAT matches DIR_FileSize
+ * again. Register it with mimic_fat_set_growing_file() to append to it again.
+ */
+bool mimic_fat_close_growing_file(const char *path) {
+    while (*path == '/')
+        path++;
+    growing_file_t *file = growing_file_find(path);
+    if (file == NULL)
+        return false;
+
+    bool is_reserved = file->is_reserved;
+    *file = growing_file[--growing_file_num];
+    if (is_reserved && usb_device_is_enabled)
+        apply_changed_entry(path, false);
+    return true;
+}
+
+/*
+ * True once after mimic_fat_notify_changed(), to report UNIT ATTENTION to the host
+ */
+bool mimic_fat_medium_changed(void) {
+    bool changed = medium_changed;
+    medium_changed = false;
+    return changed;
+}
+
+void mimic_fat_sync_stats(mimic_fat_sync_stats_t *stats) {
+    memcpy(stats, &sync_stats, sizeof(sync_stats));
+}
+
+void mimic_fat_write_stats(mimic_fat_write_stats_t *stats) {
+    memcpy(stats, &write_stats, sizeof(write_stats));
 }
@@ -0,0 +1,427 @@
+/*
+ * Read-only FAT12 snapshot of the littlefs tree
+ *
+ * The tree is walked once and indexed in RAM: the FAT directory entries of every
+ * directory, and the clusters and size of every file. Clusters are laid out one
+ * file after another, so the FAT is computed from the index, and a run of sectors
+ * of one file is served with a single littlefs read. Nothing is written to littlefs.
+ *
+ * The layout of the tree is frozen when the snapshot is created; file data is read
+ * from littlefs on demand, up to the size recorded in the snapshot. littlefs is the
+ * instance shared with the mimic, taken read-only with mimic_fat_read_filesystem()
+ * for each access, and no file is left open in between: a file removed or rewritten
+ * after the snapshot reads as its current contents, never as blocks littlefs may
+ * have erased.
+ *
+ * Copyright 2024, Hiroyuki OYAMA. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "snapshot_fat.h"
+
+
+#define ANSI_RED "\e[31m"
+#define ANSI_CLEAR "\e[0m"
+
+#ifdef  ENABLE_TRACE
+#define TRACE(...) (printf(__VA_ARGS__))
+#else
+#define TRACE(...) ((void)0)
+#endif
+
+#define SNAPSHOT_VOLUME_LABEL  "SNAPSHOT"
+#define SNAPSHOT_VOLUME_ID     0x00001235  // differs from the writable volume
+
+#define ROOT_DIR_ENTRY_MAX     16  // BPB_RootEntCnt
+#define DIR_ENTRY_PER_SECTOR   (DISK_SECTOR_SIZE / sizeof(fat_dir_entry_t))
+#define NAME_DIR_ENTRY_MAX     (LFS_NAME_MAX / 13 + 2)  // long filename entries and the short filename entry
+#define PATH_SIZE              (LFS_NAME_MAX * 2 + 1 + 1)
+
+/*
+ * A file or directory of the snapshot. Node 0 is the root directory, and the
+ * children of a directory are consecutive nodes.
+ */
+typedef struct {
+    uint16_t parent;
+    uint16_t name;           // offset in name_pool
+    uint16_t entry;          // first of its entries in the parent directory
+    uint16_t entry_num;
+    uint16_t dir_entry;      // directory: first of its own entries
+    uint16_t dir_entry_num;
+    uint8_t type;            // LFS_TYPE_REG or LFS_TYPE_DIR
+    uint32_t cluster;
+    uint32_t cluster_num;
+    uint32_t size;
+} snapshot_node_t;
+
+static const struct lfs_config *snapshot_lfs_config = NULL;
+static bool is_created = false;
+
+static snapshot_node_t node[SNAPSHOT_FAT_NODE_MAX];
+static size_t node_num = 0;
+static fat_dir_entry_t dir_entry[SNAPSHOT_FAT_DIR_ENTRY_MAX];
+static size_t dir_entry_num = 0;
+static char name_pool[SNAPSHOT_FAT_NAME_POOL_SIZE];
+static size_t name_pool_size = 0;
+
+
+void snapshot_fat_init(const struct lfs_config *c) {
+    snapshot_lfs_config = c;
+}
+
+bool snapshot_fat_is_created(void) {
+    return is_created;
+}
+
+size_t snapshot_fat_total_sector_size(void) {
+    uint64_t storage_size = (uint64_t)snapshot_lfs_config->block_count * snapshot_lfs_config->block_size;
+    return storage_size / DISK_SECTOR_SIZE;
+}
+
+static size_t fat_sector_size(void) {
+    return (snapshot_fat_total_sector_size() + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+}
+
+static uint32_t max_cluster(void) {
+    return snapshot_fat_total_sector_size() - fat_sector_size() - 1;
+}
+
+static bool node_path(size_t index, char *path, size_t size) {
+    if (index == 0) {
+        path[0] = '\0';
+        return true;
+    }
+    if (!node_path(node[index].parent, path, size))
+        return false;
+
+    size_t length = strlen(path);
+    int n = snprintf(path + length, size - length, length == 0 ? "%s" : "/%s", &name_pool[node[index].name]);
+    return n >= 0 && (size_t)n < size - length;
+}
+
+static bool append_entries(const fat_dir_entry_t *entries, size_t num) {
+    if (dir_entry_num + num > SNAPSHOT_FAT_DIR_ENTRY_MAX)
+        return false;
+    memcpy(&dir_entry[dir_entry_num], entries, sizeof(fat_dir_entry_t) * num);
+    dir_entry_num += num;
+    return true;
+}
+
+/*
+ * Append a child to the directory being indexed. Returns false if the index is full
+ */
+static bool add_node(size_t parent, struct lfs_info *finfo) {
+    fat_dir_entry_t entries[NAME_DIR_ENTRY_MAX];
+    size_t num = mimic_fat_append_dir_entry(entries, finfo, 0) - entries;
+    size_t name_size = strlen(finfo->name) + 1;
+
+    if (node_num >= SNAPSHOT_FAT_NODE_MAX || name_pool_size + name_size > SNAPSHOT_FAT_NAME_POOL_SIZE)
+        return false;
+    if (parent == 0 && node[0].dir_entry_num + num > ROOT_DIR_ENTRY_MAX)
+        return false;
+    size_t entry = dir_entry_num;
+    if (!append_entries(entries, num))
+        return false;
+
+    snapshot_node_t *n = &node[node_num++];
+    memset(n, 0, sizeof(snapshot_node_t));
+    n->parent = parent;
+    n->name = name_pool_size;
+    n->entry = entry;
+    n->entry_num = num;
+    n->type = finfo->type;
+    n->size = finfo->type == LFS_TYPE_REG ? finfo->size : 0;
+    memcpy(&name_pool[name_pool_size], finfo->name, name_size);
+    name_pool_size += name_size;
+    node[parent].dir_entry_num += num;
+    return true;
+}
+
+/*
+ * Append the entries of the directory node, and its children to the nodes
+ */
+static int index_directory(lfs_t *fs, size_t index) {
+    char path[PATH_SIZE];
+    lfs_dir_t dir;
+    struct lfs_info finfo;
+
+    if (!node_path(index, path, sizeof(path))) {
+        printf("snapshot_fat: path of '%s' is too long\n", &name_pool[node[index].name]);
+        return LFS_ERR_NAMETOOLONG;
+    }
+
+    node[index].dir_entry = dir_entry_num;
+    if (index == 0) {
+        fat_dir_entry_t label;
+        set_volume_label_entry(&label, SNAPSHOT_VOLUME_LABEL);
+        append_entries(&label, 1);
+        node[index].dir_entry_num = 1;
+    } else {
+        fat_dir_entry_t dot[2];
+        finfo.type = LFS_TYPE_DIR;
+        strcpy(finfo.name, ".");
+        mimic_fat_append_dir_entry(&dot[0], &finfo, 0);
+        strcpy(finfo.name, "..");
+        mimic_fat_append_dir_entry(&dot[1], &finfo, 0);
+        if (!append_entries(dot, 2))
+            return LFS_ERR_NOSPC;
+        node[index].dir_entry_num = 2;
+    }
+
+    int err = lfs_dir_open(fs, &dir, path);
+    if (err != LFS_ERR_OK) {
+        printf("snapshot_fat: lfs_dir_open('%s') error=%d\n", path, err);
+        return err;
+    }
+    while (true) {
+        err = lfs_dir_read(fs, &dir, &finfo);
+        if (err == 0)
+            break;
+        if (err < 0) {
+            printf("snapshot_fat: lfs_dir_read('%s') error=%d\n", path, err);
+            break;
+        }
+        if (strcmp(finfo.name, ".") == 0 || strcmp(finfo.name, "..") == 0)
+            continue;
+        if (index == 0 && finfo.type == LFS_TYPE_DIR && strcmp(finfo.name, ".mimic") == 0)
+            continue;
+
+        if (!add_node(index, &finfo))
+            printf("snapshot_fat: '%s/%s' does not fit in the snapshot\n", path, finfo.name);
+    }
+    lfs_dir_close(fs, &dir);
+    return LFS_ERR_OK;
+}
+
+static void hide_node(snapshot_node_t *n) {
+    for (size_t i = 0; i < n->entry_num; i++)
+        dir_entry[n->entry + i].DIR_Name[0] = 0xE5;
+}
+
+/*
+ * Lay out the clusters of the nodes one after another, and fill in the first clusters
+ * of the directory entries
+ */
+static void allocate_clusters(void) {
+    uint32_t cluster = 2;
+
+    node[0].cluster = 1;
+    node[0].cluster_num = 1;
+    for (size_t i = 1; i < node_num; i++) {
+        snapshot_node_t *n = &node[i];
+        uint32_t num;
+        if (n->type == LFS_TYPE_DIR)
+            num = (n->dir_entry_num + DIR_ENTRY_PER_SECTOR - 1) / DIR_ENTRY_PER_SECTOR;
+        else
+            num = (n->size + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+        if (num > 0 && cluster + num - 1 > max_cluster()) {
+            printf("snapshot_fat: '%s' does not fit in the FAT image\n", &name_pool[n->name]);
+            hide_node(n);
+            num = 0;
+        }
+        n->cluster = cluster;
+        n->cluster_num = num;
+        cluster += num;
+
+        dir_entry[n->entry + n->entry_num - 1].DIR_FstClusLO = num > 0 ? n->cluster : 0;
+        if (n->type == LFS_TYPE_DIR) {
+            dir_entry[n->dir_entry].DIR_FstClusLO = n->cluster;
+            dir_entry[n->dir_entry + 1].DIR_FstClusLO = n->parent == 0 ? 0 : node[n->parent].cluster;
+        }
+    }
+}
+
+/*
+ * Take a snapshot of the littlefs tree. Fails while the application holds littlefs
+ */
+bool snapshot_fat_create(void) {
+    TRACE(ANSI_RED "snapshot_fat_create()\n" ANSI_CLEAR);
+
+    snapshot_fat_release();
+    lfs_t *fs = mimic_fat_read_filesystem();
+    if (fs == NULL) {
+        printf("snapshot_fat_create: littlefs is not available\n");
+        return false;
+    }
+
+    memset(&node[0], 0, sizeof(snapshot_node_t));
+    node[0].type = LFS_TYPE_DIR;
+    node_num = 1;
+    dir_entry_num = 0;
+    name_pool[0] = '\0';
+    name_pool_size = 1;
+
+    for (size_t i = 0; i < node_num; i++) {
+        if (node[i].type == LFS_TYPE_DIR)
+            index_directory(fs, i);
+    }
+    allocate_clusters();
+    is_created = true;
+
+    TRACE("snapshot_fat_create: %u nodes, %u directory entries\n", node_num, dir_entry_num);
+    return true;
+}
+
+void snapshot_fat_release(void) {
+    is_created = false;
+}
+
+/*
+ * The node that holds cluster, or NULL for a free cluster
+ */
+static snapshot_node_t *find_node(uint32_t cluster) {
+    // the last node whose first cluster is not greater than cluster
+    size_t low = 1;
+    size_t high = node_num;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (node[middle].cluster <= cluster)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 1)
+        return NULL;
+
+    snapshot_node_t *n = &node[low - 1];
+    return cluster < n->cluster + n->cluster_num ? n : NULL;
+}
+
+static uint16_t fat_entry(uint32_t cluster) {
+    if (cluster == 0)
+        return 0xFF8;  // media descriptor
+    if (cluster == 1)
+        return 0xFFF;  // root directory
+
+    snapshot_node_t *n = find_node(cluster);
+    if (n == NULL)
+        return 0x000;
+    return cluster + 1 < n->cluster + n->cluster_num ? cluster + 1 : 0xFFF;
+}
+
+static void put_fat_byte(uint8_t *sector, int32_t offset, uint8_t value, uint8_t mask) {
+    if (offset < 0 || offset >= DISK_SECTOR_SIZE)
+        return;
+    sector[offset] = (sector[offset] & ~mask) | (value & mask);
+}
+
+static void read_fat_sector(uint32_t sector, uint8_t *buffer) {
+    int32_t first = (sector - 1) * DISK_SECTOR_SIZE;  // offset of the sector in the FAT
+
+    memset(buffer, 0, DISK_SECTOR_SIZE);
+    for (uint32_t cluster = first > 0 ? first * 2 / 3 - 1 : 0; (int32_t)(cluster * 3 / 2) < first + DISK_SECTOR_SIZE; cluster++) {
+        uint16_t value = fat_entry(cluster);
+        int32_t offset = cluster * 3 / 2 - first;
+        if (cluster & 1) {
+            put_fat_byte(buffer, offset, value << 4, 0xF0);
+            put_fat_byte(buffer, offset + 1, value >> 4, 0xFF);
+        } else {
+            put_fat_byte(buffer, offset, value, 0xFF);
+            put_fat_byte(buffer, offset + 1, value >> 8, 0x0F);
+        }
+    }
+}
+
+static void read_boot_sector(uint8_t *buffer) {
+    mimic_fat_boot_sector(buffer, snapshot_fat_total_sector_size());
+
+    // BS_VolID, BS_VolLab
+    uint32_t volume_id = SNAPSHOT_VOLUME_ID;
+    memcpy(&buffer[39], &volume_id, sizeof(volume_id));
+    char label[11 + 1];
+    snprintf(label, sizeof(label), "%-11s", SNAPSHOT_VOLUME_LABEL);
+    memcpy(&buffer[43], label, 11);
+}
+
+static void read_dir_sector(snapshot_node_t *n, uint32_t index, uint8_t *buffer) {
+    size_t first = index * DIR_ENTRY_PER_SECTOR;
+    size_t num = 0;
+    if (first < n->dir_entry_num)
+        num = n->dir_entry_num - first < DIR_ENTRY_PER_SECTOR ? n->dir_entry_num - first : DIR_ENTRY_PER_SECTOR;
+
+    memset(buffer, 0, DISK_SECTOR_SIZE);
+    memcpy(buffer, &dir_entry[n->dir_entry + first], sizeof(fat_dir_entry_t) * num);
+}
+
+static void read_file(snapshot_node_t *n, lfs_off_t offset, uint8_t *buffer, uint32_t size) {
+    char path[PATH_SIZE];
+    lfs_file_t file;
+
+    memset(buffer, 0, size);
+    if (offset >= n->size || !node_path(n - node, path, sizeof(path)))
+        return;
+
+    lfs_t *fs = mimic_fat_read_filesystem();
+    if (fs == NULL)
+        return;
+    int err = lfs_file_open(fs, &file, path, LFS_O_RDONLY);
+    if (err != LFS_ERR_OK) {
+        if (err != LFS_ERR_NOENT)
+            printf("snapshot_fat_read: lfs_file_open('%s') error=%d\n", path, err);
+        return;
+    }
+
+    uint32_t read_size = n->size - offset < size ? n->size - offset : size;
+    lfs_soff_t seek = lfs_file_seek(fs, &file, offset, LFS_SEEK_SET);
+    if (seek < 0) {
+        printf("snapshot_fat_read: lfs_file_seek(offset=%lu) error=%ld\n", (unsigned long)offset, (long)seek);
+    } else {
+        lfs_ssize_t s = lfs_file_read(fs, &file, buffer, read_size);
+        if (s < 0)
+            printf("snapshot_fat_read: lfs_file_read(offset=%lu) error=%ld\n", (unsigned long)offset, (long)s);
+    }
+    lfs_file_close(fs, &file);
+}
+
+/*
+ * Read the run of sectors from sector that is served with one operation: one sector
+ * of metadata, or contiguous clusters of one file. Returns the number of bytes read.
+ */
+static uint32_t read_sector_run(uint32_t sector, uint8_t *buffer, uint32_t bufsize) {
+    uint8_t temporary[DISK_SECTOR_SIZE];
+    uint32_t size = bufsize < DISK_SECTOR_SIZE ? bufsize : DISK_SECTOR_SIZE;
+    uint32_t fat_sectors = fat_sector_size();
+
+    if (sector == 0) {
+        read_boot_sector(temporary);
+    } else if (sector <= fat_sectors) {
+        read_fat_sector(sector, temporary);
+    } else {
+        uint32_t cluster = sector - fat_sectors;
+        snapshot_node_t *n = cluster == 1 ? &node[0] : find_node(cluster);
+        if (n == NULL) {
+            memset(temporary, 0, sizeof(temporary));
+        } else if (n->type == LFS_TYPE_DIR) {
+            read_dir_sector(n, cluster - n->cluster, temporary);
+        } else {
+            uint32_t sectors = n->cluster + n->cluster_num - cluster;
+            if (sectors * DISK_SECTOR_SIZE < bufsize)
+                size = sectors * DISK_SECTOR_SIZE;
+            else
+                size = bufsize;
+            read_file(n, (cluster - n->cluster) * DISK_SECTOR_SIZE, buffer, size);
+            return size;
+        }
+    }
+    memcpy(buffer, temporary, size);
+    return size;
+}
+
+/*
+ * Read bufsize bytes from sector of the snapshot. Reads before the snapshot is
+ * created return zeros.
+ */
+void snapshot_fat_read(uint32_t sector, void *buffer, uint32_t bufsize) {
+    TRACE("\e[36mRead sector=%lu snapshot_fat_read()\e[0m\n", sector);
+
+    uint8_t *p = buffer;
+    if (!is_created) {
+        memset(buffer, 0, bufsize);
+        return;
+    }
+    while (bufsize > 0) {
+        uint32_t size = read_sector_run(sector, p, bufsize);
+        sector += size / DISK_SECTOR_SIZE;
+        p += size;
+        bufsize -= size;
+    }
+}
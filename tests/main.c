@@ -19,6 +19,15 @@ int main(void) {
     test_rename();
     test_move();
     test_delete();
+    test_sync();
+    test_dir_entry_diff();
+    test_usb_msc();
+    test_snapshot();
+    test_notify();
+#if PICO_ON_DEVICE
+    test_pre_erase();
+    test_flash_stats();
+#endif
 
     test_large_file();
 
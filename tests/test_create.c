@@ -2,8 +2,6 @@
 
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
-extern int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 
@@ -17,6 +15,7 @@ static void setup(void) {
 }
 
 static void reload(void) {
+    mimic_fat_flush();
     lfs_unmount(&fs);
     int err = lfs_mount(&fs, &lfs_pico_flash_config);
     assert(err == 0);
@@ -44,17 +43,17 @@ static void test_create_file(void) {
     uint16_t cluster = 2;
     memset(buffer, 0, sizeof(buffer));
     strncpy(buffer, message, sizeof(buffer));
-    tud_msc_write10_cb(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));  // write to anonymous cache
+    msc_write10(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));  // write to anonymous cache
 
     uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0x00, 0x00};
     update_fat(fat, cluster, 0xFFF);
-    tud_msc_write10_cb(0, first_fat_sector, 0, fat, sizeof(fat));  // update file allocated table
+    msc_write10(0, first_fat_sector, 0, fat, sizeof(fat));  // update file allocated table
 
     fat_dir_entry_t root[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "CREATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen(message)},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
 
     reload();
 
@@ -87,7 +86,7 @@ static void test_create_file_windows11(void) {
     };
     uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
     uint32_t root_dir_sector = fat_sectors + 1;
-    tud_msc_write10_cb(0, root_dir_sector, 0, root0, sizeof(root0));
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));
 
     // update dir entry. The cluster to be assigned is specified. Not yet allocated.
     uint16_t cluster = root_dir_sector + 1;
@@ -95,17 +94,17 @@ static void test_create_file_windows11(void) {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "CREATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen(message)},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root1, sizeof(root1));
+    msc_write10(0, root_dir_sector, 0, root1, sizeof(root1));
 
     // write the file block to the cluster specified in step 2.
     memset(buffer, 0, sizeof(buffer));
     strncpy(buffer, message, sizeof(buffer));
-    tud_msc_write10_cb(0, cluster + fat_sectors, 0, buffer, sizeof(buffer));
+    msc_write10(0, cluster + fat_sectors, 0, buffer, sizeof(buffer));
 
     // update File allocation table
     uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0x00, 0x00};
     update_fat(fat, cluster, 0xFFF);
-    tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat));
+    msc_write10(0, 1, 0, fat, sizeof(fat));
 
     reload();
 
@@ -139,21 +138,21 @@ static void test_create_accross_blocksize(void) {
     // Update procedure from the USB layer
     uint16_t cluster = root_dir_sector + 1;
     memcpy(buffer, message, sizeof(buffer));
-    tud_msc_write10_cb(0, cluster + fat_sectors, 0, buffer, sizeof(buffer));  // write to first block
+    msc_write10(0, cluster + fat_sectors, 0, buffer, sizeof(buffer));  // write to first block
     memset(buffer, 0, sizeof(buffer));
     strncpy(buffer, message + 512, sizeof(buffer));
-    tud_msc_write10_cb(0, cluster + fat_sectors + 1, 0, buffer, sizeof(buffer));  // write to 2nd block
+    msc_write10(0, cluster + fat_sectors + 1, 0, buffer, sizeof(buffer));  // write to 2nd block
 
     uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0x00, 0x00};
     update_fat(fat, cluster, cluster + 1);  // point next cluster
     update_fat(fat, cluster + 1, 0xFFF);  // terminate allocate chain
-    tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat));  // update file allocated table
+    msc_write10(0, 1, 0, fat, sizeof(fat));  // update file allocated table
 
     fat_dir_entry_t root[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "CREATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen(message)},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
 
     reload();
 
@@ -169,12 +168,50 @@ static void test_create_accross_blocksize(void) {
     cleanup();
 }
 
+static void test_create_directory_superseded(void) {
+    setup();
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    // The host creates a directory with a temporary name and renames it immediately.
+    fat_dir_entry_t root0[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "NEWDIR     ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+    };
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));
+    fat_dir_entry_t root1[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "FINAL      ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+    };
+    msc_write10(0, root_dir_sector, 0, root1, sizeof(root1));
+
+    // Nothing is applied to littlefs until the directory entry is flushed
+    struct lfs_info finfo;
+    int err = lfs_stat(&fs, "FINAL", &finfo);
+    assert(err == LFS_ERR_NOENT);
+
+    reload();
+
+    err = lfs_stat(&fs, "FINAL", &finfo);
+    assert(err == LFS_ERR_OK);
+    assert(finfo.type == LFS_TYPE_DIR);
+    err = lfs_stat(&fs, "NEWDIR", &finfo);
+    assert(err == LFS_ERR_NOENT);
+
+    cleanup();
+}
+
 void test_create(void) {
     printf("create .................");
 
     test_create_file();
     test_create_file_windows11();
     test_create_accross_blocksize();
+    test_create_directory_superseded();
 
     printf("ok\n");
 }
@@ -2,7 +2,6 @@
 
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 
@@ -28,6 +27,7 @@ static void setup_dir(void) {
 }
 
 static void reload(void) {
+    mimic_fat_flush();
     lfs_unmount(&fs);
     int err = lfs_mount(&fs, &lfs_pico_flash_config);
     assert(err == 0);
@@ -57,12 +57,12 @@ static void test_delete_file(void) {
         {.DIR_Name = "DELETEMETXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen(MESSAGE)},
     };
     root[1].DIR_Name[0] = 0xE5;  // delete flag
-    tud_msc_write10_cb(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
 
     // update File allocation table
     uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0xFF, 0x0F};  // With cluster 2 allocated
     update_fat(fat, cluster, 0x000);
-    tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat));  // update file allocated table
+    msc_write10(0, 1, 0, fat, sizeof(fat));  // update file allocated table
 
     reload();
 
@@ -94,7 +94,7 @@ static void test_delete_dir(void) {
         {.DIR_Name = "DIR_DEL    ", .DIR_Attr = 0x10, .DIR_FstClusLO = cluster, .DIR_FileSize = 0},
     };
     root[1].DIR_Name[0] = 0xE5;  // delete flag
-    tud_msc_write10_cb(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
 
     reload();
 
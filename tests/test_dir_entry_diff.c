@@ -0,0 +1,194 @@
+#include "tests.h"
+#include "dir_entry_diff.h"
+
+
+static dir_entry_diff_t diff[32];
+
+static uint8_t check_sum(const uint8_t *filename) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+        sum = (sum >> 1) + (sum << 7) + filename[i];
+    return sum;
+}
+
+static void set_long_filename(fat_dir_entry_t *entry, const char *part1, const char *part2) {
+    uint8_t sum = check_sum(entry[2].DIR_Name);
+    set_long_filename_entry((fat_lfn_t *)&entry[0], (uint8_t *)part2, 0x42);
+    set_long_filename_entry((fat_lfn_t *)&entry[1], (uint8_t *)part1, 0x01);
+    ((fat_lfn_t *)&entry[0])->LDIR_Chksum = sum;
+    ((fat_lfn_t *)&entry[1])->LDIR_Chksum = sum;
+}
+
+static void test_dir_entry_diff_unchanged(void) {
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "DIR        ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+        {.DIR_Name = "FILE    TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = 10},
+    };
+
+    size_t num = dir_entry_diff(orig, orig, 16, diff, 32);
+    assert(num == 0);
+}
+
+static void test_dir_entry_diff_create_and_delete(void) {
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "DELETE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 10},
+    };
+    fat_dir_entry_t new[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "DELETE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 10},
+        {.DIR_Name = "CREATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = 20},
+    };
+    new[1].DIR_Name[0] = 0xE5;
+
+    size_t num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 2);
+    assert(diff[0].type == DIR_ENTRY_DIFF_CREATE);
+    assert(diff[0].orig == NULL);
+    assert(diff[0].new == &new[2]);
+    assert(diff[1].type == DIR_ENTRY_DIFF_DELETE);
+    assert(diff[1].orig == &orig[1]);
+    assert(diff[1].new == NULL);
+}
+
+static void test_dir_entry_diff_rename(void) {
+    // Renamed in place, as Windows 11 does
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "ORIGINALTXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 10},
+        {.DIR_Name = "DIR        ", .DIR_Attr = 0x10, .DIR_FstClusLO = 3, .DIR_FileSize = 0},
+    };
+    // Deleted and added at another position, as macOS does
+    fat_dir_entry_t new[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "RENAMED TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 10},
+        {.DIR_Name = "DIR        ", .DIR_Attr = 0x10, .DIR_FstClusLO = 3, .DIR_FileSize = 0},
+        {.DIR_Name = "NEWDIR     ", .DIR_Attr = 0x10, .DIR_FstClusLO = 3, .DIR_FileSize = 0},
+    };
+    new[2].DIR_Name[0] = 0xE5;
+
+    size_t num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 2);
+    assert(diff[0].type == DIR_ENTRY_DIFF_RENAME);
+    assert(diff[0].orig == &orig[1]);
+    assert(diff[0].new == &new[1]);
+    assert(diff[1].type == DIR_ENTRY_DIFF_RENAME);
+    assert(diff[1].orig == &orig[2]);
+    assert(diff[1].new == &new[3]);
+}
+
+static void test_dir_entry_diff_resize_and_attr(void) {
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "RESIZE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 10},
+        {.DIR_Name = "ATTR    TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = 10},
+        {.DIR_Name = "EMPTY   TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+    };
+    fat_dir_entry_t new[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "RESIZE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 600},
+        {.DIR_Name = "ATTR    TXT", .DIR_Attr = 0x21, .DIR_FstClusLO = 3, .DIR_FileSize = 10},
+        {.DIR_Name = "EMPTY   TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 5, .DIR_FileSize = 10},
+    };
+
+    size_t num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 3);
+    assert(diff[0].type == DIR_ENTRY_DIFF_RESIZE);
+    assert(diff[0].new == &new[1]);
+    assert(diff[1].type == DIR_ENTRY_DIFF_ATTR);
+    assert(diff[1].new == &new[2]);
+    assert(diff[2].type == DIR_ENTRY_DIFF_RESIZE);
+    assert(diff[2].orig == &orig[3]);
+    assert(diff[2].new == &new[3]);
+}
+
+static void test_dir_entry_diff_safe_save(void) {
+    // The old file is renamed away and a new file takes its name, as editors do
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "FILE    TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 5, .DIR_FileSize = 10},
+    };
+    fat_dir_entry_t new[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "FILE    TX~", .DIR_Attr = 0x20, .DIR_FstClusLO = 5, .DIR_FileSize = 10},
+        {.DIR_Name = "FILE    TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 9, .DIR_FileSize = 20},
+    };
+
+    size_t num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 2);
+    assert(diff[0].type == DIR_ENTRY_DIFF_RENAME);
+    assert(diff[0].orig == &orig[1]);
+    assert(diff[0].new == &new[1]);
+    assert(diff[1].type == DIR_ENTRY_DIFF_CREATE);
+    assert(diff[1].orig == NULL);
+    assert(diff[1].new == &new[2]);
+}
+
+static void test_dir_entry_diff_swap(void) {
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "A       TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 5, .DIR_FileSize = 10},
+        {.DIR_Name = "B       TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 6, .DIR_FileSize = 20},
+    };
+    fat_dir_entry_t new[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "A       TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 6, .DIR_FileSize = 20},
+        {.DIR_Name = "B       TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 5, .DIR_FileSize = 10},
+    };
+
+    size_t num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 2);
+    assert(diff[0].type == DIR_ENTRY_DIFF_RENAME);
+    assert(diff[0].orig == &orig[2]);
+    assert(diff[0].new == &new[1]);
+    assert(diff[1].type == DIR_ENTRY_DIFF_RENAME);
+    assert(diff[1].orig == &orig[1]);
+    assert(diff[1].new == &new[2]);
+}
+
+static void test_dir_entry_diff_long_filename(void) {
+    // Same short filename alias, different long filenames
+    fat_dir_entry_t orig[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {0},
+        {0},
+        {.DIR_Name = "LONGFI~1TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = 10},
+    };
+    set_long_filename(&orig[1], "long filename", " one.txt");
+    fat_dir_entry_t new[16];
+    memcpy(new, orig, sizeof(new));
+    set_long_filename(&new[1], "long filename", " two.txt");
+
+    size_t num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 1);
+    assert(diff[0].type == DIR_ENTRY_DIFF_RENAME);
+    assert(diff[0].orig == &orig[3]);
+    assert(diff[0].new == &new[3]);
+
+    // A chain whose checksum does not match the short filename is ignored
+    memcpy(new, orig, sizeof(new));
+    set_long_filename(&new[1], "long filename", " two.txt");
+    ((fat_lfn_t *)&new[1])->LDIR_Chksum ^= 0xFF;
+    ((fat_lfn_t *)&new[2])->LDIR_Chksum ^= 0xFF;
+    set_long_filename(&orig[1], "long filename", " two.txt");
+    ((fat_lfn_t *)&orig[1])->LDIR_Chksum ^= 0x01;
+    ((fat_lfn_t *)&orig[2])->LDIR_Chksum ^= 0x01;
+
+    num = dir_entry_diff(orig, new, 16, diff, 32);
+    assert(num == 0);
+}
+
+void test_dir_entry_diff(void) {
+    printf("dir_entry_diff .........");
+
+    test_dir_entry_diff_unchanged();
+    test_dir_entry_diff_create_and_delete();
+    test_dir_entry_diff_rename();
+    test_dir_entry_diff_resize_and_attr();
+    test_dir_entry_diff_safe_save();
+    test_dir_entry_diff_swap();
+    test_dir_entry_diff_long_filename();
+
+    printf("ok\n");
+}
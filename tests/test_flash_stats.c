@@ -0,0 +1,49 @@
+#include "tests.h"
+#include <hardware/flash.h>
+#include "littlefs_driver.h"
+
+
+static lfs_t fs;
+static littlefs_flash_stats_t before, after;
+
+
+static uint32_t histogram_total(const littlefs_flash_stats_t *stats, littlefs_flash_op_t op) {
+    uint32_t total = 0;
+    for (size_t i = 0; i < LITTLEFS_FLASH_HISTOGRAM_SIZE; i++)
+        total += stats->histogram[op][i];
+    return total;
+}
+
+static void test_flash_stats_count(void) {
+    littlefs_flash_stats(&before);
+    uint32_t erase_count = littlefs_erase_count(0);
+    littlefs_bulk_erase(0, 1);
+    assert(littlefs_erase_count(0) == erase_count + 1);
+
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    create_file(&fs, "STATS.TXT", "flash statistics\n");
+    lfs_unmount(&fs);
+
+    littlefs_flash_stats(&after);
+    assert(after.count[LITTLEFS_FLASH_OP_READ] > before.count[LITTLEFS_FLASH_OP_READ]);
+    assert(after.count[LITTLEFS_FLASH_OP_PROG] > before.count[LITTLEFS_FLASH_OP_PROG]);
+    assert(after.count[LITTLEFS_FLASH_OP_ERASE] > before.count[LITTLEFS_FLASH_OP_ERASE]);
+    assert(after.read_bytes > before.read_bytes);
+    assert(after.prog_bytes >= before.prog_bytes + FLASH_PAGE_SIZE);
+    assert(after.interrupts_disabled_us > before.interrupts_disabled_us);
+    assert(after.interrupts_disabled_max_us > 0);
+
+    for (int op = 0; op < LITTLEFS_FLASH_OP_NUM; op++)
+        assert(histogram_total(&after, op) == after.count[op]);
+}
+
+void test_flash_stats(void) {
+    printf("flash_stats ............");
+
+    test_flash_stats_count();
+
+    printf("ok\n");
+}
@@ -2,19 +2,19 @@
 #include <hardware/flash.h>
 #include <hardware/sync.h>
 #include <hardware/regs/addressmap.h>
+#include "littlefs_profile.h"
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 static struct lfs_config test_config = {
-    .read_size      = 1,
-    .prog_size      = FLASH_PAGE_SIZE,
-    .block_size     = FLASH_SECTOR_SIZE,
-    .block_count    = (1.8 * 1024 * 1024) / FLASH_SECTOR_SIZE,
-    .cache_size     = FLASH_SECTOR_SIZE,
-    .lookahead_size = 16,
-    .block_cycles   = 500,
+    .read_size      = LITTLEFS_READ_SIZE,
+    .prog_size      = LITTLEFS_PROG_SIZE,
+    .block_size     = LITTLEFS_BLOCK_SIZE,
+    .block_count    = LITTLEFS_BLOCK_COUNT,
+    .cache_size     = LITTLEFS_CACHE_SIZE,
+    .lookahead_size = LITTLEFS_LOOKAHEAD_SIZE,
+    .block_cycles   = LITTLEFS_BLOCK_CYCLES,
 };
 
 static void setup(void) {
@@ -88,13 +88,13 @@ static void test_read_large_file(size_t file_size) {
     mimic_fat_init(&lfs_pico_flash_config);
     mimic_fat_create_cache();
 
-    tud_msc_read10_cb(0, 0, 0, buffer, sizeof(buffer));  // Boot sector
-    tud_msc_read10_cb(0, 1, 0, buffer, sizeof(buffer));  // Allocation table
+    msc_read10(0, 0, 0, buffer, sizeof(buffer));  // Boot sector
+    msc_read10(0, 1, 0, buffer, sizeof(buffer));  // Allocation table
 
     uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
     uint32_t root_dir_sector = fat_sectors + 1;
 
-    tud_msc_read10_cb(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
+    msc_read10(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
     fat_dir_entry_t root[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "LARGE   TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = file_size},
@@ -115,7 +115,7 @@ static void test_read_large_file(size_t file_size) {
         for (size_t i = 0; i < (chunk / 4); i++) {
             b[i] = xor_rand(&counter);
         }
-        tud_msc_read10_cb(0, file_sector, 0, buffer, sizeof(buffer));
+        msc_read10(0, file_sector, 0, buffer, sizeof(buffer));
         file_sector++;
         remind = remind - chunk;
         assert(memcmp(expected, buffer, chunk) == 0);
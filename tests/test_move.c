@@ -2,7 +2,6 @@
 
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 
@@ -20,6 +19,7 @@ static void setup(void) {
 }
 
 static void reload(void) {
+    mimic_fat_flush();
     lfs_unmount(&fs);
     int err = lfs_mount(&fs, &lfs_pico_flash_config);
     assert(err == 0);
@@ -40,7 +40,7 @@ static void test_move_file(void) {
     uint32_t root_dir_sector = fat_sectors + 1;
 
     // Update procedure from the USB layer
-    uint8_t buffer[512];
+    uint8_t buffer[512] = {0};
 
     // update the origin dir entry. Attach deletion flag to filename.
     fat_dir_entry_t root0[16] = {
@@ -49,14 +49,14 @@ static void test_move_file(void) {
         {.DIR_Name = "MOVEME  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = strlen(MESSAGE)},
     };
     root0[2].DIR_Name[0] = 0xE5;  // deletion flag
-    tud_msc_write10_cb(0, root_dir_sector, 0, root0, sizeof(root0));  // update origin directory entry
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));  // update origin directory entry
 
     fat_dir_entry_t dir_a[16] = {
         {.DIR_Name = ".          ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
         {.DIR_Name = "..         ", .DIR_Attr = 0x10, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "MOVEME  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = strlen(MESSAGE)},
     };
-    tud_msc_write10_cb(0, fat_sectors + 2, 0, dir_a, sizeof(dir_a));  // update destination directory entry
+    msc_write10(0, fat_sectors + 2, 0, dir_a, sizeof(dir_a));  // update destination directory entry
 
     reload();
 
@@ -76,10 +76,136 @@ static void test_move_file(void) {
     cleanup();
 }
 
+static int find_entry(fat_dir_entry_t *entry, const char *name) {
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(entry[i].DIR_Name, name, 11) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void test_move_directory(void) {
+    setup();
+    create_directory(&fs, "DIR_B");
+    create_file(&fs, "DIR_B/FILE.TXT", MESSAGE);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    uint8_t buffer[512] = {0};
+    fat_dir_entry_t root[16];
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    int dir_a = find_entry(root, "DIR_A      ");
+    int dir_b = find_entry(root, "DIR_B      ");
+    assert(dir_a >= 0 && dir_b >= 0);
+    uint16_t dir_a_cluster = root[dir_a].DIR_FstClusLO;
+    uint16_t dir_b_cluster = root[dir_b].DIR_FstClusLO;
+
+    // update the origin dir entry. Attach deletion flag to the directory name.
+    fat_dir_entry_t moved = root[dir_b];
+    root[dir_b].DIR_Name[0] = 0xE5;
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));
+
+    // add the directory to the destination directory entry. Clusters have the same.
+    fat_dir_entry_t dest[16];
+    msc_read10(0, fat_sectors + dir_a_cluster, 0, dest, sizeof(dest));
+    int i = find_entry(dest, "\0\0\0\0\0\0\0\0\0\0\0");
+    assert(i >= 2);
+    dest[i] = moved;
+    msc_write10(0, fat_sectors + dir_a_cluster, 0, dest, sizeof(dest));
+
+    reload();
+
+    // Test reflection on the littlefs layer
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "DIR_A/DIR_B/FILE.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == strlen(MESSAGE));
+    assert(strcmp((const char *)buffer, MESSAGE) == 0);
+    lfs_file_close(&fs, &f);
+
+    struct lfs_info finfo;
+    err = lfs_stat(&fs, "DIR_B", &finfo);
+    assert(err ==  LFS_ERR_NOENT);
+
+    // The moved directory refers to its new parent
+    fat_dir_entry_t moved_dir[16];
+    msc_read10(0, fat_sectors + dir_b_cluster, 0, moved_dir, sizeof(moved_dir));
+    assert(memcmp(moved_dir[1].DIR_Name, "..         ", 11) == 0);
+    assert(moved_dir[1].DIR_FstClusLO == dir_a_cluster);
+
+    cleanup();
+}
+
+static void test_move_reused_cluster(void) {
+    setup();
+    char content[512 * 3 + 1];
+    memset(content, 'B', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_file(&fs, "BIG.TXT", content);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    uint8_t buffer[512] = {0};
+    fat_dir_entry_t root[16];
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    int big = find_entry(root, "BIG     TXT");
+    int moveme = find_entry(root, "MOVEME  TXT");
+    assert(big >= 0 && moveme >= 0);
+    uint16_t cluster = root[big].DIR_FstClusLO;
+
+    // The host deletes the file; reading another file applies the deletion
+    root[big].DIR_Name[0] = 0xE5;
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));
+    msc_read10(0, fat_sectors + root[moveme].DIR_FstClusLO, 0, buffer, sizeof(buffer));
+
+    // The host reuses the second cluster of the chain before freeing it in the FAT
+    memset(buffer, 'N', sizeof(buffer));
+    msc_write10(0, fat_sectors + cluster + 1, 0, buffer, sizeof(buffer));
+    mimic_fat_lock();  // removes the parked entries
+    mimic_fat_unlock();
+
+    msc_read10(0, 1, 0, buffer, sizeof(buffer));
+    update_fat(buffer, cluster, 0);
+    update_fat(buffer, cluster + 1, 0xFFF);
+    update_fat(buffer, cluster + 2, 0);
+    msc_write10(0, 1, 0, buffer, sizeof(buffer));
+    root[big] = (fat_dir_entry_t){.DIR_Name = "NEW     TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster + 1, .DIR_FileSize = 512};
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));
+
+    reload();
+
+    // The new file keeps the contents written by the host
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "NEW.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == 512);
+    for (int i = 0; i < 512; i++)
+        assert(buffer[i] == 'N');
+    lfs_file_close(&fs, &f);
+
+    struct lfs_info finfo;
+    err = lfs_stat(&fs, "BIG.TXT", &finfo);
+    assert(err ==  LFS_ERR_NOENT);
+
+    cleanup();
+}
+
 void test_move(void) {
     printf("move   .................");
 
     test_move_file();
+    test_move_directory();
+    test_move_reused_cluster();
 
     printf("ok\n");
 }
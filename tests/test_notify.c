@@ -0,0 +1,485 @@
+#include "tests.h"
+#include "usb_msc_driver.h"
+
+
+extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
+extern bool tud_msc_test_unit_ready_cb(uint8_t lun);
+
+
+/*
+ * The files are written through the littlefs instance shared with the mimic, as
+ * the firmware does
+ */
+static void setup(void) {
+    int err = mimic_fat_init(&lfs_pico_flash_config);
+    (void)err;  // not formatted yet
+    mimic_fat_lock();
+    err = mimic_fat_format();
+    assert(err == 0);
+    mimic_fat_unlock();
+}
+
+static void cleanup(void) {
+    mimic_fat_update_usb_device_is_enabled(false);
+}
+
+static void create_cache(void) {
+    mimic_fat_create_cache();
+    mimic_fat_update_usb_device_is_enabled(true);
+    (void)mimic_fat_medium_changed();
+}
+
+static void write_file(const char *path, const char *content) {
+    create_file(mimic_fat_lock(), path, content);
+    mimic_fat_unlock();
+}
+
+static void append_file(const char *path, const char *content) {
+    lfs_t *fs = mimic_fat_lock();
+    lfs_file_t f;
+    int err = lfs_file_open(fs, &f, path, LFS_O_RDWR|LFS_O_APPEND|LFS_O_CREAT);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_write(fs, &f, content, strlen(content));
+    assert(size == (lfs_ssize_t)strlen(content));
+    lfs_file_close(fs, &f);
+    mimic_fat_unlock();
+}
+
+static void truncate_file(const char *path, lfs_off_t size) {
+    lfs_t *fs = mimic_fat_lock();
+    lfs_file_t f;
+    int err = lfs_file_open(fs, &f, path, LFS_O_RDWR);
+    assert(err == LFS_ERR_OK);
+    err = lfs_file_truncate(fs, &f, size);
+    assert(err == LFS_ERR_OK);
+    lfs_file_close(fs, &f);
+    mimic_fat_unlock();
+}
+
+static fat_dir_entry_t *find_entry(fat_dir_entry_t *dir, const char *name) {
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(dir[i].DIR_Name, name, 11) == 0)
+            return &dir[i];
+    }
+    return NULL;
+}
+
+static uint16_t read_fat12(const uint8_t *fat, uint32_t cluster) {
+    uint32_t offset = cluster * 3 / 2;
+    uint16_t value = fat[offset] | (fat[offset + 1] << 8);
+    return (cluster & 0x01) ? value >> 4 : value & 0xFFF;
+}
+
+/*
+ * Follow the chain of entry and compare its clusters with content
+ */
+static size_t assert_cluster_chain(const uint8_t *fat, fat_dir_entry_t *entry, const char *content) {
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint8_t buffer[512];
+    size_t size = strlen(content);
+    size_t num = 0;
+
+    assert(entry->DIR_FileSize == size);
+    uint16_t cluster = entry->DIR_FstClusLO;
+    for (size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+        assert(cluster >= 2 && cluster < 0xFF8);
+        msc_read10(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));
+        size_t length = size - offset < sizeof(buffer) ? size - offset : sizeof(buffer);
+        assert(memcmp(buffer, content + offset, length) == 0);
+        cluster = read_fat12(fat, cluster);
+        num++;
+    }
+    assert(size == 0 ? entry->DIR_FstClusLO == 0 : cluster == 0xFFF);
+    return num;
+}
+
+static void test_notify_append(void) {
+    static char content[512 + 100 + 1];
+    uint8_t fat[512];
+    fat_dir_entry_t root[16];
+
+    setup();
+
+    memset(content, 'A', 100);
+    content[100] = '\0';
+    write_file("LOG.TXT", content);
+    create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    uint16_t first = find_entry(root, "LOG     TXT")->DIR_FstClusLO;
+
+    memset(content + 100, 'B', 512);
+    content[100 + 512] = '\0';
+    append_file("LOG.TXT", content + 100);
+    mimic_fat_notify_changed("LOG.TXT");
+
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    fat_dir_entry_t *entry = find_entry(root, "LOG     TXT");
+    assert(entry != NULL);
+    assert(entry->DIR_FstClusLO == first);
+    assert(assert_cluster_chain(fat, entry, content) == 2);
+    assert(read_fat12(fat, first) == first + 1);  // grown into the following free cluster
+
+    cleanup();
+}
+
+static void test_notify_append_relocate(void) {
+    static char content[512 * 4 + 1];
+    uint8_t fat[512];
+    fat_dir_entry_t root[16];
+
+    setup();
+
+    write_file("A.TXT", "a\n");
+    write_file("B.TXT", "b\n");
+    create_cache();
+
+    memset(content, 'A', sizeof(content) - 1);
+    content[0] = 'a';
+    content[1] = '\n';
+    content[sizeof(content) - 1] = '\0';
+    append_file("A.TXT", content + 2);
+    mimic_fat_notify_changed("/A.TXT");
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    fat_dir_entry_t *a = find_entry(root, "A       TXT");
+    fat_dir_entry_t *b = find_entry(root, "B       TXT");
+    assert(a != NULL && b != NULL);
+    assert(assert_cluster_chain(fat, a, content) == 4);
+    assert(assert_cluster_chain(fat, b, "b\n") == 1);
+
+    // The chain of A.TXT goes around B.TXT
+    for (uint16_t cluster = a->DIR_FstClusLO; cluster < 0xFF8; cluster = read_fat12(fat, cluster))
+        assert(cluster != b->DIR_FstClusLO);
+
+    cleanup();
+}
+
+static void test_notify_create(void) {
+    uint8_t fat[512];
+    fat_dir_entry_t root[16];
+    fat_dir_entry_t dir1[16];
+
+    setup();
+
+    write_file("README.TXT", "Hello World!\n");
+    create_directory(mimic_fat_lock(), "DIR1");
+    mimic_fat_unlock();
+    create_cache();
+
+    write_file("NEW.TXT", "created by the firmware\n");
+    mimic_fat_notify_changed("NEW.TXT");
+    write_file("DIR1/SUB.TXT", "directory 1\n");
+    mimic_fat_notify_changed("DIR1/SUB.TXT");
+    write_file("Long filename.txt", "long\n");
+    mimic_fat_notify_changed("Long filename.txt");
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    assert(assert_cluster_chain(fat, find_entry(root, "README  TXT"), "Hello World!\n") == 1);
+    assert(assert_cluster_chain(fat, find_entry(root, "NEW     TXT"), "created by the firmware\n") == 1);
+
+    fat_dir_entry_t *entry = find_entry(root, "DIR1       ");
+    assert(entry != NULL);
+    msc_read10(0, fat_sectors + entry->DIR_FstClusLO, 0, dir1, sizeof(dir1));
+    assert(assert_cluster_chain(fat, find_entry(dir1, "SUB     TXT"), "directory 1\n") == 1);
+
+    // A long filename is preceded by its long filename entries
+    int index = -1;
+    for (int i = 1; i < 16; i++) {
+        if ((root[i].DIR_Attr & 0x0F) != 0x0F && (root[i - 1].DIR_Attr & 0x0F) == 0x0F)
+            index = i;
+    }
+    assert(index >= 2);
+    assert(assert_cluster_chain(fat, &root[index], "long\n") == 1);
+
+    cleanup();
+}
+
+static void test_notify_remove(void) {
+    static char content[512 * 3 + 1];
+    uint8_t fat[512];
+    fat_dir_entry_t root[16];
+
+    setup();
+
+    memset(content, 'R', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    write_file("REMOVE.TXT", content);
+    write_file("KEEP.TXT", "keep\n");
+    create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    uint16_t first = find_entry(root, "REMOVE  TXT")->DIR_FstClusLO;
+
+    int err = lfs_remove(mimic_fat_lock(), "REMOVE.TXT");
+    assert(err == LFS_ERR_OK);
+    mimic_fat_unlock();
+    mimic_fat_notify_changed("REMOVE.TXT");
+
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    assert(find_entry(root, "REMOVE  TXT") == NULL);
+    for (uint16_t cluster = first; cluster < first + 3; cluster++)
+        assert(read_fat12(fat, cluster) == 0x000);
+    assert(assert_cluster_chain(fat, find_entry(root, "KEEP    TXT"), "keep\n") == 1);
+
+    cleanup();
+}
+
+static void test_notify_truncate(void) {
+    static char content[512 * 3 + 1];
+    uint8_t fat[512];
+    fat_dir_entry_t root[16];
+
+    setup();
+
+    memset(content, 'T', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    write_file("TRUNC.TXT", content);
+    create_cache();
+
+    truncate_file("TRUNC.TXT", 10);
+    mimic_fat_notify_changed("TRUNC.TXT");
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    fat_dir_entry_t *entry = find_entry(root, "TRUNC   TXT");
+    content[10] = '\0';
+    assert(assert_cluster_chain(fat, entry, content) == 1);
+    assert(read_fat12(fat, entry->DIR_FstClusLO + 1) == 0x000);
+    assert(read_fat12(fat, entry->DIR_FstClusLO + 2) == 0x000);
+
+    truncate_file("TRUNC.TXT", 0);
+    mimic_fat_notify_changed("TRUNC.TXT");
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    assert(assert_cluster_chain(fat, find_entry(root, "TRUNC   TXT"), "") == 0);
+
+    cleanup();
+}
+
+static void test_notify_growing_file(void) {
+    static char content[512 * (MIMIC_FAT_GROWING_FILE_RESERVE + 2) + 1];
+    uint8_t fat[512];
+    uint8_t before_fat[512];
+    fat_dir_entry_t root[16];
+    fat_dir_entry_t before_root[16];
+
+    setup();
+
+    memset(content, 'G', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    char saved = content[100];
+    content[100] = '\0';
+    write_file("GROW.TXT", content);
+    write_file("OTHER.TXT", "other\n");
+    assert(mimic_fat_set_growing_file("/GROW.TXT"));
+    create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, 1, 0, before_fat, sizeof(before_fat));
+    msc_read10(0, fat_sectors + 1, 0, before_root, sizeof(before_root));
+    fat_dir_entry_t *entry = find_entry(before_root, "GROW    TXT");
+    uint16_t first = entry->DIR_FstClusLO;
+
+    // Clusters are reserved past the end of the file
+    uint16_t cluster = first;
+    for (size_t i = 0; i < 1 + MIMIC_FAT_GROWING_FILE_RESERVE - 1; i++) {
+        assert(read_fat12(before_fat, cluster) == cluster + 1);
+        cluster++;
+    }
+    assert(read_fat12(before_fat, cluster) == 0xFFF);
+    assert(find_entry(before_root, "OTHER   TXT")->DIR_FstClusLO > cluster);
+
+    // Appending changes only the size in the directory entry
+    content[100] = saved;
+    saved = content[100 + 1000];
+    content[100 + 1000] = '\0';
+    append_file("GROW.TXT", content + 100);
+    mimic_fat_notify_changed("GROW.TXT");
+
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    assert(memcmp(fat, before_fat, sizeof(fat)) == 0);
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    entry = find_entry(root, "GROW    TXT");
+    assert(entry->DIR_FileSize == 100 + 1000);
+    entry->DIR_FileSize = find_entry(before_root, "GROW    TXT")->DIR_FileSize;
+    assert(memcmp(root, before_root, sizeof(root)) == 0);
+
+    uint8_t buffer[512 * 3];
+    msc_read10(0, fat_sectors + first, 0, buffer, sizeof(buffer));
+    assert(memcmp(buffer, content, 100 + 1000) == 0);
+    for (size_t i = 100 + 1000; i < sizeof(buffer); i++)
+        assert(buffer[i] == 0);
+
+    // Past the reserved clusters the chain is extended with a new reserve
+    content[100 + 1000] = saved;
+    append_file("GROW.TXT", content + 100 + 1000);
+    mimic_fat_notify_changed("GROW.TXT");
+
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    entry = find_entry(root, "GROW    TXT");
+    assert(entry->DIR_FstClusLO == first);
+    assert(entry->DIR_FileSize == strlen(content));
+    size_t num = 0;
+    for (cluster = first; cluster < 0xFF8; cluster = read_fat12(fat, cluster))
+        num++;
+    assert(num == MIMIC_FAT_GROWING_FILE_RESERVE + 2 + MIMIC_FAT_GROWING_FILE_RESERVE);
+    assert(assert_cluster_chain(fat, find_entry(root, "OTHER   TXT"), "other\n") == 1);
+
+    cleanup();
+}
+
+static size_t chain_length(const uint8_t *fat, uint16_t cluster) {
+    size_t num = 0;
+    for (; cluster >= 2 && cluster < 0xFF8; cluster = read_fat12(fat, cluster))
+        num++;
+    return num;
+}
+
+static void test_notify_growing_file_trim(void) {
+    static char content[512 * 3 + 1];
+    uint8_t fat[512];
+    fat_dir_entry_t root[16];
+
+    setup();
+
+    memset(content, 'T', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    char saved = content[100];
+    content[100] = '\0';
+    write_file("GROW.TXT", content);
+    write_file("OTHER.TXT", "other\n");
+    assert(mimic_fat_set_growing_file("GROW.TXT"));
+    create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    uint16_t first = find_entry(root, "GROW    TXT")->DIR_FstClusLO;
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    assert(chain_length(fat, first) == 1 + MIMIC_FAT_GROWING_FILE_RESERVE);
+
+    // The reserve is given back once the file stops growing
+    uint64_t start_at = time_us_64();
+    while (time_us_64() - start_at < MIMIC_FAT_GROWING_FILE_IDLE_US)
+        mimic_fat_task();
+    mimic_fat_task();
+    assert(mimic_fat_medium_changed());
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    assert(assert_cluster_chain(fat, find_entry(root, "GROW    TXT"), content) == 1);
+    assert(assert_cluster_chain(fat, find_entry(root, "OTHER   TXT"), "other\n") == 1);
+
+    // and laid out again when it grows
+    content[100] = saved;
+    append_file("GROW.TXT", content + 100);
+    mimic_fat_notify_changed("GROW.TXT");
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    fat_dir_entry_t *entry = find_entry(root, "GROW    TXT");
+    assert(entry->DIR_FileSize == strlen(content));
+    assert(chain_length(fat, entry->DIR_FstClusLO) == 3 + MIMIC_FAT_GROWING_FILE_RESERVE);
+
+    // Closing the file trims the chain to its size at once
+    (void)mimic_fat_medium_changed();
+    assert(mimic_fat_close_growing_file("/GROW.TXT"));
+    assert(mimic_fat_medium_changed());
+    msc_read10(0, 1, 0, fat, sizeof(fat));
+    msc_read10(0, fat_sectors + 1, 0, root, sizeof(root));
+    assert(assert_cluster_chain(fat, find_entry(root, "GROW    TXT"), content) == 3);
+    assert(!mimic_fat_close_growing_file("GROW.TXT"));
+
+    cleanup();
+}
+
+static void test_notify_unit_attention(void) {
+    setup();
+
+    write_file("README.TXT", "Hello World!\n");
+    create_cache();
+    assert(tud_msc_test_unit_ready_cb(0));
+
+    append_file("README.TXT", "again\n");
+    mimic_fat_notify_changed("README.TXT");
+    assert(!tud_msc_test_unit_ready_cb(0));  // medium may have changed
+    assert(tud_msc_test_unit_ready_cb(0));
+
+    // A format rebuilds the whole image
+    mimic_fat_lock();
+    int err = mimic_fat_format();
+    assert(err == 0);
+    mimic_fat_unlock();
+    mimic_fat_notify_changed(NULL);
+    assert(!tud_msc_test_unit_ready_cb(0));
+    assert(tud_msc_test_unit_ready_cb(0));
+
+    fat_dir_entry_t root[16];
+    msc_read10(0, fat_sector_size(&lfs_pico_flash_config) + 1, 0, root, sizeof(root));
+    assert(find_entry(root, "README  TXT") == NULL);
+
+    cleanup();
+}
+
+static void test_notify_lock(void) {
+    fat_dir_entry_t root[16];
+
+    setup();
+
+    write_file("README.TXT", "Hello World!\n");
+    create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+    uint8_t buffer[512] = "locked\n";
+    uint16_t cluster = 10;
+    msc_write10(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));
+    msc_read10(0, 1, 0, buffer, sizeof(buffer));
+    update_fat(buffer, cluster, 0xFFF);
+    msc_write10(0, 1, 0, buffer, sizeof(buffer));
+
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    root[2] = (fat_dir_entry_t){.DIR_Name = "LOCK    TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen("locked\n")};
+
+    // Host writes wait while the application holds littlefs
+    lfs_t *fs = mimic_fat_lock();
+    assert(fs == mimic_fat_filesystem());
+    int32_t length = tud_msc_write10_cb(0, root_dir_sector, 0, (uint8_t *)root, sizeof(root));
+    assert(length == sizeof(root));
+    usb_msc_driver_task();
+    mimic_fat_task();
+    assert(!usb_msc_driver_is_idle());
+    mimic_fat_unlock();
+
+    while (!usb_msc_driver_is_idle())
+        usb_msc_driver_task();
+    mimic_fat_flush();
+    struct lfs_info finfo;
+    assert(lfs_stat(mimic_fat_filesystem(), "LOCK.TXT", &finfo) == LFS_ERR_OK);
+    assert(finfo.size == strlen("locked\n"));
+
+    cleanup();
+}
+
+void test_notify(void) {
+    printf("notify .................");
+
+    test_notify_append();
+    test_notify_append_relocate();
+    test_notify_create();
+    test_notify_remove();
+    test_notify_truncate();
+    test_notify_growing_file();
+    test_notify_growing_file_trim();
+    test_notify_unit_attention();
+    test_notify_lock();
+
+    printf("ok\n");
+}
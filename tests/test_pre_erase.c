@@ -0,0 +1,110 @@
+#include "tests.h"
+#include "littlefs_driver.h"
+
+
+static lfs_t fs;
+static uint8_t buffer[2048];
+
+
+static void setup(void) {
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+}
+
+static void cleanup(void) {
+    lfs_unmount(&fs);
+}
+
+static void write_file(const char *path, uint8_t value) {
+    lfs_file_t f;
+    memset(buffer, value, sizeof(buffer));  // larger than an inline file
+    int err = lfs_file_open(&fs, &f, path, LFS_O_WRONLY | LFS_O_CREAT);
+    assert(err == 0);
+    lfs_ssize_t size = lfs_file_write(&fs, &f, buffer, sizeof(buffer));
+    assert(size == sizeof(buffer));
+    lfs_file_close(&fs, &f);
+}
+
+static void verify_file(const char *path, uint8_t value) {
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, path, LFS_O_RDONLY);
+    assert(err == 0);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == sizeof(buffer));
+    lfs_file_close(&fs, &f);
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        assert(buffer[i] == value);
+}
+
+static void test_pre_erase_hit(void) {
+    littlefs_erase_stats_t before, after;
+
+    setup();
+
+    write_file("FIRST.BIN", 0x11);  // moves the allocator next to its blocks
+
+    sleep_ms(600);
+    for (int i = 0; i < PRE_ERASE_POOL_SIZE; i++)
+        littlefs_pre_erase_task(&fs);
+
+    littlefs_erase_stats(&before);
+    write_file("SECOND.BIN", 0x22);
+    littlefs_erase_stats(&after);
+    assert(after.hits > before.hits);
+    assert(after.hidden_us > before.hidden_us);
+
+    verify_file("FIRST.BIN", 0x11);
+    verify_file("SECOND.BIN", 0x22);
+
+    cleanup();
+}
+
+static void test_pre_erase_busy(void) {
+    littlefs_erase_stats_t before, after;
+
+    setup();
+
+    write_file("FIRST.BIN", 0x11);
+    littlefs_pre_erase_task(&fs);  // flash was just accessed
+
+    littlefs_erase_stats(&before);
+    write_file("SECOND.BIN", 0x22);
+    littlefs_erase_stats(&after);
+    assert(after.hits == before.hits);
+    assert(after.misses > before.misses);
+
+    verify_file("SECOND.BIN", 0x22);
+
+    cleanup();
+}
+
+static void test_bulk_erase(void) {
+    littlefs_erase_stats_t before, after;
+
+    littlefs_bulk_erase(0, lfs_pico_flash_config.block_count);
+
+    littlefs_erase_stats(&before);
+    setup();
+    write_file("FIRST.BIN", 0x11);
+    write_file("SECOND.BIN", 0x22);
+    littlefs_erase_stats(&after);
+    assert(after.hits > before.hits);
+    assert(after.misses == before.misses);
+
+    verify_file("FIRST.BIN", 0x11);
+    verify_file("SECOND.BIN", 0x22);
+
+    cleanup();
+}
+
+void test_pre_erase(void) {
+    printf("pre_erase ..............");
+
+    test_pre_erase_busy();
+    test_pre_erase_hit();
+    test_bulk_erase();
+
+    printf("ok\n");
+}
@@ -2,7 +2,6 @@
 
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 
@@ -33,19 +32,19 @@ static void test_read_file(void) {
     uint32_t root_dir_sector = fat_sectors + 1;
     uint32_t cluster = 2;
 
-    tud_msc_read10_cb(0, 0, 0, buffer, sizeof(buffer));  // Boot sector
-    tud_msc_read10_cb(0, 1, 0, buffer, sizeof(buffer));  // Allocation table
+    msc_read10(0, 0, 0, buffer, sizeof(buffer));  // Boot sector
+    msc_read10(0, 1, 0, buffer, sizeof(buffer));  // Allocation table
     uint8_t expected_allocation_table[512] = {0xf8, 0xff, 0xff, 0xff, 0x0f, 0x00};
     assert(memcmp(buffer, expected_allocation_table, 6) == 0);
 
-    tud_msc_read10_cb(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
+    msc_read10(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
     fat_dir_entry_t root[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "READ    TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen("Hello World!\n")},
     };
     assert(dirent_cmp((fat_dir_entry_t *)buffer, root) == 0);
 
-    tud_msc_read10_cb(0, cluster + fat_sectors, 0, buffer, sizeof(buffer));  // TEST.TXT
+    msc_read10(0, cluster + fat_sectors, 0, buffer, sizeof(buffer));  // TEST.TXT
     assert(strcmp(buffer, "Hello World!\n") == 0);
 
     cleanup();
@@ -66,19 +65,19 @@ static void test_sub_directory(void) {
     uint32_t first_fat_sector = 1;
     uint32_t root_dir_sector = fat_sectors + 1;
 
-    tud_msc_read10_cb(0, 0, 0, buffer, sizeof(buffer));  // Boot sector
-    tud_msc_read10_cb(0, 1, 0, buffer, sizeof(buffer));  // Allocation table
+    msc_read10(0, 0, 0, buffer, sizeof(buffer));  // Boot sector
+    msc_read10(0, 1, 0, buffer, sizeof(buffer));  // Allocation table
     uint8_t expected_allocation_table[512] = {0xf8, 0xff, 0xff, 0xff, 0xff, 0xFF, 0x00};
     assert(memcmp(buffer, expected_allocation_table, 7) == 0);
 
-    tud_msc_read10_cb(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
+    msc_read10(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
     fat_dir_entry_t root[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "DIR1       ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
     };
     assert(dirent_cmp((fat_dir_entry_t *)buffer, root) == 0);
 
-    tud_msc_read10_cb(0, fat_sectors + 2, 0, buffer, sizeof(buffer));  // DIR1 directory entry
+    msc_read10(0, fat_sectors + 2, 0, buffer, sizeof(buffer));  // DIR1 directory entry
     fat_dir_entry_t dir1[16] = {
         {.DIR_Name = ".          ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
         {.DIR_Name = "..         ", .DIR_Attr = 0x10, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
@@ -86,7 +85,7 @@ static void test_sub_directory(void) {
     };
     assert(dirent_cmp((fat_dir_entry_t *)buffer, dir1) == 0);
 
-    tud_msc_read10_cb(0, fat_sectors + 3, 0, buffer, sizeof(buffer));  // DIR1/SUB.TXT
+    msc_read10(0, fat_sectors + 3, 0, buffer, sizeof(buffer));  // DIR1/SUB.TXT
     assert(strcmp(buffer, "directory 1\n") == 0);
 
     cleanup();
@@ -106,7 +105,7 @@ static void test_long_filename(void) {
     uint32_t first_fat_sector = 1;
     uint32_t root_dir_sector = fat_sectors + 1;
 
-    tud_msc_read10_cb(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
+    msc_read10(0, root_dir_sector, 0, buffer, sizeof(buffer));  // Root directory entry
 
     fat_dir_entry_t root[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
@@ -121,12 +120,145 @@ static void test_long_filename(void) {
     cleanup();
 }
 
+static void test_unallocated_sector(void) {
+    uint8_t buffer[512];
+    uint8_t zero[512] = {0};
+
+    setup();
+
+    create_file(&fs, "TAIL.TXT", "tail\n");
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    msc_read10(0, fat_sectors + 3, 0, buffer, sizeof(buffer));  // Free cluster
+    assert(memcmp(buffer, zero, sizeof(buffer)) == 0);
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    msc_read10(0, mimic_fat_total_sector_size(), 0, buffer, sizeof(buffer));  // Out of range
+    assert(memcmp(buffer, zero, sizeof(buffer)) == 0);
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    msc_read10(0, fat_sectors + 2, 0, buffer, sizeof(buffer));  // TAIL.TXT
+    assert(memcmp(buffer, "tail\n", 5) == 0);
+    assert(memcmp(buffer + 5, zero, sizeof(buffer) - 5) == 0);
+
+    cleanup();
+}
+
+static void test_multi_sector_read(void) {
+    static uint8_t buffer[512 * 32];
+    static uint8_t sector[512];
+    static char content[512 * 3 + 100];
+
+    setup();
+
+    memset(content, 'L', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_file(&fs, "A.TXT", "Hello World!\n");
+    create_file(&fs, "LONG.TXT", content);
+    create_directory(&fs, "DIR1");
+    create_file(&fs, "DIR1/SUB.TXT", "directory 1\n");
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    // Boot sector, FAT, root directory, files, a directory and free space in one read
+    uint32_t sectors = fat_sector_size(&lfs_pico_flash_config) + 10;
+    assert(sectors <= sizeof(buffer) / sizeof(sector));
+    mimic_fat_read(0, 0, buffer, sectors * sizeof(sector));
+    for (uint32_t i = 0; i < sectors; i++) {
+        mimic_fat_read(0, i, sector, sizeof(sector));
+        assert(memcmp(&buffer[i * sizeof(sector)], sector, sizeof(sector)) == 0);
+    }
+
+    cleanup();
+}
+
+static uint8_t multi_block_pattern(uint32_t offset) {
+    return (uint8_t)(offset ^ (offset >> 8) ^ (offset >> 16));
+}
+
+static void test_multi_block_file(void) {
+    static uint8_t buffer[512 * 3];
+    const uint32_t file_size = 17 * 4096 + 300;  // CTZ blocks with up to five pointers
+
+    setup();
+
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "BLOCKS.BIN", LFS_O_RDWR|LFS_O_CREAT);
+    assert(err == LFS_ERR_OK);
+    for (uint32_t offset = 0; offset < file_size; offset += sizeof(buffer)) {
+        uint32_t size = file_size - offset < sizeof(buffer) ? file_size - offset : sizeof(buffer);
+        for (uint32_t i = 0; i < size; i++)
+            buffer[i] = multi_block_pattern(offset + i);
+        assert(lfs_file_write(&fs, &f, buffer, size) == (lfs_ssize_t)size);
+    }
+    lfs_file_close(&fs, &f);
+    create_file(&fs, "OTHER.TXT", "other file\n");
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    fat_dir_entry_t root[16];
+    mimic_fat_read(0, fat_sectors + 1, root, sizeof(root));
+    uint16_t cluster = 0;
+    uint16_t other_cluster = 0;
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(root[i].DIR_Name, "BLOCKS  BIN", 11) == 0)
+            cluster = root[i].DIR_FstClusLO;
+        if (memcmp(root[i].DIR_Name, "OTHER   TXT", 11) == 0)
+            other_cluster = root[i].DIR_FstClusLO;
+    }
+    assert(cluster != 0 && other_cluster != 0);
+
+    // Forward and backward at many offsets, single and multi-sector runs across blocks,
+    // with writes to another file in between
+    uint32_t sectors = (file_size + 511) / 512;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t n = 0; n < sectors; n++) {
+            uint32_t k = pass == 0 ? (n * 5) % sectors : sectors - 1 - (n * 3) % sectors;
+            uint32_t count = (k % 3) + 1;
+            if (k + count > sectors)
+                count = sectors - k;
+            mimic_fat_read(0, fat_sectors + cluster + k, buffer, count * 512);
+            for (uint32_t i = 0; i < count * 512; i++) {
+                uint32_t offset = k * 512 + i;
+                assert(buffer[i] == (offset < file_size ? multi_block_pattern(offset) : 0));
+            }
+            if (n % 16 == 0) {
+                uint8_t sector[512] = {0};
+                snprintf((char *)sector, sizeof(sector), "other file %lu\n", (unsigned long)n);
+                mimic_fat_write(0, fat_sectors + other_cluster, sector, sizeof(sector));
+            }
+        }
+    }
+
+    // The map follows a write to the mapped file
+    memset(buffer, 'W', 512);
+    mimic_fat_write(0, fat_sectors + cluster + 20, buffer, 512);
+    mimic_fat_read(0, fat_sectors + cluster + 19, buffer, sizeof(buffer));
+    for (uint32_t i = 0; i < sizeof(buffer); i++) {
+        uint32_t offset = 19 * 512 + i;
+        assert(buffer[i] == (i / 512 == 1 ? 'W' : multi_block_pattern(offset)));
+    }
+
+    cleanup();
+}
+
 void test_read(void) {
     printf("read ...................");
 
     test_read_file();
     test_sub_directory();
     test_long_filename();
+    test_multi_sector_read();
+    test_unallocated_sector();
+    test_multi_block_file();
 
     printf("ok\n");
 }
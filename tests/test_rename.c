@@ -2,12 +2,11 @@
 
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
-extern int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 
 #define MESSAGE  "please rename!\n"
+#define OTHER_MESSAGE  "please swap!\n"
 
 
 static void setup(void) {
@@ -20,6 +19,7 @@ static void setup(void) {
 }
 
 static void reload(void) {
+    mimic_fat_flush();
     lfs_unmount(&fs);
     int err = lfs_mount(&fs, &lfs_pico_flash_config);
     assert(err == 0);
@@ -51,7 +51,7 @@ static void test_rename_file(void) {
         {.DIR_Name = "RENAMED TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = strlen(MESSAGE)},
     };
     root0[1].DIR_Name[0] = 0xE5;
-    tud_msc_write10_cb(0, root_dir_sector, 0, root0, sizeof(root0));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));  // update directory entry
 
     reload();
 
@@ -90,7 +90,7 @@ static void test_rename_file_windows11(void) {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "RENAMED TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = strlen(MESSAGE)},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root0, sizeof(root0));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));  // update directory entry
 
     reload();
 
@@ -110,11 +110,104 @@ static void test_rename_file_windows11(void) {
     cleanup();
 }
 
+static void test_rename_directory(void) {
+    setup();
+    create_directory(&fs, "DIR");
+    create_file(&fs, "DIR/FILE.TXT", MESSAGE);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    // Rename the directory entry in place; the directory keeps its cluster
+    uint8_t buffer[512] = {0};
+    fat_dir_entry_t root[16];
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    bool is_found = false;
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(root[i].DIR_Name, "DIR        ", 11) == 0) {
+            memcpy(root[i].DIR_Name, "RENAMED    ", 11);
+            is_found = true;
+        }
+    }
+    assert(is_found);
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
+
+    reload();
+
+    // Test reflection on the littlefs layer
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "RENAMED/FILE.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == strlen(MESSAGE));
+    assert(strcmp((const char *)buffer, MESSAGE) == 0);
+    lfs_file_close(&fs, &f);
+
+    struct lfs_info finfo;
+    err = lfs_stat(&fs, "DIR", &finfo);
+    assert(err ==  LFS_ERR_NOENT);
+
+    cleanup();
+}
+
+static void test_rename_swap(void) {
+    setup();
+    create_file(&fs, "OTHER.TXT", OTHER_MESSAGE);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    // Swap the names of the two files in place; each file keeps its cluster
+    uint8_t buffer[512] = {0};
+    fat_dir_entry_t root[16];
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    int original = -1;
+    int other = -1;
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(root[i].DIR_Name, "ORIGINALTXT", 11) == 0)
+            original = i;
+        if (memcmp(root[i].DIR_Name, "OTHER   TXT", 11) == 0)
+            other = i;
+    }
+    assert(original >= 0 && other >= 0);
+    memcpy(root[original].DIR_Name, "OTHER   TXT", 11);
+    memcpy(root[other].DIR_Name, "ORIGINALTXT", 11);
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));  // update directory entry
+
+    reload();
+
+    // Test reflection on the littlefs layer
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "OTHER.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == strlen(MESSAGE));
+    assert(memcmp(buffer, MESSAGE, size) == 0);
+    lfs_file_close(&fs, &f);
+
+    err = lfs_file_open(&fs, &f, "ORIGINAL.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == strlen(OTHER_MESSAGE));
+    assert(memcmp(buffer, OTHER_MESSAGE, size) == 0);
+    lfs_file_close(&fs, &f);
+
+    cleanup();
+}
+
 void test_rename(void) {
     printf("rename .................");
 
     test_rename_file();
     test_rename_file_windows11();
+    test_rename_directory();
+    test_rename_swap();
 
     printf("ok\n");
 }
@@ -0,0 +1,297 @@
+#include "tests.h"
+#include "snapshot_fat.h"
+#include "usb_msc_driver.h"
+
+
+extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
+extern bool tud_msc_is_writable_cb(uint8_t lun);
+extern bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
+
+static lfs_t *fs;
+
+
+static void setup(void) {
+    int err = mimic_fat_init(&lfs_pico_flash_config);
+    (void)err;  // not formatted yet
+    mimic_fat_lock();
+    err = mimic_fat_format();
+    assert(err == 0);
+    mimic_fat_unlock();
+    fs = mimic_fat_filesystem();
+}
+
+static void cleanup(void) {
+    snapshot_fat_release();
+}
+
+static void test_snapshot_read(void) {
+    static uint8_t buffer[512 * 3];
+    static char content[512 * 2 + 100];
+    struct lfs_info finfo;
+
+    setup();
+
+    memset(content, 'S', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_directory(fs, "DIR1");
+    create_file(fs, "DIR1/SUB.TXT", "directory 1\n");
+    create_file(fs, "LOG.TXT", content);
+    create_file(fs, "README.TXT", "Hello World!\n");
+
+    snapshot_fat_init(&lfs_pico_flash_config);
+    snapshot_fat_create();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, 0, 0, buffer, 512);  // Boot sector
+    assert(memcmp(&buffer[43], "SNAPSHOT   ", 11) == 0);
+    assert(buffer[510] == 0x55 && buffer[511] == 0xAA);
+
+    // DIR1, LOG.TXT and README.TXT are laid out first, then the entries of DIR1
+    msc_read10(USB_MSC_LUN_SNAPSHOT, 1, 0, buffer, 512);  // Allocation table
+    uint8_t expected_allocation_table[512] = {0xf8, 0xff, 0xff};
+    update_fat(expected_allocation_table, 2, 0xFFF);
+    update_fat(expected_allocation_table, 3, 4);
+    update_fat(expected_allocation_table, 4, 5);
+    update_fat(expected_allocation_table, 5, 0xFFF);
+    update_fat(expected_allocation_table, 6, 0xFFF);
+    update_fat(expected_allocation_table, 7, 0xFFF);
+    assert(memcmp(buffer, expected_allocation_table, sizeof(expected_allocation_table)) == 0);
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, root_dir_sector, 0, buffer, 512);  // Root directory entry
+    fat_dir_entry_t root[16] = {
+        {.DIR_Name = "SNAPSHOT   ", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "DIR1       ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+        {.DIR_Name = "LOG     TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = strlen(content)},
+        {.DIR_Name = "README  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 6, .DIR_FileSize = strlen("Hello World!\n")},
+    };
+    assert(dirent_cmp((fat_dir_entry_t *)buffer, root) == 0);
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 2, 0, buffer, 512);  // DIR1 directory entry
+    fat_dir_entry_t dir1[16] = {
+        {.DIR_Name = ".          ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+        {.DIR_Name = "..         ", .DIR_Attr = 0x10, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "SUB     TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 7, .DIR_FileSize = strlen("directory 1\n")},
+    };
+    assert(dirent_cmp((fat_dir_entry_t *)buffer, dir1) == 0);
+
+    // LOG.TXT in one transfer, zero filled past the end of the file
+    memset(buffer, 0xAA, sizeof(buffer));
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 3, 0, buffer, 512 * 3);
+    assert(memcmp(buffer, content, strlen(content)) == 0);
+    for (size_t i = strlen(content); i < sizeof(buffer); i++)
+        assert(buffer[i] == 0);
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 7, 0, buffer, 512);  // DIR1/SUB.TXT
+    assert(strcmp((const char *)buffer, "directory 1\n") == 0);
+
+    // Nothing is written to littlefs
+    assert(lfs_stat(fs, ".mimic", &finfo) == LFS_ERR_NOENT);
+
+    cleanup();
+}
+
+static void test_snapshot_is_frozen(void) {
+    uint8_t before[512];
+    uint8_t buffer[512];
+
+    setup();
+
+    create_file(fs, "README.TXT", "Hello World!\n");
+
+    snapshot_fat_init(&lfs_pico_flash_config);
+    snapshot_fat_create();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, root_dir_sector, 0, before, sizeof(before));
+    create_file(fs, "NEW.TXT", "created after the snapshot\n");
+    msc_read10(USB_MSC_LUN_SNAPSHOT, root_dir_sector, 0, buffer, sizeof(buffer));
+    assert(memcmp(before, buffer, sizeof(buffer)) == 0);
+
+    // Eject and load takes a new snapshot on the next read
+    tud_msc_start_stop_cb(USB_MSC_LUN_SNAPSHOT, 0, false, true);
+    assert(!snapshot_fat_is_created());
+    msc_read10(USB_MSC_LUN_SNAPSHOT, root_dir_sector, 0, buffer, sizeof(buffer));
+    assert(snapshot_fat_is_created());
+    fat_dir_entry_t root[16] = {
+        {.DIR_Name = "SNAPSHOT   ", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "NEW     TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 2, .DIR_FileSize = strlen("created after the snapshot\n")},
+        {.DIR_Name = "README  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 3, .DIR_FileSize = strlen("Hello World!\n")},
+    };
+    assert(dirent_cmp((fat_dir_entry_t *)buffer, root) == 0);
+
+    cleanup();
+}
+
+static void test_snapshot_is_read_only(void) {
+    uint8_t buffer[512];
+
+    setup();
+
+    create_file(fs, "README.TXT", "Hello World!\n");
+    snapshot_fat_init(&lfs_pico_flash_config);
+    snapshot_fat_create();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+
+    assert(tud_msc_is_writable_cb(USB_MSC_LUN_MIMIC));
+    assert(!tud_msc_is_writable_cb(USB_MSC_LUN_SNAPSHOT));
+
+    memset(buffer, 'X', sizeof(buffer));
+    assert(tud_msc_write10_cb(USB_MSC_LUN_SNAPSHOT, fat_sectors + 2, 0, buffer, sizeof(buffer)) < 0);
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 2, 0, buffer, sizeof(buffer));
+    assert(strcmp((const char *)buffer, "Hello World!\n") == 0);
+
+    cleanup();
+}
+
+static void test_snapshot_file_removed(void) {
+    uint8_t buffer[512];
+
+    setup();
+
+    create_file(fs, "README.TXT", "Hello World!\n");
+    snapshot_fat_init(&lfs_pico_flash_config);
+    snapshot_fat_create();
+    assert(!mimic_fat_is_locked());
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 2, 0, buffer, sizeof(buffer));
+    assert(strcmp((const char *)buffer, "Hello World!\n") == 0);
+    assert(!mimic_fat_is_locked());
+
+    // No file is kept open, a file removed after the snapshot reads as zeros
+    lfs_t *locked = mimic_fat_lock();
+    int err = lfs_remove(locked, "README.TXT");
+    assert(err == LFS_ERR_OK);
+    create_file(locked, "OTHER.TXT", "written over the blocks\n");
+    mimic_fat_unlock();
+
+    memset(buffer, 0xAA, sizeof(buffer));
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 2, 0, buffer, sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        assert(buffer[i] == 0);
+
+    cleanup();
+}
+
+static int find_entry(fat_dir_entry_t *entry, const char *name) {
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(entry[i].DIR_Name, name, 11) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void test_snapshot_keeps_pending_move(void) {
+    uint8_t buffer[512];
+
+    setup();
+
+    create_directory(fs, "DIR_A");
+    create_directory(fs, "DIR_B");
+    create_file(fs, "DIR_B/FILE.TXT", "please move!\n");
+    mimic_fat_create_cache();
+    snapshot_fat_init(&lfs_pico_flash_config);
+    snapshot_fat_create();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    fat_dir_entry_t root[16];
+    msc_read10(USB_MSC_LUN_MIMIC, root_dir_sector, 0, root, sizeof(root));
+    int dir_a = find_entry(root, "DIR_A      ");
+    int dir_b = find_entry(root, "DIR_B      ");
+    assert(dir_a >= 0 && dir_b >= 0);
+    uint16_t dir_a_cluster = root[dir_a].DIR_FstClusLO;
+
+    // The host moves DIR_B into DIR_A, and reads the snapshot between the two writes
+    fat_dir_entry_t moved = root[dir_b];
+    root[dir_b].DIR_Name[0] = 0xE5;
+    msc_write10(USB_MSC_LUN_MIMIC, root_dir_sector, 0, root, sizeof(root));
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, root_dir_sector, 0, buffer, sizeof(buffer));
+    for (uint32_t sector = fat_sectors + 2; sector < fat_sectors + 5; sector++)
+        msc_read10(USB_MSC_LUN_SNAPSHOT, sector, 0, buffer, sizeof(buffer));
+
+    fat_dir_entry_t dest[16];
+    msc_read10(USB_MSC_LUN_MIMIC, fat_sectors + dir_a_cluster, 0, dest, sizeof(dest));
+    int i = find_entry(dest, "\0\0\0\0\0\0\0\0\0\0\0");
+    assert(i >= 2);
+    dest[i] = moved;
+    msc_write10(USB_MSC_LUN_MIMIC, fat_sectors + dir_a_cluster, 0, dest, sizeof(dest));
+    mimic_fat_flush();
+
+    // The parked directory was not removed by the snapshot reads
+    lfs_file_t f;
+    int err = lfs_file_open(fs, &f, "DIR_A/DIR_B/FILE.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    memset(buffer, 0, sizeof(buffer));
+    lfs_ssize_t size = lfs_file_read(fs, &f, buffer, sizeof(buffer));
+    assert(size == strlen("please move!\n"));
+    assert(strcmp((const char *)buffer, "please move!\n") == 0);
+    lfs_file_close(fs, &f);
+
+    cleanup();
+}
+
+static uint16_t read_fat12(const uint8_t *fat, uint32_t cluster) {
+    uint32_t offset = cluster * 3 / 2;
+    uint16_t value = fat[offset] | (fat[offset + 1] << 8);
+    return (cluster & 0x01) ? value >> 4 : value & 0xFFF;
+}
+
+static void test_snapshot_large_file(void) {
+    static uint8_t buffer[512 * 2];
+    static char content[512 * 200];
+
+    setup();
+
+    memset(content, 'L', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_file(fs, "LARGE1.TXT", content);
+    create_file(fs, "LARGE2.TXT", content);
+    create_file(fs, "SMALL.TXT", "small\n");
+
+    snapshot_fat_init(&lfs_pico_flash_config);
+    snapshot_fat_create();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+
+    // Allocation table across the boundary of the first two sectors
+    msc_read10(USB_MSC_LUN_SNAPSHOT, 1, 0, buffer, sizeof(buffer));
+    for (uint32_t cluster = 2; cluster < 402; cluster++) {
+        uint16_t next = (cluster == 201 || cluster == 401) ? 0xFFF : cluster + 1;
+        assert(read_fat12(buffer, cluster) == next);
+    }
+    assert(read_fat12(buffer, 402) == 0xFFF);  // SMALL.TXT
+    assert(read_fat12(buffer, 403) == 0x000);
+
+    memset(buffer, 0, sizeof(buffer));
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 201, 0, buffer, sizeof(buffer));  // across LARGE1.TXT and LARGE2.TXT
+    assert(memcmp(buffer, content + 512 * 199, strlen(content) - 512 * 199) == 0);
+    assert(buffer[strlen(content) - 512 * 199] == 0);
+    assert(memcmp(buffer + 512, content, 512) == 0);
+
+    msc_read10(USB_MSC_LUN_SNAPSHOT, fat_sectors + 402, 0, buffer, 512);
+    assert(strcmp((const char *)buffer, "small\n") == 0);
+
+    cleanup();
+}
+
+void test_snapshot(void) {
+    printf("snapshot ...............");
+
+    test_snapshot_read();
+    test_snapshot_is_frozen();
+    test_snapshot_is_read_only();
+    test_snapshot_file_removed();
+    test_snapshot_keeps_pending_move();
+    test_snapshot_large_file();
+
+    printf("ok\n");
+}
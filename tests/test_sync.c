@@ -0,0 +1,102 @@
+#include "tests.h"
+
+
+extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
+extern int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize);
+
+static lfs_t fs;
+
+
+static void setup(void) {
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+}
+
+static void reload(void) {
+    lfs_unmount(&fs);
+    int err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+}
+
+static void cleanup(void) {
+    lfs_unmount(&fs);
+}
+
+static void test_mode_sense_caching_page(void) {
+    uint8_t buffer[64] = {0};
+
+    setup();
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint8_t mode_sense_10[16] = {0x5A, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, sizeof(buffer)};
+    int32_t length = tud_msc_scsi_cb(0, mode_sense_10, buffer, sizeof(buffer));
+    assert(length == 8 + 20);
+    assert(buffer[1] == 8 + 20 - 2);  // mode data length
+    assert((buffer[3] & 0x80) == 0);  // not write protected
+    assert(buffer[8] == 0x08);        // caching mode page
+    assert(buffer[9] == 20 - 2);
+    assert(buffer[10] & 0x04);        // write cache enabled
+
+    // allocation length is respected
+    mode_sense_10[8] = 8;
+    length = tud_msc_scsi_cb(0, mode_sense_10, buffer, sizeof(buffer));
+    assert(length == 8);
+
+    // unsupported mode page
+    mode_sense_10[2] = 0x1C;
+    mode_sense_10[8] = sizeof(buffer);
+    length = tud_msc_scsi_cb(0, mode_sense_10, buffer, sizeof(buffer));
+    assert(length < 0);
+
+    cleanup();
+}
+
+static void test_synchronize_cache(void) {
+    setup();
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    fat_dir_entry_t root[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "SYNCDIR    ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+    };
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));
+
+    mimic_fat_sync_stats_t before;
+    mimic_fat_sync_stats(&before);
+
+    uint8_t synchronize_cache_10[16] = {0x35};
+    int32_t length = tud_msc_scsi_cb(0, synchronize_cache_10, NULL, 0);
+    assert(length == 0);
+
+    mimic_fat_sync_stats_t after;
+    mimic_fat_sync_stats(&after);
+    assert(after.count == before.count + 1);
+    assert(after.total_us >= before.total_us);
+
+    reload();
+
+    struct lfs_info finfo;
+    int err = lfs_stat(&fs, "SYNCDIR", &finfo);
+    assert(err == LFS_ERR_OK);
+    assert(finfo.type == LFS_TYPE_DIR);
+
+    cleanup();
+}
+
+void test_sync(void) {
+    printf("sync   .................");
+
+    test_mode_sense_caching_page();
+    test_synchronize_cache();
+
+    printf("ok\n");
+}
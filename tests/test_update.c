@@ -2,7 +2,6 @@
 
 
 extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
-extern int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 static lfs_t fs;
 
@@ -17,6 +16,7 @@ static void setup(void) {
 }
 
 static void reload(void) {
+    mimic_fat_flush();
     lfs_unmount(&fs);
     int err = lfs_mount(&fs, &lfs_pico_flash_config);
     assert(err == 0);
@@ -43,26 +43,26 @@ static void test_update_file(void) {
     // write file blocks to unassigned clusters
     memset(buffer, 0, sizeof(buffer));
     strncpy(buffer, message, sizeof(buffer));
-    tud_msc_write10_cb(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));  // write to anonymous cache
+    msc_write10(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));  // write to anonymous cache
 
     // update File allocation table
     uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0xFF, 0x0F};  // With cluster 2 allocated
     update_fat(fat, cluster, 0xFFF);
-    tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat));  // update file allocated table
+    msc_write10(0, 1, 0, fat, sizeof(fat));  // update file allocated table
 
     // update dir entry. The cluster to which the file belongs is set to 0.
     fat_dir_entry_t root0[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "UPDATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root0, sizeof(root0));  // update root directory entry
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));  // update root directory entry
 
     // update dir entry. The clusters written in step 1 are specified.
     fat_dir_entry_t root1[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "UPDATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen(message)},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root1, sizeof(root1));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root1, sizeof(root1));  // update directory entry
 
     reload();
 
@@ -98,28 +98,28 @@ static void test_update_file_windows11(void) {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "UPDATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root0, sizeof(root0));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root0, sizeof(root0));  // update directory entry
 
     // update File allocation table
     uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0xFF, 0x0F};  // With cluster 2 allocated
     update_fat(fat, cluster, 0xFFF);
-    tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat));  // update file allocated table
+    msc_write10(0, 1, 0, fat, sizeof(fat));  // update file allocated table
 
     // update dir entry. The clusters written in step 2 are specified.
     fat_dir_entry_t root1[16] = {
         {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
         {.DIR_Name = "UPDATE  TXT", .DIR_Attr = 0x20, .DIR_FstClusLO = cluster, .DIR_FileSize = strlen(message)},
     };
-    tud_msc_write10_cb(0, root_dir_sector, 0, root1, sizeof(root1));  // update directory entry
+    msc_write10(0, root_dir_sector, 0, root1, sizeof(root1));  // update directory entry
 
     // write the file block to the cluster specified in step 3
     memset(buffer, 0, sizeof(buffer));
     strncpy(buffer, message, sizeof(buffer));
-    tud_msc_write10_cb(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));
+    msc_write10(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));
 
     // update File allocation table
     update_fat(fat, 2, 0x000);  // Release old allocated areas
-    tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat));  // update file allocated table
+    msc_write10(0, 1, 0, fat, sizeof(fat));  // update file allocated table
 
     reload();
 
@@ -135,11 +135,267 @@ static void test_update_file_windows11(void) {
     cleanup();
 }
 
+static void test_update_file_in_place(void) {
+    static char content[512 * 3 + 1];
+
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    memset(content, 'A', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_file(&fs, "INPLACE.TXT", content);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint16_t cluster = 2;
+    static uint8_t buffer[512];
+
+    // The host reads the file before overwriting it
+    msc_read10(0, fat_sectors + cluster + 1, 0, buffer, sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        assert(buffer[i] == 'A');
+
+    // Overwrite the allocated clusters of the file in sequence
+    for (int i = 0; i < 3; i++) {
+        memset(buffer, 'a' + i, sizeof(buffer));
+        msc_write10(0, fat_sectors + cluster + i, 0, buffer, sizeof(buffer));
+    }
+
+    // Reading back from the host sees the written data
+    msc_read10(0, fat_sectors + cluster + 1, 0, buffer, sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        assert(buffer[i] == 'b');
+
+    reload();
+
+    // Test reflection on the littlefs layer
+    lfs_file_t f;
+    err = lfs_file_open(&fs, &f, "INPLACE.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    assert(lfs_file_size(&fs, &f) == 512 * 3);
+    for (int i = 0; i < 3; i++) {
+        lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+        assert(size == sizeof(buffer));
+        for (size_t j = 0; j < sizeof(buffer); j++)
+            assert(buffer[j] == 'a' + i);
+    }
+    lfs_file_close(&fs, &f);
+
+    cleanup();
+}
+
+static void test_update_file_append(void) {
+    static char content[512 * 2 + 1];
+    static uint8_t buffer[512];
+
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    memset(content, 'A', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_file(&fs, "LOG.TXT", content);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t first_fat_sector = 1;
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    // write the appended block to an unassigned cluster
+    memset(buffer, 'B', sizeof(buffer));
+    msc_write10(0, fat_sectors + 4, 0, buffer, sizeof(buffer));
+
+    // extend the cluster chain 2 -> 3 -> 4
+    msc_read10(0, first_fat_sector, 0, buffer, sizeof(buffer));
+    update_fat(buffer, 3, 4);
+    update_fat(buffer, 4, 0xFFF);
+    msc_write10(0, first_fat_sector, 0, buffer, sizeof(buffer));
+
+    // update the file size in the dir entry
+    fat_dir_entry_t root[16];
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    assert(memcmp(root[1].DIR_Name, "LOG     TXT", 11) == 0);
+    assert(root[1].DIR_FstClusLO == 2);
+    root[1].DIR_FileSize = 512 * 3;
+    msc_write10(0, root_dir_sector, 0, root, sizeof(root));
+
+    reload();
+
+    // Test reflection on the littlefs layer
+    lfs_file_t f;
+    err = lfs_file_open(&fs, &f, "LOG.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    assert(lfs_file_size(&fs, &f) == 512 * 3);
+    for (int i = 0; i < 3; i++) {
+        lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+        assert(size == sizeof(buffer));
+        for (size_t j = 0; j < sizeof(buffer); j++)
+            assert(buffer[j] == (i < 2 ? 'A' : 'B'));
+    }
+    lfs_file_close(&fs, &f);
+
+    cleanup();
+}
+
+static void test_update_file_unchanged(void) {
+    static uint8_t buffer[512];
+    static uint8_t sector[512];
+
+    setup();
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t first_fat_sector = 1;
+    uint16_t cluster = 2;
+    mimic_fat_write_stats_t before, after;
+
+    // Writing back what was read does not reach littlefs
+    mimic_fat_write_stats(&before);
+    msc_read10(0, fat_sectors + cluster, 0, sector, sizeof(sector));
+    msc_write10(0, fat_sectors + cluster, 0, sector, sizeof(sector));
+    msc_read10(0, first_fat_sector, 0, buffer, sizeof(buffer));
+    msc_write10(0, first_fat_sector, 0, buffer, sizeof(buffer));
+    mimic_fat_write_stats(&after);
+    assert(after.count == before.count + 2);
+    assert(after.suppressed == before.suppressed + 2);
+
+    // A changed sector is written
+    memcpy(buffer, sector, sizeof(buffer));
+    buffer[0] = 'p';
+    msc_write10(0, fat_sectors + cluster, 0, buffer, sizeof(buffer));
+    mimic_fat_write_stats(&before);
+    assert(before.count == after.count + 1);
+    assert(before.suppressed == after.suppressed);
+
+    reload();
+
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "UPDATE.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == (lfs_ssize_t)strlen((const char *)sector));
+    assert(buffer[0] == 'p');
+    assert(memcmp(buffer + 1, sector + 1, size - 1) == 0);
+    lfs_file_close(&fs, &f);
+
+    cleanup();
+}
+
+static void test_update_file_unchanged_keeps_handles(void) {
+    static uint8_t buffer[512];
+    static uint8_t sector[512];
+    fat_dir_entry_t root[16];
+
+    setup();
+    create_file(&fs, "OTHER.TXT", "Please keep!\n");
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+    uint16_t update_cluster = 0;
+    uint16_t other_cluster = 0;
+    msc_read10(0, root_dir_sector, 0, root, sizeof(root));
+    for (int i = 0; i < 16; i++) {
+        if (memcmp(root[i].DIR_Name, "UPDATE  TXT", 11) == 0)
+            update_cluster = root[i].DIR_FstClusLO;
+        if (memcmp(root[i].DIR_Name, "OTHER   TXT", 11) == 0)
+            other_cluster = root[i].DIR_FstClusLO;
+    }
+    assert(update_cluster != 0 && other_cluster != 0);
+    mimic_fat_write_stats_t before, after;
+
+    // Comparing an unchanged sector does not close the write handle of another file
+    msc_read10(0, fat_sectors + other_cluster, 0, sector, sizeof(sector));
+    msc_read10(0, fat_sectors + update_cluster, 0, buffer, sizeof(buffer));
+    buffer[0] = 'p';
+    msc_write10(0, fat_sectors + update_cluster, 0, buffer, sizeof(buffer));
+    assert(!mimic_fat_is_idle());
+    mimic_fat_write_stats(&before);
+    msc_write10(0, fat_sectors + other_cluster, 0, sector, sizeof(sector));
+    mimic_fat_write_stats(&after);
+    assert(after.suppressed == before.suppressed + 1);
+    assert(!mimic_fat_is_idle());
+
+    reload();
+
+    lfs_file_t f;
+    int err = lfs_file_open(&fs, &f, "UPDATE.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == strlen("Please update!\n"));
+    assert(memcmp(buffer, "please update!\n", size) == 0);
+    lfs_file_close(&fs, &f);
+
+    cleanup();
+}
+
+static void test_update_file_multi_sector(void) {
+    static char content[512 * 4 + 1];
+    static uint8_t buffer[512 * 4];
+
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    memset(content, 'A', sizeof(content) - 1);
+    content[sizeof(content) - 1] = '\0';
+    create_file(&fs, "MULTI.TXT", content);
+
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size((const struct lfs_config *)&lfs_pico_flash_config);
+    uint16_t cluster = 2;
+    mimic_fat_write_stats_t before, after;
+
+    // The whole file in one read
+    mimic_fat_read(0, fat_sectors + cluster, buffer, sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        assert(buffer[i] == 'A');
+
+    // Overwrite all clusters in one write, leaving the second one unchanged
+    memset(buffer, 'a', 512);
+    memset(buffer + 512 * 2, 'c', 512 * 2);
+    mimic_fat_write_stats(&before);
+    mimic_fat_write(0, fat_sectors + cluster, buffer, sizeof(buffer));
+    mimic_fat_write_stats(&after);
+    assert(after.count == before.count + 4);
+    assert(after.suppressed == before.suppressed + 1);
+
+    reload();
+
+    lfs_file_t f;
+    err = lfs_file_open(&fs, &f, "MULTI.TXT", LFS_O_RDONLY);
+    assert(err == LFS_ERR_OK);
+    assert(lfs_file_size(&fs, &f) == 512 * 4);
+    lfs_ssize_t size = lfs_file_read(&fs, &f, buffer, sizeof(buffer));
+    assert(size == sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        assert(buffer[i] == "aAcc"[i / 512]);
+    lfs_file_close(&fs, &f);
+
+    cleanup();
+}
+
 void test_update(void) {
     printf("update .................");
 
     test_update_file();
     test_update_file_windows11();
+    test_update_file_in_place();
+    test_update_file_append();
+    test_update_file_unchanged();
+    test_update_file_unchanged_keeps_handles();
+    test_update_file_multi_sector();
 
     printf("ok\n");
 }
@@ -0,0 +1,111 @@
+#include "tests.h"
+#include "usb_msc_driver.h"
+
+
+extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
+extern int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize);
+
+static lfs_t fs;
+
+
+static void setup(void) {
+    int err = lfs_format(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+    err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+}
+
+static void reload(void) {
+    lfs_unmount(&fs);
+    int err = lfs_mount(&fs, &lfs_pico_flash_config);
+    assert(err == 0);
+}
+
+static void cleanup(void) {
+    lfs_unmount(&fs);
+}
+
+static void test_read_ahead(void) {
+    uint8_t buffer[512];
+
+    setup();
+    create_file(&fs, "READ.TXT", "Hello World!\n");
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t cluster = 2;
+
+    // Never busy, TinyUSB would retry it without returning to the main loop
+    memset(buffer, 0, sizeof(buffer));
+    assert(tud_msc_read10_cb(0, cluster + fat_sectors, 0, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(strcmp((const char *)buffer, "Hello World!\n") == 0);
+
+    // The next sector is read ahead by the main loop
+    assert(!usb_msc_driver_is_idle());
+    usb_msc_driver_task();
+    assert(usb_msc_driver_is_idle());
+    assert(tud_msc_read10_cb(0, cluster + fat_sectors + 1, 0, buffer, sizeof(buffer)) == sizeof(buffer));
+
+    // or by the callback if the main loop has not run
+    assert(tud_msc_read10_cb(0, cluster + fat_sectors + 2, 0, buffer, sizeof(buffer)) == sizeof(buffer));
+
+    // and dropped at the end of the command
+    assert(!usb_msc_driver_is_idle());
+    tud_msc_read10_complete_cb(0);
+    assert(usb_msc_driver_is_idle());
+
+    // Not ready while the application holds littlefs
+    mimic_fat_lock();
+    assert(tud_msc_read10_cb(0, cluster + fat_sectors, 0, buffer, sizeof(buffer)) < 0);
+    mimic_fat_unlock();
+    assert(usb_msc_driver_is_idle());
+
+    cleanup();
+}
+
+static void test_deferred_write(void) {
+    setup();
+    mimic_fat_init(&lfs_pico_flash_config);
+    mimic_fat_create_cache();
+
+    uint16_t fat_sectors = fat_sector_size(&lfs_pico_flash_config);
+    uint32_t root_dir_sector = fat_sectors + 1;
+
+    // Accepted at once and applied by the main loop
+    fat_dir_entry_t root[16] = {
+        {.DIR_Name = "littlefsUSB", .DIR_Attr = 0x08, .DIR_FstClusLO = 0, .DIR_FileSize = 0},
+        {.DIR_Name = "DIR        ", .DIR_Attr = 0x10, .DIR_FstClusLO = 2, .DIR_FileSize = 0},
+    };
+    uint8_t fat[512] = {0xF8, 0xFF, 0xFF, 0xFF, 0x0F};
+    assert(tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat)) == sizeof(fat));
+    assert(tud_msc_write10_cb(0, root_dir_sector, 0, (uint8_t *)root, sizeof(root)) == sizeof(root));
+    assert(!usb_msc_driver_is_idle());
+
+    // Still accepted while the queue is full, by applying the oldest write
+    for (size_t i = 2; i < USB_MSC_REQUEST_QUEUE_SIZE; i++)
+        assert(tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat)) == sizeof(fat));
+    assert(tud_msc_write10_cb(0, 1, 0, fat, sizeof(fat)) == sizeof(fat));
+
+    // SYNCHRONIZE CACHE applies the queued writes
+    uint8_t synchronize_cache_10[16] = {0x35};
+    assert(tud_msc_scsi_cb(0, synchronize_cache_10, NULL, 0) == 0);
+    assert(usb_msc_driver_is_idle());
+
+    reload();
+    struct lfs_info finfo;
+    int err = lfs_stat(&fs, "DIR", &finfo);
+    assert(err == LFS_ERR_OK);
+    assert(finfo.type == LFS_TYPE_DIR);
+
+    cleanup();
+}
+
+void test_usb_msc(void) {
+    printf("usb_msc ................");
+
+    test_read_ahead();
+    test_deferred_write();
+
+    printf("ok\n");
+}
@@ -20,6 +20,13 @@ void test_update(void);
 void test_rename(void);
 void test_move(void);
 void test_delete(void);
+void test_sync(void);
+void test_dir_entry_diff(void);
+void test_usb_msc(void);
+void test_snapshot(void);
+void test_notify(void);
+void test_pre_erase(void);
+void test_flash_stats(void);
 void test_large_file();
 
 void print_block(uint8_t *buffer, size_t l);
@@ -34,5 +41,11 @@ int dirent_cmp(fat_dir_entry_t *a, fat_dir_entry_t *b);
 int dirent_cmp_lfn(fat_dir_entry_t *a, fat_dir_entry_t *b);
 void set_long_filename_entry(fat_lfn_t *ent, uint8_t *name, uint8_t order);
 
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize);
+void tud_msc_read10_complete_cb(uint8_t lun);
+int32_t msc_read10(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+int32_t msc_write10(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize);
+
 #endif
 
@@ -1,5 +1,7 @@
 #include <math.h>
+#include <tusb.h>
 #include "tests.h"
+#include "usb_msc_driver.h"
 
 
 static const int FAT_SHORT_NAME_MAX = 11;
@@ -171,3 +173,39 @@ int dirent_cmp_lfn(fat_dir_entry_t *a, fat_dir_entry_t *b) {
     }
     return 0;
 }
+
+/*
+ * Issue READ10 as TinyUSB does: one endpoint buffer at a time. A busy callback
+ * would be retried from tud_task() without the main loop ever running again
+ */
+int32_t msc_read10(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize) {
+    uint8_t *p = buffer;
+    for (uint32_t done = 0; done < bufsize; ) {
+        uint32_t size = bufsize - done < CFG_TUD_MSC_EP_BUFSIZE ? bufsize - done : CFG_TUD_MSC_EP_BUFSIZE;
+        int32_t result = tud_msc_read10_cb(lun, lba + done / DISK_SECTOR_SIZE, offset, p + done, size);
+        assert(result != 0);
+        if (result < 0)
+            return result;
+        done += result;
+    }
+    tud_msc_read10_complete_cb(lun);
+    return bufsize;
+}
+
+/*
+ * Issue WRITE10 as TinyUSB does, then run the main loop until the data is applied
+ */
+int32_t msc_write10(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize) {
+    uint8_t *p = buffer;
+    for (uint32_t done = 0; done < bufsize; ) {
+        uint32_t size = bufsize - done < CFG_TUD_MSC_EP_BUFSIZE ? bufsize - done : CFG_TUD_MSC_EP_BUFSIZE;
+        int32_t result = tud_msc_write10_cb(lun, lba + done / DISK_SECTOR_SIZE, offset, p + done, size);
+        assert(result != 0);
+        if (result < 0)
+            return result;
+        done += result;
+    }
+    while (!usb_msc_driver_is_idle())
+        usb_msc_driver_task();
+    return bufsize;
+}
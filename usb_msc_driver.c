@@ -6,18 +6,184 @@
  */
 #include <tusb.h>
 #include "mimic_fat.h"
+#include "snapshot_fat.h"
+#include "usb_msc_driver.h"
 
 
 extern const struct lfs_config lfs_pico_flash_config;
+
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10  0x35
+#define SCSI_CMD_MODE_SENSE_10         0x5A
+
+#define SCSI_MODE_PAGE_CACHING         0x08
+#define SCSI_MODE_PAGE_ALL             0x3F
+#define SCSI_MODE_PAGE_CONTROL_CHANGEABLE  0x01
+
+typedef enum {
+    MSC_REQUEST_FREE = 0,
+    MSC_REQUEST_PENDING,  // waiting for usb_msc_driver_task()
+    MSC_REQUEST_DONE,     // read data ready for the next READ10 callback
+} msc_request_state_t;
+
+/*
+ * READ10 or WRITE10 of one TinyUSB endpoint buffer, carried out by usb_msc_driver_task()
+ * or by the callback itself when it is needed at once
+ */
+typedef struct {
+    msc_request_state_t state;
+    bool is_write;
+    uint8_t lun;
+    uint32_t lba;
+    uint32_t bufsize;
+    uint32_t sequence;
+    uint8_t buffer[CFG_TUD_MSC_EP_BUFSIZE];
+} msc_request_t;
+
+static msc_request_t msc_request[USB_MSC_REQUEST_QUEUE_SIZE];
+static uint32_t next_sequence = 0;
+
 static bool ejected = false;
-static bool is_initialized = false;
+static bool is_initialized[USB_MSC_LUN_NUM] = {false};
 
 
-void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]) {
-    (void)lun;
+static msc_request_t *find_request(uint8_t lun, uint32_t lba, uint32_t bufsize, bool is_write) {
+    for (size_t i = 0; i < USB_MSC_REQUEST_QUEUE_SIZE; i++) {
+        msc_request_t *request = &msc_request[i];
+        if (request->state != MSC_REQUEST_FREE && request->is_write == is_write
+            && request->lun == lun && request->lba == lba && request->bufsize == bufsize)
+        {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+static msc_request_t *enqueue_request(uint8_t lun, uint32_t lba, uint32_t bufsize, bool is_write) {
+    for (size_t i = 0; i < USB_MSC_REQUEST_QUEUE_SIZE; i++) {
+        msc_request_t *request = &msc_request[i];
+        if (request->state == MSC_REQUEST_FREE) {
+            request->state = MSC_REQUEST_PENDING;
+            request->is_write = is_write;
+            request->lun = lun;
+            request->lba = lba;
+            request->bufsize = bufsize;
+            request->sequence = next_sequence++;
+            return request;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Drop the reads, such as a read ahead the host did not ask for in the end
+ */
+static void discard_read_requests(void) {
+    for (size_t i = 0; i < USB_MSC_REQUEST_QUEUE_SIZE; i++) {
+        if (!msc_request[i].is_write)
+            msc_request[i].state = MSC_REQUEST_FREE;
+    }
+}
+
+static msc_request_t *oldest_pending_request(void) {
+    msc_request_t *oldest = NULL;
+    for (size_t i = 0; i < USB_MSC_REQUEST_QUEUE_SIZE; i++) {
+        msc_request_t *request = &msc_request[i];
+        if (request->state == MSC_REQUEST_PENDING
+            && (oldest == NULL || (int32_t)(request->sequence - oldest->sequence) < 0))
+        {
+            oldest = request;
+        }
+    }
+    return oldest;
+}
+
+/*
+ * Build the cache of the writable LUN, or take the snapshot of the read-only LUN,
+ * on the first read of the LUN
+ */
+static void initialize(uint8_t lun) {
+    if (lun == USB_MSC_LUN_SNAPSHOT) {
+        snapshot_fat_init(&lfs_pico_flash_config);
+        snapshot_fat_create();
+    } else {
+        mimic_fat_update_usb_device_is_enabled(true);
+        mimic_fat_create_cache();
+    }
+    is_initialized[lun] = true;
+}
+
+static size_t total_sector_size(uint8_t lun) {
+    if (lun == USB_MSC_LUN_SNAPSHOT)
+        return snapshot_fat_total_sector_size();
+    return mimic_fat_total_sector_size();
+}
+
+static void read_sector(uint8_t lun, uint32_t lba, void *buffer, uint32_t bufsize) {
+    if (lun == USB_MSC_LUN_SNAPSHOT)
+        snapshot_fat_read(lba, buffer, bufsize);
+    else
+        mimic_fat_read(lun, lba, buffer, bufsize);
+}
+
+/*
+ * Carry out the oldest queued request. Returns false if there was nothing to do
+ */
+static bool process_request(void) {
+    msc_request_t *request = oldest_pending_request();
+    if (request == NULL)
+        return false;
+    if (mimic_fat_is_locked())
+        return false;  // the application holds littlefs, shared by both LUNs
+    if (!request->is_write && !is_initialized[request->lun]) {
+        initialize(request->lun);
+        return true;
+    }
+
+    if (request->is_write) {
+        mimic_fat_write(request->lun, request->lba, request->buffer, request->bufsize);
+        request->state = MSC_REQUEST_FREE;
+    } else {
+        read_sector(request->lun, request->lba, request->buffer, request->bufsize);
+        request->state = MSC_REQUEST_DONE;
+    }
+    return true;
+}
+
+/*
+ * Apply all queued writes, before a flush or an eject
+ */
+static void drain_requests(void) {
+    discard_read_requests();
+    while (process_request())
+        ;
+}
+
+/*
+ * Carry out the queue up to and including the request, from within a callback.
+ * Returns false if the application holds littlefs
+ */
+static bool complete_request(msc_request_t *request) {
+    while (request->state == MSC_REQUEST_PENDING) {
+        if (!process_request())
+            return false;
+    }
+    return true;
+}
+
+static int32_t not_ready(uint8_t lun) {
+    // Set Sense = Logical Unit Not Ready, Operation In Progress
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x07);
+    return -1;
+}
+
 
+uint8_t tud_msc_get_maxlun_cb(void) {
+    return USB_MSC_LUN_NUM;
+}
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]) {
     const char vid[] = "littlefs";
-    const char pid[] = "Mass Storage";
+    const char *pid = lun == USB_MSC_LUN_SNAPSHOT ? "Snapshot" : "Mass Storage";
     const char rev[] = "1.0";
 
     memcpy(vendor_id  , vid, strlen(vid));
@@ -26,67 +192,203 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
 }
 
 bool tud_msc_test_unit_ready_cb(uint8_t lun) {
-    (void)lun;
+    if (lun == USB_MSC_LUN_MIMIC && mimic_fat_medium_changed()) {
+        // Not ready to ready change, medium may have changed
+        tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);
+        return false;
+    }
     return true;
 }
 
 void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size) {
-    (void)lun;
-
-    *block_count = mimic_fat_total_sector_size();
+    *block_count = total_sector_size(lun);
     *block_size  = DISK_SECTOR_SIZE;
 }
 
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
-    (void)lun;
     (void)power_condition;
 
     if (load_eject) {
         if (start) {
             // load disk storage
+        } else if (lun == USB_MSC_LUN_SNAPSHOT) {
+            // the next read takes a new snapshot
+            discard_read_requests();
+            snapshot_fat_release();
+            is_initialized[lun] = false;
         } else {
             // unload disk storage
+            drain_requests();
+            mimic_fat_flush();
             ejected = true;
         }
     }
     return true;
 }
 
+/*
+ * Carry out queued READ10/WRITE10 requests outside of the TinyUSB callbacks
+ *
+ * Call from the main loop after tud_task(). One request is processed per call,
+ * so that USB transfers are serviced in between.
+ */
+void usb_msc_driver_task(void) {
+    process_request();
+}
+
+bool usb_msc_driver_is_idle(void) {
+    return oldest_pending_request() == NULL;
+}
+
+/*
+ * READ10 never returns 0 (busy): without an RTOS, TinyUSB would retry the callback
+ * inside tud_task() and the main loop would never run again. A sector not read
+ * ahead by usb_msc_driver_task() is read here; the following sector is then queued
+ * to be read ahead while the current one is transferred.
+ */
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
-    (void)lun;
     (void)offset;
 
-    if (!is_initialized) {
-        mimic_fat_init(&lfs_pico_flash_config);
-        mimic_fat_update_usb_device_is_enabled(true);
-        mimic_fat_create_cache();
-        is_initialized = true;
+    if (bufsize > CFG_TUD_MSC_EP_BUFSIZE) {
+        drain_requests();
+        if (mimic_fat_is_locked())
+            return not_ready(lun);
+        if (!is_initialized[lun])
+            initialize(lun);
+        read_sector(lun, lba, buffer, bufsize);
+        return (int32_t)bufsize;
+    }
+
+    msc_request_t *request = find_request(lun, lba, bufsize, false);
+    if (request == NULL) {
+        discard_read_requests();
+        request = enqueue_request(lun, lba, bufsize, false);
+        if (request == NULL) {
+            drain_requests();  // the queue is full of writes
+            request = enqueue_request(lun, lba, bufsize, false);
+        }
+    }
+    if (request == NULL || !complete_request(request)) {
+        discard_read_requests();
+        return not_ready(lun);
     }
-    mimic_fat_read(lun, lba, buffer, bufsize);
 
+    memcpy(buffer, request->buffer, bufsize);
+    request->state = MSC_REQUEST_FREE;
+    uint32_t next_lba = lba + bufsize / DISK_SECTOR_SIZE;
+    if (next_lba < total_sector_size(lun))
+        enqueue_request(lun, next_lba, bufsize, false);
     return (int32_t)bufsize;
 }
 
+void tud_msc_read10_complete_cb(uint8_t lun) {
+    (void)lun;
+    discard_read_requests();
+}
+
 bool tud_msc_is_writable_cb (uint8_t lun) {
-    (void) lun;
-    return true;
+    return lun != USB_MSC_LUN_SNAPSHOT;
 }
 
+/*
+ * WRITE10 data is copied to the queue and accepted at once. While the queue is full
+ * the oldest write is applied here to make room, since returning 0 (busy) would
+ * spin in tud_task(). The write-back cache reported in the caching mode page covers
+ * the window until usb_msc_driver_task() has applied it.
+ */
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
     (void)offset;
 
-    mimic_fat_write(lun, lba, buffer, bufsize);
+    if (!tud_msc_is_writable_cb(lun)) {
+        // Set Sense = Write Protected
+        tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);
+        return -1;
+    }
+    discard_read_requests();
+    if (bufsize > CFG_TUD_MSC_EP_BUFSIZE) {
+        drain_requests();
+        if (mimic_fat_is_locked())
+            return not_ready(lun);
+        mimic_fat_write(lun, lba, buffer, bufsize);
+        return bufsize;
+    }
+
+    msc_request_t *request;
+    while ((request = enqueue_request(lun, lba, bufsize, true)) == NULL) {
+        if (!process_request())
+            return not_ready(lun);
+    }
+    memcpy(request->buffer, buffer, bufsize);
     return bufsize;
 }
 
+/*
+ * Build the caching mode page, reporting that the write-back cache is enabled.
+ *
+ * Hosts then issue SYNCHRONIZE CACHE before they consider the data safe,
+ * which gives a point to apply buffered writes to littlefs.
+ */
+static size_t mode_sense_caching_page(uint8_t *page, uint8_t page_control) {
+    memset(page, 0, 20);
+    page[0] = SCSI_MODE_PAGE_CACHING;
+    page[1] = 20 - 2;  // page length
+    if (page_control != SCSI_MODE_PAGE_CONTROL_CHANGEABLE)
+        page[2] = 0x04;  // WCE: write cache enabled, RCD: read cache enabled
+    return 20;
+}
+
+/*
+ * Build the MODE SENSE(10) parameter list. Returns its length, or -1 if the page
+ * is not supported
+ */
+static int32_t mode_sense_10(uint8_t lun, uint8_t const scsi_cmd[16], uint8_t *response) {
+    uint8_t page_control = scsi_cmd[2] >> 6;
+    uint8_t page_code = scsi_cmd[2] & 0x3F;
+    size_t length = 8;  // mode parameter header
+
+    if (page_code != SCSI_MODE_PAGE_CACHING && page_code != SCSI_MODE_PAGE_ALL)
+        return -1;
+
+    memset(response, 0, length);
+    length += mode_sense_caching_page(&response[length], page_control);
+
+    response[0] = (uint8_t)((length - 2) >> 8);
+    response[1] = (uint8_t)((length - 2) & 0xFF);
+    response[3] = tud_msc_is_writable_cb(lun) ? 0x00 : 0x80;  // WP
+    return (int32_t)length;
+}
+
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize) {
     void const *response = NULL;
     int32_t resplen = 0;
+    uint8_t mode_parameter[8 + 20];
+    uint16_t allocation_length;
 
     // most scsi handled is input
     bool in_xfer = true;
 
     switch (scsi_cmd[0]) {
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+        if (lun != USB_MSC_LUN_SNAPSHOT) {
+            drain_requests();
+            mimic_fat_flush();
+        }
+        resplen = 0;
+        break;
+    case SCSI_CMD_MODE_SENSE_10:
+        // NOTE: TinyUSB answers MODE SENSE(6) without mode pages by itself and
+        // never passes it here, so the caching page is reported by MODE SENSE(10) only.
+        resplen = mode_sense_10(lun, scsi_cmd, mode_parameter);
+        if (resplen < 0) {
+            // Set Sense = Invalid Field in CDB
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+            break;
+        }
+        allocation_length = ((uint16_t)scsi_cmd[7] << 8) | scsi_cmd[8];
+        if (resplen > allocation_length)
+            resplen = allocation_length;
+        response = mode_parameter;
+        break;
     default:
         // Set Sense = Invalid Command Operation
         tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
@@ -115,13 +417,18 @@ void tud_mount_cb(void) {
      * This callback must be returned immediately. Time-consuming processing
      * here will cause TinyUSB to PANIC `ep 0 in was already available`.
      */
-    is_initialized = false;
+    for (size_t i = 0; i < USB_MSC_LUN_NUM; i++)
+        is_initialized[i] = false;
+    discard_read_requests();
 }
 
 void tud_suspend_cb(bool remote_wakeup_en) {
     (void)remote_wakeup_en;
 
     printf("\e[45msuspend\e[0m\n");
+    drain_requests();
+    mimic_fat_flush();
     mimic_fat_cleanup_cache();
     mimic_fat_update_usb_device_is_enabled(false);
+    snapshot_fat_release();
 }